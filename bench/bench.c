@@ -0,0 +1,463 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "xmlc.h"
+
+/*
+ * gx2 benchmark suite
+ *
+ * Generates synthetic documents in memory and times parse, parse_inplace,
+ * parse_skip (parse with config.skip leaving out the repeated element),
+ * parse_records (the repeated element handed over one at a time with
+ * config.record), select_nodes, print, xw_write (the tree written out
+ * through the streaming writer), xml_clone, normalize and destroy_node
+ * over each of them. Results are written as JSON, one record per corpus
+ * and operation.
+ *
+ * usage: xmlc_bench [-s size_kb] [-t seconds] [-c corpus] [-o results.json]
+ *   -s  approximate size of each generated document (default 1024 KB)
+ *   -t  minimum time spent per corpus (default 1 second)
+ *   -c  only run the named corpus
+ *   -o  write results to a file instead of stdout
+ */
+
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define MIN_REPS 3
+
+/* Growable string for building corpora */
+typedef struct strbuf_t {
+    char * buf;
+    size_t len;
+    size_t size;
+} strbuf;
+
+static void sb_append(strbuf * sb, const char * s, size_t n) {
+    if(sb->len + n + 1 > sb->size) {
+        size_t size = sb->size ? sb->size : 4096;
+        while(sb->len + n + 1 > size) {
+            size *= 2;
+        }
+        sb->buf = (char *)realloc(sb->buf, size);
+        if(!sb->buf) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        sb->size = size;
+    }
+
+    memcpy(&sb->buf[sb->len], s, n);
+    sb->len += n;
+    sb->buf[sb->len] = 0;
+}
+
+static void sb_puts(strbuf * sb, const char * s) {
+    sb_append(sb, s, strlen(s));
+}
+
+static void sb_printf(strbuf * sb, const char * fmt, int a, int b) {
+    char line[256];
+    int n = snprintf(line, sizeof(line), fmt, a, b);
+    sb_append(sb, line, n);
+}
+
+/* Corpora. Each generator writes roughly size bytes */
+
+static void gen_flat(strbuf * sb, size_t size) {
+    int i = 0;
+    sb_puts(sb, "<root>\n");
+    while(sb->len < size) {
+        sb_printf(sb, "  <item id=\"%d\">value %d</item>\n", i, i);
+        i++;
+    }
+    sb_puts(sb, "</root>\n");
+}
+
+static void gen_deep(strbuf * sb, size_t size) {
+    int depth = 256;
+    int i;
+    sb_puts(sb, "<root>");
+    while(sb->len < size) {
+        for(i = 0; i < depth; i++) {
+            sb_puts(sb, "<n>");
+        }
+        sb_puts(sb, "leaf");
+        for(i = 0; i < depth; i++) {
+            sb_puts(sb, "</n>");
+        }
+    }
+    sb_puts(sb, "</root>\n");
+}
+
+static void gen_attrs(strbuf * sb, size_t size) {
+    int i = 0, j;
+    sb_puts(sb, "<root>\n");
+    while(sb->len < size) {
+        sb_puts(sb, "  <rec");
+        for(j = 0; j < 16; j++) {
+            sb_printf(sb, " a%d=\"value-%d\"", j, i + j);
+        }
+        sb_puts(sb, "/>\n");
+        i++;
+    }
+    sb_puts(sb, "</root>\n");
+}
+
+static void gen_text(strbuf * sb, size_t size) {
+    static const char * words =
+        "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+        "eiusmod tempor incididunt ut labore et dolore magna aliqua. ";
+    int i;
+    sb_puts(sb, "<root>\n");
+    while(sb->len < size) {
+        sb_puts(sb, "  <p>");
+        for(i = 0; i < 32; i++) {
+            sb_puts(sb, words);
+        }
+        sb_puts(sb, "</p>\n");
+    }
+    sb_puts(sb, "</root>\n");
+}
+
+static void gen_entities(strbuf * sb, size_t size) {
+    int i;
+    sb_puts(sb, "<root>\n");
+    while(sb->len < size) {
+        sb_puts(sb, "  <e>");
+        for(i = 0; i < 16; i++) {
+            sb_puts(sb, "a &lt; b &amp;&amp; c &gt; d &quot;e&quot; &apos;f&apos; ");
+        }
+        sb_puts(sb, "</e>\n");
+    }
+    sb_puts(sb, "</root>\n");
+}
+
+static void gen_cdata(strbuf * sb, size_t size) {
+    int i;
+    sb_puts(sb, "<root>\n");
+    while(sb->len < size) {
+        sb_puts(sb, "  <d><![CDATA[");
+        for(i = 0; i < 64; i++) {
+            sb_puts(sb, "if (a < b && c > d) { x = \"y\"; } ");
+        }
+        sb_puts(sb, "]]></d>\n");
+    }
+    sb_puts(sb, "</root>\n");
+}
+
+/* text split into fragments by comments and CDATA, for normalize */
+static void gen_fragments(strbuf * sb, size_t size) {
+    int i;
+    sb_puts(sb, "<root>\n");
+    while(sb->len < size) {
+        sb_puts(sb, "  <f>");
+        for(i = 0; i < 64; i++) {
+            sb_puts(sb, "some text<!-- note --> more text<![CDATA[ & raw ]]>");
+        }
+        sb_puts(sb, "</f>\n");
+    }
+    sb_puts(sb, "</root>\n");
+}
+
+typedef struct corpus_t {
+    const char * name;
+    void (*generate)(strbuf * sb, size_t size);
+    const char * xpath;    /* query timed by select_nodes */
+    const char * skip;     /* element parse_skip leaves out, and
+                              parse_records streams */
+} corpus;
+
+static const corpus corpora[] = {
+    { "flat",      gen_flat,       "/root/item",    "item" },
+    { "deep",      gen_deep,       "/root/n/n/n/n", "n" },
+    { "attrs",     gen_attrs,      "/root/rec/@a7", "rec" },
+    { "text",      gen_text,       "/root/p",       "p" },
+    { "entities",  gen_entities,   "/root/e",       "e" },
+    { "cdata",     gen_cdata,      "/root/d",       "d" },
+    { "fragments", gen_fragments,  "/root/f",       "f" },
+};
+
+enum { OP_PARSE = 0, OP_INPLACE, OP_SKIP, OP_RECORDS, OP_SELECT, OP_PRINT,
+       OP_WRITE, OP_CLONE, OP_NORMALIZE, OP_DESTROY, OP_COUNT };
+
+static const char * op_names[OP_COUNT] = {
+    "parse", "parse_inplace", "parse_skip", "parse_records", "select_nodes",
+    "print", "xw_write", "xml_clone", "normalize", "destroy_node"
+};
+
+typedef struct timing_t {
+    double best;    /* ns */
+    double total;   /* ns */
+    int reps;
+} timing;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void record(timing * t, double ns) {
+    if(t->reps == 0 || ns < t->best) {
+        t->best = ns;
+    }
+    t->total += ns;
+    t->reps++;
+}
+
+/* parse_records callback, counts the records */
+static int on_record(void * ctx, xml_node * node) {
+    (void)node;
+    (*(long *)ctx)++;
+    return 0;
+}
+
+/* xw_write, a tree through the streaming writer */
+static void write_tree(xml_writer * w, xml_node * node) {
+    for(; node; node = node->sibling) {
+        xml_attribute * a;
+
+        if(node->type == ELEMENT) {
+            xw_start_element(w, node->name);
+            for(a = node->attributes; a; a = a->next) {
+                xw_attribute(w, a->name, a->value);
+            }
+            write_tree(w, node->child);
+            xw_end_element(w);
+        } else if(node->type == TEXT) {
+            xw_text(w, node->text);
+        } else if(node->type == DOCUMENT) {
+            write_tree(w, node->child);
+        }
+    }
+}
+
+static long count_nodes(xml_node * node) {
+    long n = 0;
+    for(; node; node = node->sibling) {
+        n += 1 + count_nodes(node->child);
+    }
+    return n;
+}
+
+static int run_corpus(const corpus * c, size_t size, double seconds,
+                      FILE * devnull, FILE * out, int first) {
+    strbuf sb = { NULL, 0, 0 };
+    char * scratch;
+    timing t[OP_COUNT];
+    config_t config;
+    config_t skipconfig;
+    config_t recordconfig;
+    const char * skip[2];
+    long records = 0;
+    long nodes = 0;
+    double start;
+    int op;
+
+    memset(t, 0, sizeof(t));
+    memset(&config, 0, sizeof(config));
+
+    c->generate(&sb, size);
+
+    skip[0] = c->skip;
+    skip[1] = NULL;
+    skipconfig = config;
+    skipconfig.skip = skip;
+    recordconfig = config;
+    recordconfig.record = c->skip;
+    recordconfig.on_record = on_record;
+    recordconfig.recordctx = &records;
+
+    /* parse_inplace consumes its input, it gets a fresh copy each time */
+    scratch = (char *)malloc(sb.len);
+    if(!scratch) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    start = now_ns();
+    while(t[OP_PARSE].reps < MIN_REPS || now_ns() - start < seconds * 1e9) {
+        xml_element * root = NULL;
+        xml_element * inplace = NULL;
+        xml_element * skipped = NULL;
+        xml_element * streamed = NULL;
+        xml_node * clone;
+        xml_writer * writer;
+        xml_node ** result;
+        int count = 0;
+        double t0;
+        int ret;
+
+        t0 = now_ns();
+        ret = parse_buffer(sb.buf, (int)sb.len, &root, config);
+        record(&t[OP_PARSE], now_ns() - t0);
+
+        if(ret < 0 || !root) {
+            fprintf(stderr, "%s: parse failed (%d)\n", c->name, ret);
+            free(sb.buf);
+            free(scratch);
+            return ret;
+        }
+
+        memcpy(scratch, sb.buf, sb.len);
+        t0 = now_ns();
+        ret = parse_inplace(scratch, (int)sb.len, &inplace, config);
+        record(&t[OP_INPLACE], now_ns() - t0);
+        destroy_node(inplace);
+
+        if(ret < 0) {
+            fprintf(stderr, "%s: parse_inplace failed (%d)\n", c->name, ret);
+            free(sb.buf);
+            free(scratch);
+            return ret;
+        }
+
+        t0 = now_ns();
+        ret = parse_buffer(sb.buf, (int)sb.len, &skipped, skipconfig);
+        record(&t[OP_SKIP], now_ns() - t0);
+        destroy_node(skipped);
+
+        if(ret < 0) {
+            fprintf(stderr, "%s: parse_skip failed (%d)\n", c->name, ret);
+            free(sb.buf);
+            free(scratch);
+            return ret;
+        }
+
+        t0 = now_ns();
+        ret = parse_buffer(sb.buf, (int)sb.len, &streamed, recordconfig);
+        record(&t[OP_RECORDS], now_ns() - t0);
+        destroy_node(streamed);
+
+        if(ret < 0 || !records) {
+            fprintf(stderr, "%s: parse_records failed (%d)\n", c->name, ret);
+            free(sb.buf);
+            free(scratch);
+            return ret < 0 ? ret : -1;
+        }
+
+        if(!nodes) {
+            nodes = count_nodes(root);
+        }
+
+        t0 = now_ns();
+        result = select_nodes(root, &count, (char *)c->xpath);
+        record(&t[OP_SELECT], now_ns() - t0);
+        xml_free(result);
+
+        t0 = now_ns();
+        print(root, devnull, 0);
+        record(&t[OP_PRINT], now_ns() - t0);
+
+        t0 = now_ns();
+        writer = xw_create(file_write, devnull);
+        write_tree(writer, root);
+        xw_close(writer);
+        record(&t[OP_WRITE], now_ns() - t0);
+
+        t0 = now_ns();
+        clone = xml_clone(root);
+        record(&t[OP_CLONE], now_ns() - t0);
+        destroy_node(clone);
+
+        t0 = now_ns();
+        normalize(root);
+        record(&t[OP_NORMALIZE], now_ns() - t0);
+
+        t0 = now_ns();
+        destroy_node(root);
+        record(&t[OP_DESTROY], now_ns() - t0);
+    }
+
+    for(op = 0; op < OP_COUNT; op++) {
+        double mbps = sb.len / (t[op].best / 1e9) / 1e6;
+
+        fprintf(out, "%s    {\"corpus\": \"%s\", \"op\": \"%s\", \"bytes\": %lu, "
+                "\"nodes\": %ld, \"reps\": %d, \"best_ns\": %.0f, \"mean_ns\": %.0f, "
+                "\"mb_per_s\": %.2f, \"ns_per_node\": %.2f}",
+                (first && op == 0) ? "" : ",\n",
+                c->name, op_names[op], (unsigned long)sb.len, nodes, t[op].reps,
+                t[op].best, t[op].total / t[op].reps, mbps, t[op].best / nodes);
+
+        fprintf(stderr, "%-9s %-13s %10.2f MB/s %10.2f ns/node\n",
+                c->name, op_names[op], mbps, t[op].best / nodes);
+    }
+
+    free(sb.buf);
+    free(scratch);
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    size_t size = 1024 * 1024;
+    double seconds = 1.0;
+    const char * only = NULL;
+    const char * output = NULL;
+    FILE * out = stdout;
+    FILE * devnull;
+    int first = 1;
+    int ret = 0;
+    int i;
+
+    for(i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-s") && i + 1 < argc) {
+            size = (size_t)atol(argv[++i]) * 1024;
+        } else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        } else if(!strcmp(argv[i], "-c") && i + 1 < argc) {
+            only = argv[++i];
+        } else if(!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [-s size_kb] [-t seconds] "
+                    "[-c corpus] [-o results.json]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    devnull = fopen(NULL_DEVICE, "w");
+    if(!devnull) {
+        perror(NULL_DEVICE);
+        return 1;
+    }
+
+    if(output) {
+        out = fopen(output, "w");
+        if(!out) {
+            perror(output);
+            return 1;
+        }
+    }
+
+    fprintf(out, "{\"suite\": \"xmlc\", \"size_bytes\": %lu, \"results\": [\n",
+            (unsigned long)size);
+
+    for(i = 0; i < (int)(sizeof(corpora) / sizeof(corpora[0])); i++) {
+        if(only && strcmp(only, corpora[i].name)) {
+            continue;
+        }
+
+        if(run_corpus(&corpora[i], size, seconds, devnull, out, first) < 0) {
+            ret = 1;
+        } else {
+            first = 0;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+
+    if(out != stdout) {
+        fclose(out);
+    }
+    fclose(devnull);
+
+    return ret;
+}
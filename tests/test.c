@@ -0,0 +1,1037 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "xmlc.h"
+
+/*
+ * gx2 tests
+ *
+ * Round trips: a document is parsed, written back out through the
+ * streaming writer and compared with what is expected, then the output
+ * is parsed again and must hash the same as the first tree. Then the
+ * config limits, each just under and just over, and one case per
+ * feature, checked against a plain parse or select_nodes. Run by ctest;
+ * exits non zero if any check fails.
+ */
+
+static int failures;
+
+#define CHECK(cond) \
+    if(!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; }
+
+/* Output of the writer, kept in memory */
+typedef struct strbuf_t {
+    char buf[4096];
+    int len;
+} strbuf;
+
+static int sb_write(void * ctx, const char * buf, int len) {
+    strbuf * sb = (strbuf *)ctx;
+
+    if(sb->len + len >= (int)sizeof(sb->buf)) {
+        return -1;
+    }
+    memcpy(&sb->buf[sb->len], buf, len);
+    sb->len += len;
+    sb->buf[sb->len] = 0;
+    return len;
+}
+
+static void write_tree(xml_writer * w, xml_node * node) {
+    for(; node; node = node->sibling) {
+        xml_attribute * a;
+
+        if(node->type == ELEMENT) {
+            xw_start_element(w, node->name);
+            for(a = node->attributes; a; a = a->next) {
+                xw_attribute(w, a->name, a->value);
+            }
+            write_tree(w, node->child);
+            xw_end_element(w);
+        } else if(node->type == TEXT) {
+            xw_text(w, node->text);
+        }
+    }
+}
+
+/* the document element, past any DOCTYPE */
+static xml_node * document_element(xml_node * document) {
+    xml_node * n = document ? document->child : NULL;
+
+    while(n && n->type != ELEMENT) {
+        n = n->sibling;
+    }
+    return n;
+}
+
+static int parse_string(const char * doc, xml_element ** root, config_t config) {
+    char buf[4096];
+    int len = (int)strlen(doc);
+
+    memcpy(buf, doc, len + 1);
+    return parse_buffer(buf, len, root, config);
+}
+
+/* doc parses, writes out as expected, and reads back the same */
+static void round_trip(const char * doc, const char * expected) {
+    xml_element * root = NULL;
+    xml_element * again = NULL;
+    xml_writer * w;
+    strbuf out;
+    config_t config;
+    int ret;
+
+    memset(&config, 0, sizeof(config));
+    ret = parse_string(doc, &root, config);
+    CHECK(ret == 0)
+    if(ret < 0) {
+        fprintf(stderr, "  %s: %s\n", doc, xml_strerror(ret));
+        destroy_node(root);
+        return;
+    }
+
+    out.len = 0;
+    out.buf[0] = 0;
+    w = xw_create(sb_write, &out);
+    write_tree(w, document_element(root));
+    CHECK(xw_close(w) == 0)
+    CHECK(!strcmp(out.buf, expected))
+    if(strcmp(out.buf, expected)) {
+        fprintf(stderr, "  %s\n  wrote    %s\n  expected %s\n", doc, out.buf, expected);
+    }
+
+    CHECK(parse_string(out.buf, &again, config) == 0)
+    CHECK(xml_hash(document_element(root)) == xml_hash(document_element(again)))
+
+    destroy_node(root);
+    destroy_node(again);
+}
+
+static void test_names(void) {
+    xml_element * root = NULL;
+    config_t config;
+
+    round_trip("<café><naïve été=\"ü\">x</naïve></café>",
+               "<café><naïve été=\"ü\">x</naïve></café>");
+    round_trip("<данные><элемент/></данные>",
+               "<данные><элемент/></данные>");
+    round_trip("<名前 属性=\"値\">テキスト</名前>",
+               "<名前 属性=\"値\">テキスト</名前>");
+
+    /* end tags are compared byte for byte, bytes over 0x7f included */
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<café></cafè>", &root, config) == ENDTAGMISMATCH)
+    destroy_node(root);
+    root = NULL;
+    CHECK(parse_string("<é></e>", &root, config) == ENDTAGMISMATCH)
+    destroy_node(root);
+}
+
+static void test_entities(void) {
+    xml_element * root = NULL;
+    config_t config;
+
+    round_trip("<a>&lt;&gt;&amp;&quot;&apos;</a>",
+               "<a>&lt;&gt;&amp;&quot;&apos;</a>");
+    round_trip("<a x=\"&lt;&amp;&quot;\">&#65;&#x42;</a>",
+               "<a x=\"&lt;&amp;&quot;\">AB</a>");
+    round_trip("<!DOCTYPE a [<!ENTITY e \"hello\">]><a x=\"&e;\">&e; &amp; &e;</a>",
+               "<a x=\"hello\">hello &amp; hello</a>");
+    round_trip("<!DOCTYPE a [<!ENTITY in \"é\"><!ENTITY out \"[&in;]\">]><a>&out;</a>",
+               "<a>[é]</a>");
+
+    /* expansion that grows without end is stopped */
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<!DOCTYPE a [<!ENTITY a \"&b;\"><!ENTITY b \"&a;\">]><a>&a;</a>",
+                       &root, config) == ENTITYLIMIT)
+    destroy_node(root);
+    root = NULL;
+    CHECK(parse_string("<!DOCTYPE a [<!ENTITY a \"aaaaaaaaaaaaaaaa\">"
+                       "<!ENTITY b \"&a;&a;&a;&a;&a;&a;&a;&a;&a;&a;&a;&a;&a;&a;&a;&a;\">"
+                       "<!ENTITY c \"&b;&b;&b;&b;&b;&b;&b;&b;&b;&b;&b;&b;&b;&b;&b;&b;\">"
+                       "<!ENTITY d \"&c;&c;&c;&c;&c;&c;&c;&c;&c;&c;&c;&c;&c;&c;&c;&c;\">"
+                       "<!ENTITY e \"&d;&d;&d;&d;&d;&d;&d;&d;&d;&d;&d;&d;&d;&d;&d;&d;\">"
+                       "<!ENTITY f \"&e;&e;&e;&e;&e;&e;&e;&e;&e;&e;&e;&e;&e;&e;&e;&e;\">]>"
+                       "<a>&f;&f;&f;&f;&f;&f;&f;&f;&f;&f;&f;&f;&f;&f;&f;&f;</a>",
+                       &root, config) == ENTITYLIMIT)
+    destroy_node(root);
+}
+
+/* doc parses under config with the code given */
+static void limit(const char * doc, config_t config, int code) {
+    xml_element * root = NULL;
+    xml_error error;
+    int ret;
+
+    config.error = &error;
+    ret = parse_string(doc, &root, config);
+    CHECK(ret == code)
+    if(ret != code) {
+        fprintf(stderr, "  %s: %d, expected %d\n", doc, ret, code);
+    }
+    CHECK(error.code == (code < 0 ? code : 0))
+    destroy_node(root);
+}
+
+static void test_limits(void) {
+    config_t config;
+    char text[200];
+
+    memset(&config, 0, sizeof(config));
+    config.max_depth = 3;
+    limit("<a><b><c/></b></a>", config, 0);
+    limit("<a><b><c><d/></c></b></a>", config, DEPTHLIMIT);
+
+    memset(&config, 0, sizeof(config));
+    config.max_nodes = 3;
+    limit("<a><b/>t</a>", config, 0);
+    limit("<a><b/>t<c/></a>", config, NODELIMIT);
+
+    memset(&config, 0, sizeof(config));
+    config.max_attributes = 2;
+    limit("<a x=\"1\" y=\"2\"><b z=\"3\" w=\"4\"/></a>", config, 0);
+    limit("<a x=\"1\" y=\"2\" z=\"3\"/>", config, ATTRIBUTELIMIT);
+
+    memset(&config, 0, sizeof(config));
+    config.max_name = 4;     /* bytes, a multibyte name counts each */
+    limit("<abcd efgh=\"1\"/>", config, 0);
+    limit("<abcde/>", config, NAMELIMIT);
+    limit("<a bcdef=\"1\"/>", config, NAMELIMIT);
+    limit("<éé/>", config, 0);
+    limit("<ééé/>", config, NAMELIMIT);
+
+    memset(&config, 0, sizeof(config));
+    config.max_text = 8;
+    limit("<a x=\"12345678\">12345678</a>", config, 0);
+    limit("<a>123456789</a>", config, TEXTLIMIT);
+    limit("<a x=\"123456789\"/>", config, TEXTLIMIT);
+    limit("<a><![CDATA[123456789]]></a>", config, TEXTLIMIT);
+
+    memset(&config, 0, sizeof(config));
+    config.max_bytes = 4096;
+    limit("<a><b>t</b></a>", config, 0);
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    {
+        char doc[4000];
+        int i;
+
+        strcpy(doc, "<a>");
+        for(i = 0; i < 18; i++) {
+            strcat(doc, "<b>");
+            strcat(doc, text);
+            strcat(doc, "</b>");
+        }
+        strcat(doc, "</a>");
+        limit(doc, config, MEMORYLIMIT);
+    }
+}
+
+/* a second parse of the same bytes is a hit, handing out the same tree */
+static void test_cache(void) {
+    const char * doc = "<conf><port>80</port><host name=\"a\"/></conf>";
+    xml_element * plain = NULL;
+    xml_element * first = NULL;
+    xml_element * second = NULL;
+    xml_cache_stats stats;
+    xml_cache * cache;
+    config_t config;
+    char buf[256];
+
+    memset(&config, 0, sizeof(config));
+    cache = xml_cache_create(1 << 20, config);
+    CHECK(cache != NULL)
+
+    strcpy(buf, doc);
+    CHECK(xml_cache_parse_buffer(cache, buf, (int)strlen(buf), &first) == 0)
+    strcpy(buf, doc);
+    CHECK(xml_cache_parse_buffer(cache, buf, (int)strlen(buf), &second) == 0)
+    CHECK(first != NULL && first == second)
+
+    CHECK(parse_string(doc, &plain, config) == 0)
+    CHECK(xml_equal(first, plain))
+
+    xml_cache_get_stats(cache, &stats);
+    CHECK(stats.hits == 1 && stats.misses == 1 && stats.entries == 1)
+
+    xml_release(first);
+    xml_release(second);
+    xml_cache_destroy(cache);
+    destroy_node(plain);
+}
+
+/* parsed in place, the tree is the one parse_buffer makes */
+static void test_inplace(void) {
+    const char * docs[] = {
+        "<a x=\"1\" y='two'><b>text</b><c/>tail</a>",
+        "<a x=\"&lt;&amp;\">&lt;b&gt; &#65;\r\nline</a>",
+        "<a q=\"say &quot;hi&quot;\">it&apos;s</a>",
+        NULL
+    };
+    int i;
+
+    for(i = 0; docs[i]; i++) {
+        xml_element * plain = NULL;
+        xml_element * inplace = NULL;
+        config_t config;
+        char buf[256];
+
+        memset(&config, 0, sizeof(config));
+        CHECK(parse_string(docs[i], &plain, config) == 0)
+        strcpy(buf, docs[i]);
+        CHECK(parse_inplace(buf, (int)strlen(buf), &inplace, config) == 0)
+        CHECK(xml_equal(document_element(plain), document_element(inplace)))
+        destroy_node(inplace);
+        destroy_node(plain);
+    }
+}
+
+/* the count select_nodes gives for xpath */
+static int count_nodes(xml_node * node, const char * xpath) {
+    char path[256];
+    xml_node ** nodes;
+    int count = 0;
+
+    strcpy(path, xpath);
+    nodes = select_nodes(node, &count, path);
+    xml_free(nodes);
+    return count;
+}
+
+/* prefixes resolve to interned names, and {uri}local steps select them */
+static void test_namespaces(void) {
+    xml_element * root = NULL;
+    xml_node * item;
+    config_t config;
+
+    memset(&config, 0, sizeof(config));
+    config.namespaces = 1;
+    CHECK(parse_string("<r xmlns=\"urn:d\" xmlns:b=\"urn:b\">"
+                       "<item id=\"1\"/><b:item b:id=\"2\"/><b:other/></r>",
+                       &root, config) == 0)
+
+    item = document_element(root)->child;
+    CHECK(item->ns == xml_intern("urn:d"))
+    CHECK(item->localname == xml_intern("item"))
+    CHECK(item->sibling->ns == xml_intern("urn:b"))
+    CHECK(find_attribute_ns(item->sibling, xml_intern("urn:b"), xml_intern("id")) != NULL)
+    CHECK(find_attribute_ns(item, NULL, xml_intern("id")) != NULL)
+
+    CHECK(count_nodes(root, "/r/item") == 2)
+    CHECK(count_nodes(root, "/r/b:item") == 1)
+    CHECK(count_nodes(root, "/r/{urn:b}item") == 1)
+    CHECK(count_nodes(root, "/r/{urn:d}item") == 1)
+    CHECK(count_nodes(root, "/{urn:d}r/{urn:b}other") == 1)
+    CHECK(count_nodes(root, "/r/{urn:none}item") == 0)
+    CHECK(count_nodes(root, "/r/{}item") == 0)
+    destroy_node(root);
+
+    root = NULL;
+    CHECK(parse_string("<r><x:a/></r>", &root, config) == NAMESPACEERROR)
+    destroy_node(root);
+    xml_intern_reset();
+}
+
+/* skipped elements leave the tree a document without them parses to */
+static void test_skip(void) {
+    const char * skip[] = { "audit", "/doc/history", NULL };
+    xml_element * skipped = NULL;
+    xml_element * plain = NULL;
+    config_t config;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<doc><a>1</a><b/><c>3</c></doc>", &plain, config) == 0)
+
+    config.skip = skip;
+    CHECK(parse_string("<doc><a>1</a><audit x=\"&bogus;\"><audit/>t</audit>"
+                       "<b/><history><h/></history><c>3</c></doc>",
+                       &skipped, config) == 0)
+    CHECK(xml_equal(document_element(plain), document_element(skipped)))
+
+    /* only /doc/history, not one further down */
+    destroy_node(skipped);
+    skipped = NULL;
+    CHECK(parse_string("<doc><a><history/></a></doc>", &skipped, config) == 0)
+    CHECK(count_nodes(skipped, "/doc/a/history") == 1)
+    destroy_node(skipped);
+
+    /* the content must still balance */
+    skipped = NULL;
+    CHECK(parse_string("<doc><audit><x></audit></doc>", &skipped, config) < 0)
+    destroy_node(skipped);
+    destroy_node(plain);
+}
+
+/* replaces removed bytes at start of doc with insert, updates the tree
+   with parse_edit and compares it with a parse of the new text */
+static void edit(const char * doc, int start, int removed, const char * insert) {
+    xml_element * root = NULL;
+    xml_element * fresh = NULL;
+    config_t config;
+    char buf[512];
+    int inserted = (int)strlen(insert);
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string(doc, &root, config) == 0)
+
+    memcpy(buf, doc, start);
+    memcpy(&buf[start], insert, inserted);
+    strcpy(&buf[start + inserted], &doc[start + removed]);
+
+    CHECK(parse_string(buf, &fresh, config) == 0)
+    CHECK(parse_edit(&root, buf, (int)strlen(buf), start, removed, inserted,
+                     config) == 0)
+    CHECK(xml_equal(root, fresh))
+    if(!xml_equal(root, fresh)) {
+        fprintf(stderr, "  %s, edited to %s\n", doc, buf);
+    }
+
+    destroy_node(root);
+    destroy_node(fresh);
+}
+
+static void test_edit(void) {
+    const char * doc = "<r><a x=\"1\">one</a><b><c>two</c></b><d/></r>";
+
+    edit(doc, 12, 3, "three");            /* text in <a> */
+    edit(doc, 9, 1, "9");                 /* an attribute value */
+    edit(doc, 25, 3, "2<e/>");            /* an element added in <c> */
+    edit(doc, 36, 0, "<f>new</f>");       /* a sibling between </b> and <d/> */
+    edit(doc, 3, 16, "");                 /* <a> removed */
+}
+
+/* a patched with diff(a, b) is b */
+static void diff_patch(const char * from, const char * to) {
+    xml_element * a = NULL;
+    xml_element * b = NULL;
+    xml_node * script;
+    config_t config;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string(from, &a, config) == 0)
+    CHECK(parse_string(to, &b, config) == 0)
+
+    script = xml_diff(document_element(a), document_element(b));
+    CHECK(script != NULL)
+    CHECK(xml_patch(document_element(a), script) == 0)
+    CHECK(xml_equal(document_element(a), document_element(b)))
+    if(!xml_equal(document_element(a), document_element(b))) {
+        fprintf(stderr, "  %s patched to %s\n", from, to);
+    }
+
+    destroy_node(script);
+    destroy_node(a);
+    destroy_node(b);
+}
+
+static void test_diff(void) {
+    xml_element * a = NULL;
+    xml_element * b = NULL;
+    xml_element * other = NULL;
+    xml_node * script;
+    config_t config;
+
+    diff_patch("<c><port>80</port></c>", "<c><port>80</port></c>");
+    diff_patch("<c port=\"80\" x=\"1\"/>", "<c port=\"8080\" y=\"2\"/>");
+    diff_patch("<c><a/><b>t</b><d/></c>", "<c><b>u</b><d/><e f=\"1\"/></c>");
+    diff_patch("<c><a><b><x/></b></a>t</c>", "<c><a><b><y/></b></a></c>");
+
+    /* a script that does not fit fails and changes nothing */
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<c><a/><b/><d/></c>", &a, config) == 0)
+    CHECK(parse_string("<c><a/><d/></c>", &b, config) == 0)
+    CHECK(parse_string("<c/>", &other, config) == 0)
+    script = xml_diff(document_element(a), document_element(b));
+    CHECK(xml_patch(document_element(other), script) == PATCHERROR)
+    CHECK(document_element(other)->child == NULL)
+
+    destroy_node(script);
+    destroy_node(a);
+    destroy_node(b);
+    destroy_node(other);
+}
+
+/* doc a and doc b are equal, or not, with hashes to match */
+static void equal(const char * a, const char * b, int expected) {
+    xml_element * ta = NULL;
+    xml_element * tb = NULL;
+    config_t config;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string(a, &ta, config) == 0)
+    CHECK(parse_string(b, &tb, config) == 0)
+    CHECK(xml_equal(ta, tb) == expected)
+    CHECK((xml_hash(ta) == xml_hash(tb)) == expected)
+    if(xml_equal(ta, tb) != expected) {
+        fprintf(stderr, "  %s, %s: expected %d\n", a, b, expected);
+    }
+    destroy_node(ta);
+    destroy_node(tb);
+}
+
+static void test_hash(void) {
+    xml_element * root = NULL;
+    xml_node * a;
+    config_t config;
+    uint64_t h;
+
+    equal("<a x=\"1\" y=\"2\"><b/>t</a>", "<a y=\"2\" x=\"1\"><b/>t</a>", 1);
+    equal("<a><b/><c/></a>", "<a><c/><b/></a>", 0);
+    equal("<a>t</a>", "<a>u</a>", 0);
+    equal("<a x=\"1\"/>", "<a x=\"2\"/>", 0);
+    equal("<a x=\"1\"/>", "<a y=\"1\"/>", 0);
+
+    /* kept hashes are dropped by the tree functions, and xml_touch */
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<a><b/></a>", &root, config) == 0)
+    a = document_element(root);
+    h = xml_hash(root);
+    add_attribute(a->child, create_attribute("x", "1"));
+    CHECK(xml_hash(root) != h)
+    h = xml_hash(root);
+    a->child->attributes->value[0] = '2';
+    xml_touch(a->child);
+    CHECK(xml_hash(root) != h)
+    destroy_node(root);
+}
+
+/* clones equal the original and outlive it; a shared copy changes
+   without changing its template */
+static void test_copies(void) {
+    const char * doc = "<conf><server port=\"80\"><name>a &amp; b</name></server>"
+                       "<log level=\"1\"/></conf>";
+    xml_element * root = NULL;
+    xml_element * again = NULL;
+    xml_node * clone;
+    xml_node * copy;
+    xml_node * server;
+    xml_node ** found;
+    config_t config;
+    int count = 0;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string(doc, &root, config) == 0)
+    CHECK(parse_string(doc, &again, config) == 0)
+
+    clone = xml_clone(root);
+    CHECK(clone != NULL && xml_equal(clone, root))
+    destroy_node(root);
+    CHECK(xml_equal(clone, again))
+    destroy_node(clone);
+
+    root = NULL;
+    CHECK(parse_string(doc, &root, config) == 0)
+    copy = xml_share(root);
+    CHECK(copy != NULL && xml_equal(copy, root))
+
+    found = select_nodes(copy, &count, "/conf/server");
+    CHECK(count == 1)
+    server = xml_unshare(copy, found[0]);
+    CHECK(server != NULL && server != found[0])
+    xml_free(found);
+    add_attribute(server, create_attribute("host", "b"));
+
+    CHECK(!xml_equal(copy, root))
+    CHECK(xml_equal(root, again))
+    CHECK(count_nodes(copy, "/conf/server/@host=b") == 1)
+    CHECK(count_nodes(root, "/conf/server/@host=b") == 0)
+    CHECK(count_nodes(copy, "/conf/log") == 1)
+
+    destroy_node(copy);
+    xml_release(root);
+    destroy_node(again);
+}
+
+/* adjacent texts, left by comments that are not kept, are merged into
+   the text a document without the comments has */
+static void test_normalize(void) {
+    const char * doc = "<a>x<!--1-->y<!--2-->z<b>1<!--3-->2</b>w<!--4--></a>";
+    xml_element * merged = NULL;
+    xml_element * root = NULL;
+    xml_element * inplace = NULL;
+    xml_node * a;
+    config_t config;
+    char buf[4096];
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<a>xyz<b>12</b>w</a>", &merged, config) == 0)
+    CHECK(parse_string(doc, &root, config) == 0)
+    CHECK(!xml_equal(root, merged))
+    normalize(root);
+    CHECK(xml_equal(root, merged))
+
+    /* texts in the buffer of a parse_inplace */
+    strcpy(buf, doc);
+    CHECK(parse_inplace(buf, (int)strlen(buf), &inplace, config) == 0)
+    normalize(inplace);
+    CHECK(xml_equal(inplace, merged))
+    destroy_node(inplace);
+
+    /* many fragments make one text, in order */
+    destroy_node(root);
+    root = NULL;
+    CHECK(parse_string("<a/>", &root, config) == 0)
+    a = document_element(root);
+    for(i = 0; i < 1000; i++) {
+        char text[2] = { (char)('a' + i % 26), 0 };
+        add_childorsibling(a, create_text(text));
+    }
+    normalize(root);
+    CHECK(a->child && !a->child->sibling && strlen(a->child->text) == 1000)
+    CHECK(!strncmp(a->child->text, "abcdefghijklmnopqrstuvwxyzab", 28))
+
+    destroy_node(root);
+    destroy_node(merged);
+}
+
+/* index lookups find what select_nodes does, before and after an edit */
+static void test_index(void) {
+    const char * keys[] = { "id", NULL };
+    const char * paths[] = { "/r/item/@id=a", "/r/g/item/@id=b",
+                             "/r/item/@id=c", "/r/other/@id=d", NULL };
+    xml_element * root = NULL;
+    xml_node ** all;
+    xml_node ** found;
+    xml_node * item;
+    config_t config;
+    char path[64];
+    int count = 0;
+    int selected = 0;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    config.index = keys;
+    CHECK(parse_string("<r><item id=\"a\"/><g><item id=\"b\">t</item></g>"
+                       "<item id=\"c\"/><other id=\"d\"/></r>", &root, config) == 0)
+
+    all = xml_lookup_all(root, "item", NULL, &count);
+    CHECK(count == 3)
+    xml_free(all);
+
+    for(i = 0; paths[i]; i++) {
+        strcpy(path, paths[i]);
+        found = select_nodes(root, &selected, path);
+        CHECK(selected == 1)
+        CHECK(selected == 1 && 
+              xml_lookup(root, "id", strchr(paths[i], '=') + 1) == found[0])
+        xml_free(found);
+    }
+    CHECK(xml_lookup(root, "id", "none") == NULL)
+
+    /* the tree functions keep it up to date */
+    item = create_element("item");
+    add_attribute(item, create_attribute("id", "e"));
+    add_childorsibling(document_element(root), item);
+    CHECK(xml_lookup(root, "id", "e") == item)
+    CHECK(remove_childorsibiling(document_element(root), item) == item)
+    CHECK(xml_lookup(root, "id", "e") == NULL)
+    destroy_node(item);
+
+    /* and without one the tree is searched */
+    xml_index_drop(root);
+    CHECK(xml_lookup(root, "id", "c") != NULL)
+    all = xml_lookup_all(root, "item", NULL, &count);
+    CHECK(count == 3)
+    xml_free(all);
+
+    destroy_node(root);
+}
+
+/* an iterator and select_nodes_into give what select_nodes does, in
+   the same order */
+static void same_as_select(xml_node * root, const char * xpath) {
+    xml_node * into[16];
+    xml_node ** nodes;
+    xml_node * n;
+    xpath_iter it;
+    char path[256];
+    int count = 0;
+    int i = 0;
+
+    strcpy(path, xpath);
+    nodes = select_nodes(root, &count, path);
+
+    CHECK(xpath_iter_init(&it, root, xpath) == 0)
+    while((n = xpath_iter_next(&it)) != NULL) {
+        CHECK(i < count && nodes[i] == n)
+        i++;
+    }
+    CHECK(i == count)
+
+    CHECK(select_nodes_into(root, xpath, into, 16) == count)
+    for(i = 0; i < count && i < 16; i++) {
+        CHECK(into[i] == nodes[i])
+    }
+
+    /* a short array gets the first ones, and the count of all */
+    into[1] = NULL;
+    CHECK(select_nodes_into(root, xpath, into, 1) == count)
+    CHECK(count == 0 || into[0] == nodes[0])
+    CHECK(into[1] == NULL)
+
+    if(i != count) {
+        fprintf(stderr, "  %s\n", xpath);
+    }
+    xml_free(nodes);
+}
+
+static void test_iter(void) {
+    xml_element * root = NULL;
+    config_t config;
+    xpath_iter it;
+    char path[200];
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<r><a x=\"1\"><b/><b/></a><a><b/></a><c/>"
+                       "<a x=\"1\"><b><b/></b></a></r>", &root, config) == 0)
+
+    same_as_select(root, "/r/a");
+    same_as_select(root, "/r/a/b");
+    same_as_select(root, "/r/a/@x=1");
+    same_as_select(root, "/r/a/@x=1/b");
+    same_as_select(root, "/r/a/b/b");
+    same_as_select(root, "/r/none");
+    same_as_select(root, "/r/a/@y");
+
+    /* paths longer than XPATH_MAX_STEPS */
+    path[0] = 0;
+    for(i = 0; i <= XPATH_MAX_STEPS; i++) {
+        strcat(path, "/a");
+    }
+    CHECK(xpath_iter_init(&it, root, path) == XPATHERROR)
+    CHECK(xpath_iter_next(&it) == NULL)
+
+    destroy_node(root);
+}
+
+/* each path of a batch finds the first node, and the count,
+   select_nodes does */
+static void batch_as_select(const char * doc, const char ** paths, int count,
+                            int namespaces) {
+    xml_element * root = NULL;
+    xml_node * first[8];
+    int counts[8];
+    xpath_batch * batch;
+    config_t config;
+    int i;
+
+    /* compiled before the document is parsed, as for a stream of them */
+    batch = xpath_batch_compile(paths, count);
+    CHECK(batch != NULL)
+
+    memset(&config, 0, sizeof(config));
+    config.namespaces = namespaces;
+    CHECK(parse_string(doc, &root, config) == 0)
+    CHECK(xpath_batch_run(batch, root, first, counts) >= 0)
+
+    for(i = 0; i < count; i++) {
+        char path[256];
+        xml_node ** nodes;
+        int selected = 0;
+
+        strcpy(path, paths[i]);
+        nodes = select_nodes(root, &selected, path);
+        CHECK(counts[i] == selected)
+        CHECK(first[i] == (selected ? nodes[0] : NULL))
+        if(counts[i] != selected) {
+            fprintf(stderr, "  %s: %d, select_nodes %d\n", paths[i], counts[i], selected);
+        }
+        xml_free(nodes);
+    }
+
+    xpath_batch_free(batch);
+    destroy_node(root);
+}
+
+static void test_batch(void) {
+    const char * paths[] = { "/order/id", "/order/customer/@name",
+                             "/order/line/item", "/order/line/@qty=2",
+                             "order/line", "/order/none", "/order/line/item/@sku" };
+    const char * nspaths[] = { "/{urn:o}order/{urn:l}line", "/order/l:line",
+                               "/order/line", "/{urn:o}order/{}note" };
+
+    batch_as_select("<order><id>7</id><customer name=\"a\"/>"
+                    "<line qty=\"1\"><item sku=\"x\"/></line>"
+                    "<line qty=\"2\"><item/><item sku=\"y\"/></line></order>",
+                    paths, 7, 0);
+    batch_as_select("<order xmlns=\"urn:o\" xmlns:l=\"urn:l\"><l:line/><line/>"
+                    "<l:line/><note xmlns=\"\"/></order>", nspaths, 4, 1);
+    xml_intern_reset();
+}
+
+/* records are compared with those of a plain parse, in order */
+typedef struct records_t {
+    xml_node * expected;    /* the next record of the plain parse */
+    int count;
+    int stop;               /* stop with XPATHERROR at this count */
+} records;
+
+static int on_record(void * ctx, xml_node * record) {
+    records * r = (records *)ctx;
+
+    CHECK(r->expected && xml_equal(record, r->expected))
+    if(r->expected) {
+        r->expected = r->expected->sibling;
+    }
+    while(r->expected && r->expected->type != ELEMENT) {
+        r->expected = r->expected->sibling;
+    }
+    return ++r->count == r->stop ? XPATHERROR : 0;
+}
+
+static void test_records(void) {
+    const char * doc = "<feed><head/><record id=\"1\">a</record>"
+                       "<record id=\"2\"><record>inner</record></record>"
+                       "<record id=\"3\"/></feed>";
+    xml_element * plain = NULL;
+    xml_element * root = NULL;
+    config_t config;
+    records r;
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string(doc, &plain, config) == 0)
+
+    memset(&r, 0, sizeof(r));
+    r.expected = document_element(plain)->child->sibling;
+    config.record = "/feed/record";
+    config.on_record = on_record;
+    config.recordctx = &r;
+    CHECK(parse_string(doc, &root, config) == 0)
+    CHECK(r.count == 3)
+    CHECK(count_nodes(root, "/feed/record") == 0)
+    CHECK(count_nodes(root, "/feed/head") == 1)
+    destroy_node(root);
+
+    /* by name, the record inside a record is part of it */
+    memset(&r, 0, sizeof(r));
+    r.expected = document_element(plain)->child->sibling;
+    config.record = "record";
+    root = NULL;
+    CHECK(parse_string(doc, &root, config) == 0)
+    CHECK(r.count == 3)
+    destroy_node(root);
+
+    /* a negative return stops the parse with that code */
+    memset(&r, 0, sizeof(r));
+    r.expected = document_element(plain)->child->sibling;
+    r.stop = 2;
+    root = NULL;
+    CHECK(parse_string(doc, &root, config) == XPATHERROR)
+    CHECK(r.count == 2)
+    destroy_node(root);
+    destroy_node(plain);
+}
+
+/* a file read ahead parses to the tree parse makes of it. Rows come in
+   groups of 100 */
+static void readahead_as_parse(int groups) {
+    xml_element * plain = NULL;
+    xml_element * ahead = NULL;
+    config_t config;
+    FILE * fp = tmpfile();
+    int i;
+
+    CHECK(fp != NULL)
+    if(!fp) {
+        return;
+    }
+
+    fputs("<rows>", fp);
+    for(i = 0; i < groups * 100; i++) {
+        if(i % 100 == 0) {
+            fputs("<group>", fp);
+        }
+        fprintf(fp, "<row id=\"%d\">text &amp; more %d</row>\n", i, i * 7);
+        if(i % 100 == 99) {
+            fputs("</group>", fp);
+        }
+    }
+    fputs("</rows>", fp);
+
+    memset(&config, 0, sizeof(config));
+    rewind(fp);
+    CHECK(parse(fp, &plain, config) == 0)
+    rewind(fp);
+    CHECK(parse_readahead(fp, &ahead, config) == 0)
+    CHECK(xml_equal(plain, ahead))
+    CHECK(count_nodes(ahead, "/rows/group/row") == groups * 100)
+
+    destroy_node(plain);
+    destroy_node(ahead);
+    fclose(fp);
+}
+
+static void test_readahead(void) {
+    readahead_as_parse(0);
+    readahead_as_parse(1);
+    readahead_as_parse(1000);       /* several READAHEAD_SIZE buffers */
+}
+
+/* test_gzip's document, gzip compressed in two members split at byte 20 */
+static const unsigned char gzipped[] = {
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03,
+        0xb3, 0x49, 0xc9, 0x4f, 0xb6, 0xb3, 0x49, 0x54, 0xa8, 0xb0,
+        0x55, 0x32, 0x54, 0xb2, 0x2b, 0x49, 0xad, 0x28, 0x51, 0x50,
+        0x03, 0x00, 0xf0, 0x27, 0x5c, 0xe4, 0x14, 0x00, 0x00, 0x00,
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03,
+        0x4b, 0xcc, 0x2d, 0xb0, 0x56, 0xc8, 0xcd, 0x2f, 0x4a, 0xb5,
+        0xd1, 0x4f, 0xb4, 0xb3, 0x49, 0xd2, 0xb7, 0x2b, 0x49, 0xcc,
+        0xcc, 0xb1, 0xd1, 0x4f, 0xc9, 0x4f, 0xb6, 0x03, 0x00, 0xf8,
+        0x15, 0xcb, 0x9d, 0x1b, 0x00, 0x00, 0x00
+};
+
+/* gzip input parses to the tree of the document it holds; without zlib
+   it is refused */
+static void test_gzip(void) {
+    xml_element * plain = NULL;
+    xml_element * root = NULL;
+    config_t config;
+    char buf[sizeof(gzipped)];
+
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<doc><a x=\"1\">text &amp; more</a><b/>tail</doc>",
+                       &plain, config) == 0)
+
+    memcpy(buf, gzipped, sizeof(gzipped));
+#ifdef XMLC_ZLIB
+    CHECK(parse_buffer(buf, (int)sizeof(buf), &root, config) == 0)
+    CHECK(xml_equal(root, plain))
+    destroy_node(root);
+
+    /* cut short in the second member */
+    root = NULL;
+    memcpy(buf, gzipped, sizeof(gzipped));
+    CHECK(parse_buffer(buf, (int)sizeof(buf) - 12, &root, config) == COMPRESSERROR)
+#else
+    CHECK(parse_buffer(buf, (int)sizeof(buf), &root, config) == COMPRESSERROR)
+#endif
+    destroy_node(root);
+    destroy_node(plain);
+}
+
+/* a write callback that always fails */
+static int fail_write(void * ctx, const char * buf, int len) {
+    (void)ctx;
+    (void)buf;
+    (void)len;
+    return -1;
+}
+
+/* calls out of order and a failing callback give WRITEERROR, from then
+   on; xw_close ends what is left open */
+static void test_writer(void) {
+    xml_writer * w;
+    strbuf out;
+    int i;
+
+    out.len = 0;
+    out.buf[0] = 0;
+    w = xw_create(sb_write, &out);
+    CHECK(xw_start_element(w, "a") == 0)
+    CHECK(xw_attribute(w, "x", "<\"&amp;") == 0)
+    CHECK(xw_start_element(w, "b") == 0)
+    CHECK(xw_close(w) == 0)
+    CHECK(!strcmp(out.buf, "<a x=\"&lt;&quot;&amp;\"><b/></a>"))
+
+    /* an attribute after text */
+    w = xw_create(sb_write, &out);
+    CHECK(xw_start_element(w, "a") == 0)
+    CHECK(xw_text(w, "t") == 0)
+    CHECK(xw_attribute(w, "x", "1") == WRITEERROR)
+    CHECK(xw_text(w, "u") == WRITEERROR)
+    CHECK(xw_close(w) == WRITEERROR)
+
+    /* an end with nothing open */
+    w = xw_create(sb_write, &out);
+    CHECK(xw_end_element(w) == WRITEERROR)
+    CHECK(xw_start_element(w, "a") == WRITEERROR)
+    CHECK(xw_close(w) == WRITEERROR)
+
+    /* the callback failing, when the buffer is flushed */
+    w = xw_create(fail_write, NULL);
+    CHECK(xw_start_element(w, "a") == 0)
+    CHECK(xw_flush(w) == WRITEERROR)
+    CHECK(xw_end_element(w) == WRITEERROR)
+    CHECK(xw_close(w) == WRITEERROR)
+
+    /* or when it fills */
+    w = xw_create(fail_write, NULL);
+    xw_start_element(w, "a");
+    for(i = 0; i < WRITE_SIZE && xw_text(w, "0123456789") == 0; i++)
+        ;
+    CHECK(i < WRITE_SIZE)
+    CHECK(xw_close(w) == WRITEERROR)
+}
+
+/* an allocator that counts the blocks it holds */
+static long blocks;
+
+static void * count_malloc(void * ctx, size_t size) {
+    (void)ctx;
+    blocks++;
+    return malloc(size);
+}
+
+static void * count_realloc(void * ctx, void * ptr, size_t size) {
+    (void)ctx;
+    if(!ptr) {
+        blocks++;
+    }
+    return realloc(ptr, size);
+}
+
+static void count_free(void * ctx, void * ptr) {
+    (void)ctx;
+    blocks--;
+    free(ptr);
+}
+
+static void test_alloc(void) {
+    xml_allocator counting = { count_malloc, count_realloc, count_free, NULL };
+    xml_element * root = NULL;
+    config_t config;
+
+    /* count * size wrapping around is refused, not a short block */
+    CHECK(xml_calloc((size_t)-1 / 2 + 2, 2) == NULL)
+
+    xml_set_allocator(&counting);
+    memset(&config, 0, sizeof(config));
+    CHECK(parse_string("<a x=\"1\"><b>text &amp; more</b></a>", &root, config) == 0)
+    CHECK(blocks > 0)
+    destroy_node(root);
+    CHECK(blocks == 0)
+    xml_set_allocator(NULL);
+}
+
+int main(void) {
+    test_alloc();
+    test_names();
+    test_entities();
+    test_limits();
+    test_cache();
+    test_inplace();
+    test_namespaces();
+    test_skip();
+    test_edit();
+    test_diff();
+    test_hash();
+    test_copies();
+    test_normalize();
+    test_index();
+    test_iter();
+    test_batch();
+    test_records();
+    test_readahead();
+    test_gzip();
+    test_writer();
+
+    if(failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
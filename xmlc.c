@@ -1,7 +1,37 @@
+#if defined(XMLC_STATS) || defined(XMLC_READAHEAD) || defined(XMLC_THREADS)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#ifdef XMLC_STATS
+#include <time.h>
+#endif
+
+#if defined(XMLC_READAHEAD) || defined(XMLC_THREADS)
+#include <pthread.h>
+#endif
+
+#ifdef XMLC_READAHEAD
+#include <fcntl.h>
+#endif
+
+#ifdef XMLC_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef XMLC_ZSTD
+#include <zstd.h>
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "xmlc.h"
 
 
@@ -23,14 +53,237 @@
  * 
  */
 
-static char buffer[BUFFER_SIZE];
-static char tmp[BUFFER_SIZE];
+/* read_text escape modes */
+#define TEXT_RAW     0    /* copied as is */
+#define TEXT_ESCAPE  1    /* process_text, references left alone */
+#define TEXT_EXPAND  2    /* process_text */
+
+/* compress_magic, the compressed inputs told apart */
+enum { COMPRESS_NONE = 0, COMPRESS_GZIP, COMPRESS_ZSTD };
+
+/* Internal entities of a parse, stream->entities, see declare_entities */
+typedef struct entity_table_t entity_table;
+static void entity_table_free(entity_table * table);
+static int entity_failed(entity_table * entities);
+static char * escape_refs(stream_t * stream, const char * value,
+                          int len, int refs);
+
+static int name_is(const char * s, const char * name, int len);
+
+/* 
+ * Instrumentation. Everything below compiles away without XMLC_STATS.
+ * Time is charged to the phase the parser is in; parse_source switches
+ * to PHASE_TREE around node creation and process_text to PHASE_TEXT.
+ */
+enum { PHASE_TOKENIZE = 0, PHASE_TEXT, PHASE_TREE };
+
+#ifdef XMLC_STATS
+static double stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* INTERNAL - charge the time so far to the phase the parse is in,
+   returns that phase. A NULL stream is no parse */
+static int stats_switch(stream_t * stream, int phase) {
+	xml_stats * stats = stream ? stream->config.stats : NULL;
+	int prev = stream ? stream->phase : phase;
+
+	if(stats) {
+		double now = stats_now();
+		double elapsed = now - stream->phasestart;
+
+		if(prev == PHASE_TEXT) {
+			stats->process_text_ns += elapsed;
+		} else if(prev == PHASE_TREE) {
+			stats->tree_ns += elapsed;
+		} else {
+			stats->tokenize_ns += elapsed;
+		}
+
+		stream->phasestart = now;
+		stream->phase = phase;
+	}
+
+	return prev;
+}
+
+#define STAT_ADD(stream, field, n) \
+	if((stream) && (stream)->config.stats) { (stream)->config.stats->field += (n); }
+#define STAT_PHASE(stream, phase) stats_switch(stream, phase);
+#else
+#define STAT_ADD(stream, field, n)
+#define STAT_PHASE(stream, phase)
+#endif
+
+/* Counts read and changed from any thread: the references to a shared
+   tree, see xml_release, and index_live */
+#ifdef __GNUC__
+#define COUNT_ADD(count, n) __atomic_add_fetch(&(count), (n), __ATOMIC_ACQ_REL)
+#define COUNT_GET(count) __atomic_load_n(&(count), __ATOMIC_ACQUIRE)
+#else
+#define COUNT_ADD(count, n) ((count) += (n))
+#define COUNT_GET(count) (count)
+#endif
+
+/* 
+ * Allocation. Every allocation in the library goes through the
+ * installed allocator, see xml_set_allocator.
+ */
+static void * default_malloc(void * ctx, size_t size) {
+	(void)ctx;
+	return malloc(size);
+}
+
+static void * default_realloc(void * ctx, void * ptr, size_t size) {
+	(void)ctx;
+	return realloc(ptr, size);
+}
+
+static void default_free(void * ctx, void * ptr) {
+	(void)ctx;
+	free(ptr);
+}
+
+static xml_allocator allocator = { 
+	default_malloc, default_realloc, default_free, NULL 
+};
+
+/* Use this to route allocations to your own allocator. NULL restores
+   malloc/free. Install it before any tree is created and keep it until
+   the trees it allocated are gone. */
+void xml_set_allocator(const xml_allocator * alloc) {
+	if(alloc && alloc->malloc_fn && alloc->realloc_fn && alloc->free_fn) {
+		allocator = *alloc;
+	} else {
+		allocator.malloc_fn = default_malloc;
+		allocator.realloc_fn = default_realloc;
+		allocator.free_fn = default_free;
+		allocator.ctx = NULL;
+	}
+}
+
+void xml_get_allocator(xml_allocator * alloc) {
+	if(alloc) {
+		*alloc = allocator;
+	}
+}
+
+void * xml_malloc(size_t size) {
+	return allocator.malloc_fn(allocator.ctx, size);
+}
+
+/* NULL, as calloc, when count * size does not fit a size_t */
+void * xml_calloc(size_t count, size_t size) {
+	void * p;
+
+	if(size && count > SIZE_MAX / size) {
+		return NULL;
+	}
+
+	p = allocator.malloc_fn(allocator.ctx, count * size);
+	if(p) {
+		memset(p, 0, count * size);
+	}
+	return p;
+}
+
+void * xml_realloc(void * ptr, size_t size) {
+	return allocator.realloc_fn(allocator.ctx, ptr, size);
+}
+
+/* Use this to free memory handed out by the library, e.g. select_nodes results */
+void xml_free(void * ptr) {
+	if(ptr) {
+		allocator.free_fn(allocator.ctx, ptr);
+	}
+}
+
+/*
+ * Allocation made for a parse, charged to its config.max_bytes in
+ * stream->bytes. A NULL stream is no parse and is not charged. What the
+ * parse gives back, by shrinking or freeing, is taken off again.
+ */
+static int stream_charge(stream_t * stream, size_t size) {
+	if(!stream || !stream->config.max_bytes) {
+		return 0;
+	}
+
+	if(stream->bytes + size > stream->config.max_bytes) {
+		stream->limited = MEMORYLIMIT;
+		return -1;
+	}
+
+	stream->bytes += size;
+	return 0;
+}
+
+static void stream_credit(stream_t * stream, size_t size) {
+	if(stream && stream->config.max_bytes) {
+		stream->bytes -= size < stream->bytes ? size : stream->bytes;
+	}
+}
+
+static void * stream_malloc(stream_t * stream, size_t size) {
+	void * p;
+
+	if(stream_charge(stream, size) < 0) {
+		return NULL;
+	}
+
+	p = xml_malloc(size);
+	if(!p) {
+		stream_credit(stream, size);
+	}
+	return p;
+}
+
+static void * stream_calloc(stream_t * stream, size_t count, size_t size) {
+	void * p;
+
+	if(stream_charge(stream, count * size) < 0) {
+		return NULL;
+	}
+
+	p = xml_calloc(count, size);
+	if(!p) {
+		stream_credit(stream, count * size);
+	}
+	return p;
+}
+
+/* only what the block grows by is charged, old is its size until now */
+static void * stream_realloc(stream_t * stream, void * ptr, size_t old,
+                             size_t size) {
+	void * p;
+
+	if(size > old && stream_charge(stream, size - old) < 0) {
+		return NULL;
+	}
+
+	p = xml_realloc(ptr, size);
+	if(!p ? size > old : size < old) {
+		stream_credit(stream, size > old ? size - old : old - size);
+	}
+	return p;
+}
+
+/* size is what was charged for ptr */
+static void stream_free(stream_t * stream, void * ptr, size_t size) {
+	if(ptr) {
+		xml_free(ptr);
+		stream_credit(stream, size);
+	}
+}
 
 /* INTERNAL */
 void destroy_element(xml_element * e) {
 	if(e) {
-		free(e->name);
-		free(e);
+		if(e->flags & FREENAME) {
+			xml_free(e->name);
+		}
+		xml_free(e);
 	}
 }
 
@@ -41,7 +294,12 @@ void destroy_node(xml_node * node) {
     if(node == NULL)
         return;
 
-    p = node->child;
+    if(node->index) {
+      xml_index_drop(node);
+    }
+
+    /* borrowed children belong to the template, see xml_share */
+    p = (node->flags & SHARED) ? NULL : node->child;
 
     while(p) {
 	  q = p->sibling;
@@ -49,111 +307,297 @@ void destroy_node(xml_node * node) {
       p = q; 
     }
 
+    if(node->type == ELEMENT || node->type == PI) {
+      xml_attribute * a = node->attributes, * b;
+      while(a) {
+        b = a->next;
+        if(a->flags & FREENAME) {
+          xml_free(a->name);
+        }
+        if(a->flags & FREETEXT) {
+          xml_free(a->value);
+        }
+        if(!(a->flags & INARENA)) {
+          xml_free(a);
+        }
+        a = b;
+      }
+      node->attributes = NULL;
+    }
+
     if(node->name) {
-        free(node->name);
+        if(node->flags & FREENAME) {
+          xml_free(node->name);
+        }
         node->name = NULL;
     }
 
     if(node->text) {
-      free(node->text);
+      if(node->flags & FREETEXT) {
+        xml_free(node->text);
+      }
       node->text = NULL;
     }
 
-    free(node);
+    if(node->flags & HOLDSREF) {
+      xml_release(node->origin);
+    }
+
+    /* a clone's nodes go with its root, see xml_clone */
+    if(!(node->flags & INARENA)) {
+      xml_free(node);
+    }
 
     /* node's parent is not updated etc...*/
 }
 
-/* INTERNAL */
-char * location(stream_t * stream) {
-
-   int len = stream->runlength;
-   len -= (ERROR_BUFFER_SIZE - 1);
-
-   if(len < 0) {
-	   memcpy(&tmp[0], &stream->buf[0], 
-	    stream->runlength);
-
-       tmp[stream->runlength - 1] = 0;
-   } else {
-       memcpy(&tmp[0], &stream->buf[len], 
-  		     ERROR_BUFFER_SIZE - 1);
- 
-       tmp[ERROR_BUFFER_SIZE -1] = 0;
+/* 
+ * INTERNAL
+ * config.error, where the read position is. Lines are only counted now,
+ * over the window; those in input already dropped from it were counted
+ * by stream_fill as it went.
+ */
+void error_position(stream_t * stream, xml_error * error) {
+   const char * p = stream->buf;
+   const char * end = stream->buf + stream->runlength;
+   long lines = stream->lines;
+   long linestart = stream->linestart;
+
+   while((p = memchr(p, '\n', end - p)) != NULL) {
+	   lines++;
+	   p++;
+	   linestart = stream->base + (p - stream->buf);
    }
 
-   return &tmp[0];
+   error->offset = stream->base + stream->runlength;
+   error->line = (int)(lines + 1);
+   error->column = (int)(error->offset - linestart + 1);
 }
 
 /* INTERNAL */
 void unget_c(stream_t * stream, int count) {
 	int len = stream->runlength;
 
-	if(count > HALF_SIZE) {
-	   count = HALF_SIZE;
+	STAT_ADD(stream, ungets, 1)
+
+	/* reads past the end did not move, don't go back for them */
+	if(stream->overrun) {
+	   int n = count < stream->overrun ? count : stream->overrun;
+	   stream->overrun -= n;
+	   count -= n;
 	}
 
 	len -= count;
 
 	if(len < 0) {
-	  if(stream->lastactivezone == 2)
-         len += BUFFER_SIZE;
-	  else 
-		 len = 0;
+	   len = 0;
 	}
 
 	stream->runlength = len;
 }
 
+/* 
+ * INTERNAL
+ * Pulls the next block from the source into the window. Bytes before
+ * the token being read (stream->mark) and the unget lookback are dropped
+ * first; the window grows when a token outgrows it.
+ * Returns bytes added, 0 at end of input, < 0 on error.
+ */
+int stream_fill(stream_t * stream) {
+	int keep, n;
+
+	if(stream->eof) {
+		return 0;
+	}
+
+	if(stream->invalid) {
+		return -1;
+	}
+
+	keep = stream->runlength - HALF_SIZE;
+	if(stream->mark >= 0 && stream->mark < keep) {
+		keep = stream->mark;
+	}
+
+	if(keep > 0) {
+		/* config.error, lines are counted before they go */
+		if(stream->config.error) {
+			const char * p = stream->buf;
+			const char * end = stream->buf + keep;
+
+			while((p = memchr(p, '\n', end - p)) != NULL) {
+				stream->lines++;
+				p++;
+				stream->linestart = stream->base + (p - stream->buf);
+			}
+		}
+
+		memmove(stream->buf, &stream->buf[keep], stream->length - keep);
+		stream->length -= keep;
+		stream->runlength -= keep;
+		stream->base += keep;
+		if(stream->mark >= 0) {
+			stream->mark -= keep;
+		}
+	}
+
+	if(stream->size - stream->length < READ_SIZE) {
+		int size = stream->size * 2;
+		char * p;
+
+		while(size - stream->length < READ_SIZE) {
+			size *= 2;
+		}
+
+		p = (char *)stream_realloc(stream, stream->buf, stream->size, size);
+		if(!p) {
+			return -1;
+		}
+
+		stream->buf = p;
+		stream->size = size;
+	}
+
+	n = stream->read(stream->readctx, &stream->buf[stream->length], 
+	                 stream->size - stream->length);
+	STAT_ADD(stream, refills, 1)
+
+	if(n < 0) {
+		return -1;
+	}
+
+	if(n == 0) {
+		stream->eof = 1;
+	}
+
+	if(stream->config.validate_utf8) {
+		stream->utf8 = utf8_validate(stream->utf8, &stream->buf[stream->length], n);
+		if(stream->utf8 < 0 || (n == 0 && stream->utf8)) {
+			stream->invalid = 1;
+			return -1;
+		}
+	}
+
+	STAT_ADD(stream, bytes_read, n)
+	stream->length += n;
+	return n;
+}
+
 /* INTERNAL */
 int get_c(stream_t * stream) {
-	char * buf = NULL;
-	int size = -1;
-
-	if(stream->length > 0 && stream->length < HALF_SIZE) {
-		if((stream->runlength == stream->length) ||
-		  (stream->runlength == stream->length + HALF_SIZE))
-            return -19; // EOF
-	}
-     
-	if(stream->runlength == HALF_SIZE && stream->activezone == 1) {
-       size = HALF_SIZE;
-	   stream->activezone = 2;
-	   stream->lastactivezone = 1;
-	} else if (stream->runlength == BUFFER_SIZE) {
-		stream->runlength = 0;
-		if(stream->activezone == 2) {
-			size = 0; 
-			stream->activezone = 1;
-			stream->lastactivezone = 2;
-		}
-	}
-
-	if(size >= 0) {
-	   if (feof(stream->fp)) {
-	        return -19;
-	   }
-	   clearerr(stream->fp);
+	if(stream->runlength >= stream->length) {
+		int n = stream_fill(stream);
+		if(n <= 0) {
+			if(n < 0) {
+				return FILEERROR;
+			}
 
-       stream->length = fread(&buffer[size], sizeof(char), 
-               HALF_SIZE, stream->fp);
-	   if(ferror(stream->fp)){
-		   perror("Stream Error");
-	 	   return -18;
-	   } 
+			stream->overrun++;
+			return ENDOFFILE; // EOF
+		}
 	}
 
+    return (unsigned char)stream->buf[stream->runlength++];
+}
+
+/* 
+ * INTERNAL
+ * Moves to the next ch, a window at a time. ch is not consumed.
+ */
+int stream_scan(stream_t * stream, int ch) {
+	for(;;) {
+		char * p = (char *)memchr(&stream->buf[stream->runlength], ch,
+		                          stream->length - stream->runlength);
+		int n;
+
+		if(p) {
+			stream->runlength = (int)(p - stream->buf);
+			return ch;
+		}
+
+		stream->runlength = stream->length;
+
+		/* config.max_text, the token is not let grow the window further */
+		if(stream->mark >= 0 && stream->config.max_text &&
+		   (unsigned long)(stream->runlength - stream->mark - stream->valueat) >
+		   stream->config.max_text) {
+			return TEXTLIMIT;
+		}
 
-    return stream->buf[stream->runlength++];
+		n = stream_fill(stream);
+		if(n <= 0) {
+			return n < 0 ? FILEERROR : ENDOFFILE;
+		}
+	}
 }
 
-/* INTERNAL */
-int raise_error(int code, char * src, char* error, char* arg1) {
-    printf(error, (arg1 ? arg1 : ""));
-	printf("Location: %s\n", (src ? src : ""));
+/* 
+ * INTERNAL
+ * In place, a text ending at '<' can only get its NUL once that '<' has
+ * been read for the last time (it is given back and read again to tell
+ * the next node). read_text leaves it pending until then.
+ */
+void stream_settle(stream_t * stream) {
+	if(stream->pending >= 0) {
+		stream->buf[stream->pending] = 0;
+		stream->pending = -1;
+	}
+}
+
+/* 
+ * INTERNAL
+ * A parse error. Returns code, and with config.error set records the
+ * first one, where the parser was and error formatted with arg.
+ */
+int raise_error(stream_t * stream, int code, const char * error,
+                const char * arg) {
+	xml_error * e = stream->config.error;
+
+	if(e && !stream->raised) {
+		stream->raised = 1;
+		e->code = code;
+		error_position(stream, e);
+		snprintf(e->message, sizeof(e->message), error, arg ? arg : "");
+	}
 
 	return code;
+}
 
+/* Use this to describe an error code */
+const char * xml_strerror(int code) {
+	switch(code) {
+	case 0:              return "no error";
+	case INCOMPLETETAG:  return "input ends inside a tag";
+	case COMMENTERROR:   return "comment not ended";
+	case MARKUPERROR:    return "malformed declaration, PI or CDATA";
+	case CDATAERROR:     return "CDATA section not ended";
+	case TEXTERROR:      return "text runs into the end of input";
+	case NOMEMORY:       return "out of memory";
+	case ELEMENTERROR:   return "malformed start tag";
+	case NAMEERROR:      return "invalid element name or start tag";
+	case ATTRIBUTEERROR: return "malformed attribute";
+	case NOENDTAG:       return "no end tag";
+	case ENDTAGERROR:    return "malformed end tag";
+	case FILEERROR:      return "cannot read the input";
+	case ENDOFFILE:      return "end of input";
+	case ENDTAGMISMATCH: return "end tag does not match";
+	case READERROR:      return "reading the input failed";
+	case ENTITYERROR:    return "malformed entity declaration";
+	case ENTITYLIMIT:    return "entity expansion limit";
+	case ENCODINGERROR:  return "malformed UTF-8 or UTF-16";
+	case NAMESPACEERROR: return "namespace prefix not bound";
+	case PATCHERROR:     return "edit script does not fit the tree";
+	case XPATHERROR:     return "xpath too long for an iterator";
+	case COMPRESSERROR:  return "corrupt or unsupported compressed input";
+	case WRITEERROR:     return "write failed or out of order";
+	case DEPTHLIMIT:     return "elements nested too deep";
+	case NODELIMIT:      return "too many nodes";
+	case ATTRIBUTELIMIT: return "too many attributes on an element";
+	case NAMELIMIT:      return "name too long";
+	case TEXTLIMIT:      return "text or attribute value too long";
+	case MEMORYLIMIT:    return "parse allocated too much memory";
+	default:             return "error";
+	}
 }
 
 /** 
@@ -163,6 +607,7 @@ int raise_error(int code, char * src, char* error, char* arg1) {
   */
 int parsexml(void * fp, xml_element ** root) {
 	config_t config;
+	memset(&config, 0, sizeof(config));
 	config.parsecomment = 0L;
 	return parse(fp, root, config);
 }
@@ -177,552 +622,920 @@ int parsexml(void * fp, xml_element ** root) {
   *              not much now, affects say comments parsing
   */
 int parse(void * fp, xml_element ** root, config_t config) {
-   int len = 0;
-   xml_node * document = NULL;
-   int ret = 0;
-
-   stream_t *stream = (stream_t *)malloc(sizeof(stream_t));
-   stream->buf = &buffer[0];
-   stream->runlength = 0;
-   stream->activezone = 1;
-   stream->lastactivezone = -1;
-   stream->fp = (FILE *)fp;
-   stream->config = config;
+   return parse_source(file_read, fp, root, config);
+}
 
-   stream->length = fread(buffer, sizeof(char), 
-	                HALF_SIZE, stream->fp);
+/* INTERNAL - a parse that fails before reading, for config.error */
+static int config_failed(config_t * config, int code) {
+   xml_error * e = config->error;
 
-   if(ferror(stream->fp)) {
-	    *root = NULL;
-		return -18;
+   if(e) {
+	  memset(e, 0, sizeof(xml_error));
+	  e->code = code;
+	  e->line = 1;
+	  e->column = 1;
+	  snprintf(e->message, sizeof(e->message), "%s", xml_strerror(code));
    }
 
-   document = create_document();
-   ret = parse_node(stream, document);
-
-   *root = document;
-   return ret;
+   return code;
 }
 
-/* INTERNAL */
-/* Recursive descent begins here */
-/* Root point for an XML node parse */
-int parse_node(stream_t * stream, xml_node * parent) {
-    
-	int c,c1,c2,c3;
-
-	for(;;) {
-
-		c = skip_whitespaces(stream);
-		RAISE_ERROR(c, -24, stream, "Error while trimming spaces in node", "")
+/* INTERNAL - pfn_read over memory, for compressed buffers */
+typedef struct memory_source_t {
+   const char * buf;
+   int len;
+} memory_source;
 
-		c = get_c(stream);
-		if(c == ENDOFFILE) //EOF is fine
-          return 0; 
+static int memory_read(void * ctx, char * buf, int len) {
+   memory_source * src = (memory_source *)ctx;
 
-		if(c == '<') {
-			char * name = NULL;
-			c1 = get_c(stream);
-			RAISE_ERROR(c1, -1, stream, "Incomplete tag", "")
-			c2 = get_c(stream);
-			RAISE_ERROR(c2, -2, stream, "Incomplete tag", "")
-			c3 = get_c(stream);
-			RAISE_ERROR(c3, -3, stream, "Incomplete tag", "")
+   if(len > src->len) {
+	  len = src->len;
+   }
+   memcpy(buf, src->buf, len);
+   src->buf += len;
+   src->len -= len;
+   return len;
+}
 
-            if(c == -19) 
-              return 0; 
+/**
+  * Use this API to parse XML held in memory
+  * buf --> XML text, need not be NUL terminated. It is read in place,
+  *         not copied, and must stay put until parse_buffer returns.
+  *         gzip and zstd are inflated as they are parsed
+  * len --> bytes in buf
+  */
+int parse_buffer(char * buf, int len, xml_element ** root, config_t config) {
+   stream_t stream;
+
+   if(compress_magic(buf, len) != COMPRESS_NONE) {
+	  memory_source src;
+	  src.buf = buf;
+	  src.len = len;
+	  return parse_source(memory_read, &src, root, config);
+   }
 
-			if(c1 == '!' && c2 == '-' && c3 =='-') {
-				int ret;
-				if(stream->config.parsecomment) {
-				  ret = parse_comment(stream, parent); 
-				} else {
-				  ret = scan_comment(stream);
-				}
+   /* UTF-16 is parsed from a UTF-8 copy */
+   if(utf16_bom(buf, len) >= 0) {
+	  int ret;
+	  char * utf8 = utf16_decode(buf, len, &len);
+	  if(!utf8) {
+		 *root = NULL;
+		 return config_failed(&config, len);
+	  }
 
-			   RAISE_ERROR(ret, -4, stream, "Error While scanning for comments", "")
-               
-			} else {
-				unget_c(stream, 4);
+	  ret = parse_buffer(utf8, len, root, config);
+	  xml_free(utf8);
+	  return ret;
+   }
 
-				/* This means, We are parsing the end tag at the wrong level, return success */
-				if(c1 == '/') { 
-					return 0;
-				}
+   memset(&stream, 0, sizeof(stream));
+   stream.buf = buf;
+   stream.length = len;
+   stream.size = len;
+   stream.mark = -1;
+   stream.eof = 1;
+   stream.config = config;
+   stream.pending = -1;
 
-				if( '!' == c1) {
-				  parse_entity(stream, parent);
-				} else if ('?' == c1) {
-				  parse_PI(stream, parent);
-				} else {
-				  parse_element(stream, parent); 
-				}
-			}
-		   
-		} else {
- 		   unget_c(stream, 1);
-		   parse_text(stream, parent);
-		}
-	}
+   return parse_stream(&stream, root);
 }
 
-/* INTERNAL */
-/* XML Entity */
-int parse_entity(stream_t * stream, xml_node * parent) {
-  int c = get_c(stream);
-  int c1 = get_c(stream);
-  char * q = &tmp[0];
-  xml_node * entity;
-  char * text;
+/**
+  * Use this API to parse XML held in memory the tree may keep
+  * buf --> XML text, need not be NUL terminated. Names, text and
+  *         attribute values are terminated and entity/line end processed
+  *         inside buf, and the nodes point straight at them. Only text
+  *         that would grow in processing is copied out. buf is
+  *         overwritten and must outlive the tree. UTF-16 is transcoded
+  *         into buf too, ENCODINGERROR if the UTF-8 would not fit
+  * len --> bytes in buf
+  */
+int parse_inplace(char * buf, int len, xml_element ** root, config_t config) {
+   stream_t stream;
+
+   if(utf16_bom(buf, len) >= 0) {
+	  int n;
+	  char * utf8 = utf16_decode(buf, len, &n);
+	  if(!utf8 || n > len) {
+		 xml_free(utf8);
+		 *root = NULL;
+		 return config_failed(&config, utf8 ? ENCODINGERROR : n);
+	  }
 
-  if(c == '<' && c1 == '!') {
- 	for(;;) {
-		c = get_c(stream);
-		RAISE_ERROR(c, -31, stream, "Invalid Entity name", "")
+	  memcpy(buf, utf8, n);
+	  xml_free(utf8);
+	  len = n;
+   }
 
-		if(c <= 0x20) {
-          *q = 0;
-          break;
-		}
+   memset(&stream, 0, sizeof(stream));
+   stream.buf = buf;
+   stream.length = len;
+   stream.size = len;
+   stream.mark = -1;
+   stream.eof = 1;
+   stream.config = config;
+   stream.inplace = 1;
+   stream.pending = -1;
+
+   return parse_stream(&stream, root);
+}
 
-		*q++ = c;
-	}
+/* INTERNAL - whether an edit must be handled by parsing it all again */
+static int edit_needs_full(xml_node * root, char * buf, int len,
+                           config_t * config) {
+   xml_node * n;
 
-	q = &tmp[0];
+   if(!root || root->refcount || (root->flags & (SHARED | HOLDSREF)) ||
+      config->namespaces || 
+      utf16_bom(buf, len) >= 0) {
+	  return 1;
+   }
 
-	if(*q == 0) {
-       RAISE_ERROR(-32, -31, stream, "Invalid Entity", "")
-	}
+   /* skip paths start at the root */
+   if(config->skip) {
+	  const char ** skip;
+	  for(skip = config->skip; *skip; skip++) {
+		 if(**skip == '/') {
+			return 1;
+		 }
+	  }
+   }
 
-	entity = create_entity(q);
+   /* entities declared in the DOCTYPE could be referenced anywhere */
+   for(n = root->child; n; n = n->sibling) {
+	  if(n->type == ENTITY && n->text && strstr(n->text, "<!ENTITY")) {
+		 return 1;
+	  }
+   }
 
-    c = read_text(stream, '>', NULL, &text);
-	RAISE_ERROR(c, -5, stream, "Invalid Entity values", "");
+   return 0;
+}
 
-	entity->text = text;
+/* 
+ * INTERNAL
+ * Reparses elt, which starts at abs in buf and is now len bytes long.
+ * Its replacement must be one element spanning exactly those bytes.
+ */
+static xml_node * edit_element(xml_node * elt, char * buf, int abs, int len,
+                               config_t config) {
+   xml_node * document = NULL;
+   xml_node * fresh;
+   xml_node * p;
+   xml_index * ix;
+   int ret;
+
+   /* the fragment is indexed as part of the tree, below, and a fragment
+      that does not parse is no error of parse_edit's */
+   config.index = NULL;
+   config.error = NULL;
+   ret = parse_buffer(&buf[abs], len, &document, config);
+   fresh = document ? document->child : NULL;
+
+   if(ret < 0 || !fresh || fresh->sibling || fresh->type != ELEMENT || 
+      fresh->length != len) {
+	  destroy_node(document);
+	  return NULL;
+   }
 
-	add_childorsibling(parent, entity);
+   document->child = NULL;
+   destroy_node(document);
 
-#ifdef DEBUG
-	if(stream->config.nodeflush) {
-		print(entity, stream->config.fp, 0);
-	}
-#endif
+   /* take elt's place among its siblings */
+   fresh->offset = elt->offset;
+   fresh->parent = elt->parent;
+   fresh->sibling = elt->sibling;
 
-  }
-  return 0;
-}
+   if(elt->parent->child == elt) {
+	  elt->parent->child = fresh;
+   } else {
+	  for(p = elt->parent->child; p->sibling != elt; p = p->sibling)
+		 ;
+	  p->sibling = fresh;
+   }
 
-/* INTERNAL */
-int pi_end_token(stream_t * stream) {
-   int c1 = get_c(stream);
-   if(c1 < 0)
-      return c1;
+   xml_touch(fresh->parent);
+   ix = index_of(fresh);
+   index_tree(ix, elt, 0);
+   index_tree(ix, fresh, 1);
 
-   if(c1 == '>')
-      return 1;   
-   
-   unget_c(stream, 1);
-   return 0;
+   elt->sibling = NULL;
+   elt->parent = NULL;
+   destroy_node(elt);
+   return fresh;
 }
 
-/* INTERNAL.
- *  Processing Instruction parsing 
- */
-int parse_PI(stream_t * stream, xml_node * parent) {
-  int c = get_c(stream);
-  int c1 = get_c(stream);
-  int c2 = get_c(stream);
-  int c3 = get_c(stream);
-  int c4 = get_c(stream);
+/**
+  * Use this API to bring a tree up to date after an edit of its text
+  * root --> tree parsed from the text before the edit, updated in place
+  * buf, len --> the whole text after the edit
+  * start --> where the edit begins
+  * removed --> bytes of the old text replaced from start on
+  * inserted --> bytes that replaced them
+  * Only the smallest element holding the edit is parsed again, and
+  * spliced in for the old one; the rest of the tree is kept. When the
+  * edit changes the structure around it, or the document declares
+  * entities, the whole text is parsed again and *root replaced. On error
+  * *root is left as it was.
+  */
+int parse_edit(xml_element ** root, char * buf, int len, int start,
+               int removed, int inserted, config_t config) {
+   xml_node * elt = NULL;
+   xml_node * p;
+   int delta = inserted - removed;
+   int abs = 0;
+   int ret;
+
+   if(!edit_needs_full(*root, buf, len, &config)) {
+	  /* descend to the innermost element strictly around the edit */
+	  p = *root;
+	  for(;;) {
+		 xml_node * n;
+
+		 for(n = p->child; n; n = n->sibling) {
+			if(n->type == ELEMENT && abs + n->offset < start &&
+			   start + removed < abs + n->offset + n->length) {
+			   break;
+			}
+		 }
 
-  char * text = NULL;
-  xml_element * elt = NULL;
+		 if(!n) {
+			break;
+		 }
 
-  if(c == '<' && c1 == '?' && 
-	  (c2 =='x' || c2 =='X') &&
-	  (c3 =='m' || c3 =='M') &&
-	  (c4 =='l' || c4 =='L')) {
+		 abs += n->offset;
+		 elt = p = n;
+	  }
 
-	  int child = 0;
+	  /* widen to the enclosing element until a reparse fits */
+	  while(elt && elt->type == ELEMENT) {
+		 xml_node * parent = elt->parent;
 
-	  elt = create_PI("xml");
+		 p = edit_element(elt, buf, abs, elt->length + delta, config);
+		 if(p) {
+			/* what follows moves by delta, what holds it grows by it */
+			for(; p->parent; p = p->parent) {
+			   xml_node * n;
 
-	  c = read_text(stream, '?', pi_end_token, &text);
-	  RAISE_ERROR(c, -5, stream, "Invalid Processing Instruction", "");
+			   for(n = p->sibling; n; n = n->sibling) {
+				  if(n->type == ELEMENT) {
+					 n->offset += delta;
+				  }
+			   }
+			   p->parent->length += delta;
+			}
+			return 0;
+		 }
 
-	  elt->text = text;
-	  add_childorsibling(parent, elt);
-#ifdef DEBUG
-	  if(stream->config.nodeflush) {
-		print(elt, stream->config.fp, 0);
+		 abs -= elt->offset;
+		 elt = parent;
 	  }
-#endif
+   }
 
-	  return 0;
-  }
+   /* structure changed or cannot be reparsed locally */
+   p = NULL;
+   ret = parse_buffer(buf, len, &p, config);
+   if(ret >= 0 && !p->index && *root && (*root)->index) {
+	  ret = index_like(p, *root);
+   }
+   if(ret < 0) {
+	  destroy_node(p);
+	  return ret;
+   }
 
-  unget_c(stream, 5);
+   if(*root && (*root)->refcount) {
+	  xml_release(*root);
+   } else {
+	  destroy_node(*root);
+   }
 
-  return -33;
+   *root = p;
+   return ret;
 }
 
 /* INTERNAL */
-int cdata_end_token(stream_t * stream) {
-	int c1;
-    c1 = get_c(stream);
-    if(c1 < 0)
-	   return c1;
+int file_read(void * fp, char * buf, int len) {
+   FILE * file = (FILE *)fp;
+   int n;
 
-    if(c1 == ']') {
- 	   c1 = get_c(stream);
-	   if(c1 < 0)
-	      return c1;
-			  
+   if (feof(file)) {
+	   return 0;
+   }
+   clearerr(file);
 
-	   if( c1 == '>') {
-		  return 1;
-	   } else {
-	 	 unget_c(stream, 1);
-		 unget_c(stream, 1);
-	   }
-	} else {
-	  unget_c(stream, 1);
-	}
+   /* errno tells why */
+   n = fread(buf, sizeof(char), len, file);
+   if(ferror(file)){
+	   return -1;
+   }
 
-	return 0;
+   return n;
 }
 
-/* INTERNAL */
-/* CDATA Section parsing */
-int parse_cdata(stream_t * stream, xml_node * parent) {
-	int ch[9];
-	int i = 0;
-	char * text = NULL;
-	xml_node * node;
-
-	for(; i < sizeof(ch); i++) {
-		ch[i] = get_c(stream);
-		RAISE_ERROR(ch[i], -5, stream, "Incomplete tag", "")
-	}
-
-	if(memcmp(ch, "<![CDATA[", sizeof(ch)) == 0) {
+#ifdef XMLC_READAHEAD
+/* 
+ * INTERNAL
+ * parse_readahead. A thread reads the file into a ring of large buffers
+ * while the parser takes from the ones already full. head and tail count
+ * buffers filled and used up; the thread waits while all are full, the
+ * parser while all are used up.
+ */
+typedef struct readahead_t {
+	FILE * file;
+	char * buf[READAHEAD_COUNT];
+	int len[READAHEAD_COUNT];
+	unsigned head;    /* buffers filled, by the thread */
+	unsigned tail;    /* buffers used up, by the parser */
+	int pos;          /* read position in the buffer at tail */
+	int done;         /* the thread has read to the end of the file */
+	int error;        /* ... or a read failed */
+	int stop;         /* the parse is over, the thread should quit */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} readahead;
+
+/* INTERNAL - the reading thread */
+static void * readahead_thread(void * arg) {
+	readahead * ra = (readahead *)arg;
+
+	pthread_mutex_lock(&ra->lock);
+	while(!ra->done) {
+		int slot, n;
+
+		while(ra->head - ra->tail == READAHEAD_COUNT && !ra->stop) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		}
+		if(ra->stop) {
+			break;
+		}
 
-		ch[0] = read_text(stream, ']', cdata_end_token, &text);
-		RAISE_ERROR(ch[0], -8, stream, "Error while reading CDATA", "")
+		/* the buffer is not the parser's until head moves past it */
+		slot = ra->head % READAHEAD_COUNT;
+		pthread_mutex_unlock(&ra->lock);
+		n = (int)fread(ra->buf[slot], 1, READAHEAD_SIZE, ra->file);
+		pthread_mutex_lock(&ra->lock);
 
-		node = create_CDATA(text);
+		if(n > 0) {
+			ra->len[slot] = n;
+			ra->head++;
+		}
+		if(n < READAHEAD_SIZE) {
+			ra->error = ferror(ra->file) != 0;
+			ra->done = 1;
+		}
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
 
-	    add_childorsibling(parent, node);
+	return NULL;
+}
 
-#ifdef DEBUG
-		if(stream->config.nodeflush) {
-			print(node, stream->config.fp, 0);
-		}
-#endif
+/* INTERNAL - pfn_read over the ring */
+static int readahead_read(void * ctx, char * buf, int len) {
+	readahead * ra = (readahead *)ctx;
+	int slot;
 
-        return 0;
+	pthread_mutex_lock(&ra->lock);
+	while(ra->head == ra->tail && !ra->done) {
+		pthread_cond_wait(&ra->cond, &ra->lock);
 	}
+	if(ra->head == ra->tail) {
+		pthread_mutex_unlock(&ra->lock);
+		return ra->error ? -1 : 0;
+	}
+	pthread_mutex_unlock(&ra->lock);
 
-	unget_c(stream, 9);
-	
+	slot = ra->tail % READAHEAD_COUNT;
+	if(len > ra->len[slot] - ra->pos) {
+		len = ra->len[slot] - ra->pos;
+	}
+	memcpy(buf, &ra->buf[slot][ra->pos], len);
+	ra->pos += len;
+
+	/* used up, the thread may fill it again */
+	if(ra->pos == ra->len[slot]) {
+		pthread_mutex_lock(&ra->lock);
+		ra->tail++;
+		ra->pos = 0;
+		pthread_cond_broadcast(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+	}
 
-	return -25;
+	return len;
 }
+#endif
 
+/**
+  * Use this API to parse a file with reads overlapped with parsing
+  * fp --> pointer to XML file to read, read to its end
+  * A thread reads ahead into READAHEAD_COUNT buffers of READAHEAD_SIZE
+  * bytes while the parse goes on, so a parse from a slow disk takes as
+  * long as the slower of reading and parsing rather than both. Without
+  * XMLC_READAHEAD, or if the thread cannot be had, this is parse().
+  */
+int parse_readahead(void * fp, xml_element ** root, config_t config) {
+#ifdef XMLC_READAHEAD
+   readahead * ra;
+   pthread_t thread;
+   int ret = NOMEMORY;
+   int i;
+
+   /* ask the kernel to read ahead too */
+   posix_fadvise(fileno((FILE *)fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+   ra = (readahead *)xml_calloc(1, sizeof(readahead) + 
+                                READAHEAD_COUNT * (size_t)READAHEAD_SIZE);
+   if(!ra) {
+	  *root = NULL;
+	  return config_failed(&config, NOMEMORY);
+   }
 
-/* INTERNAL */
-int parse_text(stream_t * stream,  xml_element * parent) {
-	char * text = NULL;
-	xml_node * node;
-	
-	int c = read_text(stream, '<', NULL, &text);
-	if(c == -10) {
-       RAISE_ERROR(c, -10, stream, "Error while looking for text end char for elt %s", 
-		   parent->name)
-	} else if(c == -11) {
-       RAISE_ERROR(c, -11, stream, "Text too big for %s", parent->name)
-	}
+   ra->file = (FILE *)fp;
+   for(i = 0; i < READAHEAD_COUNT; i++) {
+	  ra->buf[i] = (char *)(ra + 1) + i * (size_t)READAHEAD_SIZE;
+   }
 
-	RAISE_ERROR(c, c, stream, "Invalid text at %s", parent->name)
-	node = create_text(text);
+   if(pthread_mutex_init(&ra->lock, NULL)) {
+	  xml_free(ra);
+	  return parse(fp, root, config);
+   }
+   if(pthread_cond_init(&ra->cond, NULL)) {
+	  pthread_mutex_destroy(&ra->lock);
+	  xml_free(ra);
+	  return parse(fp, root, config);
+   }
 
-    free(text);    
+   if(pthread_create(&thread, NULL, readahead_thread, ra)) {
+	  ret = parse(fp, root, config);
+   } else {
+	  ret = parse_source(readahead_read, ra, root, config);
 
-	add_childorsibling(parent, node);
+	  pthread_mutex_lock(&ra->lock);
+	  ra->stop = 1;
+	  pthread_cond_broadcast(&ra->cond);
+	  pthread_mutex_unlock(&ra->lock);
+	  pthread_join(thread, NULL);
+   }
 
-#ifdef DEBUG
-	if(stream->config.nodeflush) {
-		print(node, stream->config.fp, 0);
-	}
+   pthread_cond_destroy(&ra->cond);
+   pthread_mutex_destroy(&ra->lock);
+   xml_free(ra);
+   return ret;
+#else
+   return parse(fp, root, config);
 #endif
-
-	return 0;
 }
 
+/**
+  * Use this API to parse XML from any source
+  * read --> called to fill the parse buffer, see pfn_read
+  * ctx --> passed back to read
+  */
+int parse_source(pfn_read read, void * ctx, xml_element ** root, config_t config) {
+   stream_t stream;
+   int ret;
+
+   memset(&stream, 0, sizeof(stream));
+   stream.size = READ_SIZE + BUFFER_SIZE;
+   stream.buf = (char *)xml_malloc(stream.size);
+   stream.mark = -1;
+   stream.read = read;
+   stream.readctx = ctx;
+   stream.config = config;
+   stream.pending = -1;
+
+   if(!stream.buf) {
+	    *root = NULL;
+		return config_failed(&config, NOMEMORY);
+   }
 
-/* INTERNAL */
-int read_text(stream_t * stream, int endchar, pfn_end_token is_endtoken, char ** ptext) {
-	char * text = NULL;
-	int count = 0;
-	int size = 0;
-	int c;
-	int flag = 0L;
-
-	for(;;) {
-		   c = get_c(stream);
-		   if(c < 0)
-			   return -10;
-
-		   /* check for end condition */
-		   if(c == endchar) {
-			   if(is_endtoken) {
-		          flag = is_endtoken(stream);
-				  if(flag < 0) return flag; 
-			   } else {
-                  flag = 1L;
-			   }
-		   }
+   ret = parse_stream(&stream, root);
 
-		   if(flag == 1L || count == sizeof(tmp)) {
-			   int alloclen = size + count 
-				   + ((flag == 1L) ? 1 : 0);
-			   char * p = realloc(text, alloclen);
-			   if(!p) {
-				 if(text != NULL) {
-			   	    text[size -1] = 0;
-				 }
-				 *ptext = text;
-                 return -11;
-			   }
+   utf16_free(stream.utf16);
+   inflate_free(stream.inflate);
+   xml_free(stream.buf);
+   return ret;
+}
 
-               text = p;
-			   memcpy(&text[size], tmp, count);
-			   size = alloclen;
-			   
-               if(flag == 1L) {
-				  text[size -1] = 0;
-				  *ptext = text;
-			      break;
-			   }
+/* INTERNAL - why an allocation made while parsing returned NULL */
+static int alloc_failed(stream_t * stream) {
+   if(stream->limited) {
+	  return stream->limited;
+   }
+   return entity_failed(stream->entities) ? ENTITYLIMIT : NOMEMORY;
+}
 
-			   count = 0;
-		   }
+/* INTERNAL - a failed parse, config.error gets what raise_error did not */
+static int parse_failed(stream_t * stream, int code) {
+   xml_error * e = stream->config.error;
 
-           tmp[count++] = c;
+   if(e) {
+	  if(!stream->raised) {
+		 error_position(stream, e);
+		 snprintf(e->message, sizeof(e->message), "%s", xml_strerror(code));
 	  }
+	  e->code = code;
+   }
 
-      return 0;
+   return code;
 }
 
-
 /* INTERNAL */
-/* Element parsed here */
-int parse_element(stream_t * stream, xml_element * parent) {
-	int c;
-    char * q = &tmp[0];
-	xml_element * elt;
-	int child = 1L;
-
-	c = get_c(stream);
-	if( c != '<') {
-		RAISE_ERROR(-12, -12, stream, "Element should begin with < symbol", "")
-	}
-    
-	while(1) {
-		c = get_c(stream);
-		RAISE_ERROR(c, -12, stream, "stream error while reading element", "")
-
-		if(c <= 0x20 || c == '>') {
-          *q = 0;
-          break;
-		}
+int parse_stream(stream_t * stream, xml_element ** root) {
+   xml_node * document = NULL;
+   int validate;
+   int paths;
+   int ret = 0;
 
-		*q++ = c;
-	}
+   if(stream->config.error) {
+	  memset(stream->config.error, 0, sizeof(xml_error));
+   }
 
-	if( c == '>') {
-		if(q != &tmp[0] && *--q == '/') {
-			*q = 0;
-			child = 0L;
-		} 
-	}
+#ifdef XMLC_STATS
+   if(stream->config.stats) {
+	  memset(stream->config.stats, 0, sizeof(xml_stats));
+	  stream->phase = PHASE_TOKENIZE;
+	  stream->phasestart = stats_now();
+   }
+   if(stream->eof) {
+	  STAT_ADD(stream, bytes_read, stream->length)
+   }
+#endif
 
-	q = &tmp[0];
+   /* the first bytes are only validated once any BOM is dealt with */
+   validate = stream->config.validate_utf8;
+   stream->config.validate_utf8 = 0;
 
-	if(q == NULL || !*q ) {
-       RAISE_ERROR(-13, -13, stream, "Invalid element name", "")
-	}
-	/* name */
-	elt = create_element(q);
+   if(stream_fill(stream) < 0 || (ret = stream_inflate(stream)) < 0 ||
+      (ret = stream_bom(stream)) < 0) {
+	    *root = NULL;
+		return parse_failed(stream, ret < 0 ? ret : FILEERROR);
+   }
 
-	/* attributes */
-	if(c <= 0x20) {
-         c = parse_attributes(stream, elt, &child);
-		 if( c < 0)
-			 return c;
-	}
+   if(validate) {
+	    stream->config.validate_utf8 = 1;
+		stream->utf8 = utf8_validate(0, &stream->buf[stream->runlength],
+		                             stream->length - stream->runlength);
+		if(stream->utf8 < 0 || (stream->eof && stream->utf8)) {
+			*root = NULL;
+			return parse_failed(stream, ENCODINGERROR);
+		}
+   }
 
-	if(child) {
+   /* skip entries and records given as paths need the path of every
+      element */
+   paths = stream->config.record && *stream->config.record == '/';
+   if(stream->config.skip) {
+	  const char ** skip;
+	  for(skip = stream->config.skip; *skip; skip++) {
+		 if(**skip == '/') {
+			paths = 1;
+			break;
+		 }
+	  }
+   }
 
-      parse_node(stream, elt);
+   if(paths) {
+	  stream->pathsize = 256;
+	  stream->path = (char *)xml_malloc(stream->pathsize);
+	  if(!stream->path) {
+		 *root = NULL;
+		 return parse_failed(stream, NOMEMORY);
+	  }
+	  stream->path[0] = 0;
+   }
 
-      q = &tmp[0];
+   document = create_document();
+   STAT_ADD(stream, nodes[DOCUMENT], 1)
+   STAT_ADD(stream, bytes_allocated, sizeof(xml_node))
+   if(!document) {
+	  xml_free(stream->path);
+	  *root = NULL;
+	  return parse_failed(stream, NOMEMORY);
+   }
 
-  	  while(1) {
-			c = get_c(stream);
-			RAISE_ERROR(c, -16, stream, "reading element %s end tag", elt->name)
+   ret = parse_node(stream, document);
 
-			if(c == '<') {
-			   if((c = get_c(stream)) == '/')
-					continue;
-			   else {
-                 RAISE_ERROR(c, -17, stream, "No End tag for %s", elt->name)
-			   }
+   /* a limit may have surfaced as whatever failed to allocate, or not at
+      all where an allocation may fail */
+   if(stream->limited) {
+	  ret = stream->limited;
+   }
 
-			}
+   if(stream->inplace) {
+	  stream_settle(stream);
+   }
 
-			if(c == '>') {
-			  *q = 0;
-			  break;
-			}
+   document->length = stream->base + stream->runlength;
 
-			*q++ = c;
-		}
+   entity_table_free(stream->entities);
+   stream->entities = NULL;
+   xml_free(stream->ns);
+   xml_free(stream->path);
 
-	  if(strcmp(elt->name, &tmp[0])) {
-		RAISE_ERROR(-22, -22, stream, "Invalid end tag for %s", elt->name)
-	  }
-	}
+   if(ret < 0 && stream->invalid) {
+	  ret = ENCODINGERROR;
+   } else if(ret < 0 && stream->corrupt) {
+	  ret = COMPRESSERROR;
+   }
 
-	add_childorsibling(parent, elt);
+   if(ret >= 0 && stream->config.index && 
+      xml_index_build(document, stream->config.index) < 0) {
+	  ret = NOMEMORY;
+   }
 
-#ifdef DEBUG
-	if(stream->config.nodeflush) {
-		print(elt, stream->config.fp, 0);
-	}
-#endif
+   STAT_PHASE(stream, PHASE_TOKENIZE)
 
-	return 0;
+   *root = document;
+   return ret < 0 ? parse_failed(stream, ret) : ret;
 }
 
-/* XML Attributes */
-int parse_attributes(stream_t * stream, xml_element * elt, int * pchild) {
-	int inquote = 0;
-	int c;
-	char * q = &tmp[0];
-
-    c = skip_whitespaces(stream);
-    RAISE_ERROR(c, -23, stream, "Error while trimming spaces in element %s", elt->name)
+/* INTERNAL */
+/* Recursive descent begins here */
+/* Root point for an XML node parse */
+int parse_node(stream_t * stream, xml_node * parent) {
+    
+	int c,c1,c2,c3;
 
- 		for(;;) {
-			c = get_c(stream);
+	for(;;) {
 
-			RAISE_ERROR(c, -13, stream, 
-				 "Stream error while processing for attributes at %s", elt->name)
+		c = skip_whitespaces(stream);
+		RAISE_ERROR(c, READERROR, stream, "Error while trimming spaces in node", "")
 
-		   	if( c == '>') {
-			   *q = 0;
- 			   if(q != &tmp[0] && *--q == '/') {
-			   	  *q = 0;
-				  *pchild = 0L;
-			   }
+		c = get_c(stream);
+		if(c == ENDOFFILE) //EOF is fine
+          return 0; 
 
-   			   q = &tmp[0];
+		if(c == '<') {
+			char * name = NULL;
+			c1 = get_c(stream);
+			RAISE_ERROR(c1, INCOMPLETETAG, stream, "Incomplete tag", "")
+			c2 = get_c(stream);
+			RAISE_ERROR(c2, INCOMPLETETAG, stream, "Incomplete tag", "")
+			c3 = get_c(stream);
+			RAISE_ERROR(c3, INCOMPLETETAG, stream, "Incomplete tag", "")
 
-			   c = parse_attr(q, elt);
+            if(c == ENDOFFILE) 
+              return 0; 
 
-			   RAISE_ERROR(c, -14, , stream, "Invalid attribute %s", &tmp[0])
+			if(c1 == '!' && c2 == '-' && c3 =='-') {
+				int ret;
+				if(stream->config.parsecomment) {
+				  ret = parse_comment(stream, parent); 
+				} else {
+				  ret = scan_comment(stream);
+				}
 
-               break; 
-			}
+			   RAISE_ERROR(ret, COMMENTERROR, stream, "Error While scanning for comments", "")
+               
+			} else {
+				int ret;
+				unget_c(stream, 4);
 
-			if( c == '"') {
-				inquote = !inquote;
-			}
+				/* This means, We are parsing the end tag at the wrong level, return success */
+				if(c1 == '/') { 
+					return 0;
+				}
 
-			if(c <= 0x20 && !inquote) {
-			  *q = 0;
-			  q = &tmp[0];
-			  c = parse_attr(q, elt);
-			  RAISE_ERROR(c, -15, stream, "Invalid attribute %s", &tmp[0])
-              
-			  c = skip_whitespaces(stream);
-              RAISE_ERROR(c, -23, stream, "Error while trimming spaces in element %s", elt->name)
+				if( '!' == c1 && '[' == c2) {
+				  ret = parse_cdata(stream, parent);
+				} else if( '!' == c1) {
+				  ret = parse_entity(stream, parent);
+				} else if ('?' == c1) {
+				  ret = parse_PI(stream, parent);
+				} else {
+				  ret = parse_element(stream, parent); 
+				}
 
-			  continue;
+				if(ret < 0) {
+				  return ret;
+				}
 			}
-
-			*q++ = c;
+		   
+		} else {
+		   int ret;
+ 		   unget_c(stream, 1);
+		   ret = parse_text(stream, parent);
+		   if(ret < 0) {
+			 return ret;
+		   }
 		}
-
-	return 0;
+	}
 }
 
 /* INTERNAL */
-int skip_whitespaces(stream_t * stream) {
-	int c;
-	for(;;) {
-		  c = get_c(stream);
-		  if( c < 0)
-			  return c;
- 		  if(c <= 0x20) {
-			continue;
-		  } else {
-            unget_c(stream, 1);
-		    break;
-		  }
+/* XML Entity */
+int parse_entity(stream_t * stream, xml_node * parent) {
+  int c = get_c(stream);
+  int c1 = get_c(stream);
+  char * name;
+  int len;
+  xml_node * entity;
+  char * text;
+
+  if(c == '<' && c1 == '!') {
+	/* a slice of the window, as element names */
+	stream->mark = stream->runlength;
+
+ 	for(;;) {
+		c = get_c(stream);
+		RAISE_ERROR(c, ENTITYERROR, stream, "Invalid Entity name", "")
+
+		if(c <= 0x20) {
+          break;
+		}
+
+		if(stream->config.max_name &&
+		   stream->runlength - 1 - stream->mark >= stream->config.max_name) {
+          RAISE_ERROR(NAMELIMIT, NAMELIMIT, stream, "Entity name too long", "")
+		}
 	}
 
-	return c;
-}
+	len = stream->runlength - stream->mark - (c >= 0);
+	name = &stream->buf[stream->mark];
+	stream->mark = -1;
 
-/*
- * Parse attributes
- */
-int parse_attr(char * p, xml_element * elt) {
+	if(!len) {
+       RAISE_ERROR(ENTITYERROR, ENTITYERROR, stream, "Invalid Entity", "")
+	}
 
-	char * eq; 
-	char * val;
-	char * q; 
+	if(c == ENDOFFILE) {
+       RAISE_ERROR(MARKUPERROR, MARKUPERROR, stream, "Invalid Entity values", "")
+	}
 
-	if(!p || !*p) {
-  	   return 0;
+	if(stream->inplace) {
+		name[len] = 0;
 	}
 
-	eq = strrchr(p, '=');
+	STAT_PHASE(stream, PHASE_TREE)
+	entity = new_named(stream, ENTITY, name, len);
+	STAT_PHASE(stream, PHASE_TOKENIZE)
+	if(!entity) {
+       c = alloc_failed(stream);
+       RAISE_ERROR(c, c, stream, "Out of memory for an entity", "")
+	}
 
-    /* + 2 for the quote '"' */
-	q = val = ((eq && *(eq + 1)) ? eq + 2: eq);
-	
-	if(!eq) {
-		return -12;
+    if(!strcmp(entity->name, "DOCTYPE")) {
+	  c = read_doctype(stream, &text);
+	} else {
+	  c = read_text(stream, '>', NULL, TEXT_RAW, &text);
 	}
-    
-	*eq = 0;
+	if(c < 0 && c != ENDOFFILE) {
+	  destroy_node(entity);
+	  RAISE_ERROR(c, MARKUPERROR, stream, "Invalid Entity values", "");
+	}
+
+	entity->text = text;
+	if(c == 1) {
+	  entity->flags &= ~FREETEXT;
+	}
+
+	STAT_PHASE(stream, PHASE_TREE)
+	add_childorsibling(parent, entity);
+	STAT_PHASE(stream, PHASE_TOKENIZE)
+
+#ifdef DEBUG
+	if(stream->config.nodeflush) {
+		print(entity, stream->config.fp, 0);
+	}
+#endif
+
+  }
+  return 0;
+}
+
+/* 
+ * INTERNAL
+ * Reads a DOCTYPE declaration up to its closing '>', which may come after
+ * an internal subset holding '>'s of its own, and declares the entities
+ * found in there.
+ */
+int read_doctype(stream_t * stream, char ** ptext) {
+	int quote = 0, subset = 0, comment = 0;
+	int c, c1 = 0, c2 = 0;
+	int len;
+
+	*ptext = NULL;
+	stream->mark = stream->runlength;
+
+	for(;;) {
+		c = get_c(stream);
+		if(c < 0) {
+			stream->mark = -1;
+			return TEXTERROR;
+		}
+
+		if(stream->config.max_text && (unsigned long)(stream->runlength -
+		   stream->mark) > stream->config.max_text) {
+			stream->mark = -1;
+			return TEXTLIMIT;
+		}
 
-	while(*q) {
-		if(*q == '"') {
-			*q = 0;
+		if(comment) {
+			comment = !(c == '>' && c1 == '-' && c2 == '-');
+		} else if(quote) {
+			quote = (c == quote) ? 0 : quote;
+		} else if(c == '"' || c == '\'') {
+			quote = c;
+		} else if(c == '[') {
+			subset = 1;
+		} else if(c == ']') {
+			subset = 0;
+		} else if(c == '-' && c1 == '-' && c2 == '!') {
+			comment = 1;
+			c = 0;
+		} else if(c == '>' && !subset) {
 			break;
 		}
 
-		q++;
+		c2 = c1;
+		c1 = c;
 	}
 
-	add_attribute(elt, create_attribute(p, *val ? val : ""));
+	len = stream->runlength - 1 - stream->mark;
+	declare_entities(stream, &stream->buf[stream->mark], len);
 
-	return *q;
+	return slice_text(stream, len, '>', TEXT_RAW, ptext);
 }
 
 /* INTERNAL */
-int comment_end_token(stream_t * stream) {
+int pi_end_token(stream_t * stream) {
+   int c1 = get_c(stream);
+   if(c1 < 0)
+      return c1;
+
+   if(c1 == '>')
+      return 1;   
+   
+   unget_c(stream, 1);
+   return 0;
+}
+
+/* INTERNAL.
+ *  Processing Instruction parsing 
+ */
+int parse_PI(stream_t * stream, xml_node * parent) {
+  int c = get_c(stream);
+  int c1 = get_c(stream);
+  int c2 = get_c(stream);
+  int c3 = get_c(stream);
+  int c4 = get_c(stream);
+
+  char * text = NULL;
+  xml_element * elt = NULL;
+
+  if(c == '<' && c1 == '?' && 
+	  (c2 =='x' || c2 =='X') &&
+	  (c3 =='m' || c3 =='M') &&
+	  (c4 =='l' || c4 =='L')) {
+
+	  int child = 0;
+
+	  STAT_PHASE(stream, PHASE_TREE)
+	  elt = create_PI("xml");
+	  STAT_ADD(stream, nodes[PI], 1)
+	  STAT_ADD(stream, bytes_allocated, sizeof(xml_node) + 4)
+	  STAT_PHASE(stream, PHASE_TOKENIZE)
+	  if(!elt) {
+		c = alloc_failed(stream);
+		RAISE_ERROR(c, c, stream, "Out of memory for a PI", "")
+	  }
+
+	  c = read_text(stream, '?', pi_end_token, TEXT_RAW, &text);
+	  if(c < 0 && c != ENDOFFILE) {
+		destroy_node(elt);
+		RAISE_ERROR(c, MARKUPERROR, stream, "Invalid Processing Instruction", "");
+	  }
+
+	  elt->text = text;
+	  if(c == 1) {
+		elt->flags &= ~FREETEXT;
+	  }
+	  STAT_PHASE(stream, PHASE_TREE)
+	  add_childorsibling(parent, elt);
+	  STAT_PHASE(stream, PHASE_TOKENIZE)
+#ifdef DEBUG
+	  if(stream->config.nodeflush) {
+		print(elt, stream->config.fp, 0);
+	  }
+#endif
+
+	  return 0;
+  }
+
+  unget_c(stream, 5);
+
+  return MARKUPERROR;
+}
+
+/* INTERNAL */
+int cdata_end_token(stream_t * stream) {
 	int c1;
     c1 = get_c(stream);
     if(c1 < 0)
 	   return c1;
 
-    if(c1 == '-') {
+    if(c1 == ']') {
  	   c1 = get_c(stream);
 	   if(c1 < 0)
 	      return c1;
@@ -741,740 +1554,5947 @@ int comment_end_token(stream_t * stream) {
 	return 0;
 }
 
-/*
- *
- * Parse comments 
- * 
- */
-int parse_comment(stream_t * stream, xml_node * parent) {
+/* INTERNAL */
+/* CDATA Section parsing */
+int parse_cdata(stream_t * stream, xml_node * parent) {
+	static const char start[] = "<![CDATA[";
+	int ch[9];
+	int i = 0;
+	char * text = NULL;
+	xml_node * node;
 
-  char * comment = NULL;
-  xml_node * node;
+	for(; i < 9; i++) {
+		ch[i] = get_c(stream);
+		RAISE_ERROR(ch[i], MARKUPERROR, stream, "Incomplete tag", "")
+	}
 
-  int c = read_text(stream, '-', comment_end_token, &comment);
-  if(c == -10) {
-    RAISE_ERROR(c, -10, stream, "Error while looking for comment end char for %s", parent->name)
-  } else if(c == -11) {
-    RAISE_ERROR(c, -11, stream, "Comment size too big for %s", parent->name)
-  }
+	for(i = 0; i < 9 && ch[i] == start[i]; i++)
+		;
 
-  if(comment && *comment) {
-     node = create_comment(comment);
-     add_childorsibling(parent, node);
-  }
+	if(i == 9) {
 
-    
+		ch[0] = read_text(stream, ']', cdata_end_token, TEXT_ESCAPE, &text);
+		RAISE_ERROR(ch[0], CDATAERROR, stream, "Error while reading CDATA", "")
+
+		STAT_PHASE(stream, PHASE_TREE)
+		node = new_textnode(stream, CDATA, text, ch[0] == 0);
+
+	    add_childorsibling(parent, node);
+		STAT_PHASE(stream, PHASE_TOKENIZE)
+		if(!node) {
+			ch[0] = alloc_failed(stream);
+			RAISE_ERROR(ch[0], ch[0], stream, "Out of memory for CDATA", "")
+		}
 
 #ifdef DEBUG
-  if(stream->config.nodeflush) {
- 	 print(node, stream->config.fp, 0);
-  }
+		if(stream->config.nodeflush) {
+			print(node, stream->config.fp, 0);
+		}
 #endif
 
-  return 0;
-}
-
-/* INTERNAL */
-int scan_comment(stream_t * stream) {
+        return 0;
+	}
 
-  int c1, c2 ,c;
-  c1 = c2 = c = 0;
+	unget_c(stream, 9);
+	
 
-  for(;;) {
-		c2 = c1;
-		c1 = c;
-		c = get_c(stream);
-		if ( c < 0) return -4;
-		
-        if(c == '>' && c1 =='-' && c2 =='-') 
-			return c;
-  }
-  
-  /* to shut the compiler */
-  return 0;
+	return MARKUPERROR;
 }
 
 
-/* Use print to print a tree from a given node */
-void print(xml_node * node, void *fp, int depth) {
-  FILE * file = (FILE *)fp;
+/* INTERNAL */
+int parse_text(stream_t * stream,  xml_element * parent) {
+	char * text = NULL;
+	xml_node * node;
+	
+	int c = read_text(stream, '<', NULL, TEXT_EXPAND, &text);
+	if(c == TEXTERROR) {
+       RAISE_ERROR(c, TEXTERROR, stream, "Error while looking for text end char for elt %s", 
+		   parent->name)
+	} else if(c == NOMEMORY) {
+       RAISE_ERROR(c, NOMEMORY, stream, "Text too big for %s", parent->name)
+	}
 
-  int i = 0;
-  if( node == NULL || file == NULL) {
-	  return;
-  }
+	RAISE_ERROR(c, c, stream, "Invalid text at %s", parent->name)
 
-  for(; i < depth; i++) {
-       fprintf(file, "%c", '\t');
-  }
+	/* give back the '<' that ended the text */
+	unget_c(stream, 1);
 
-  if(node->type == ELEMENT) {
-    xml_element * element = node;
+	STAT_PHASE(stream, PHASE_TREE)
+	node = new_textnode(stream, TEXT, text, c == 0);
 
-    fprintf(file, "<%s", element->name);
-    if(element->attributes) {
-	   xml_attribute * p = element->attributes;
-       for (p =  element->attributes; p; p = p->next) {
-	 	  fprintf(file, " %s=\"%s\"", p->name, p->value);
-	  }
+	add_childorsibling(parent, node);
+	STAT_PHASE(stream, PHASE_TOKENIZE)
+	if(!node) {
+		c = alloc_failed(stream);
+		RAISE_ERROR(c, c, stream, "Out of memory for text in %s", parent->name)
 	}
-	if(node->child)
-      fprintf(file, "%c\n", '>');
-	else {
-      fprintf(file, "%s\n", "/>");
-	}
-  } else if ( node->type == CDATA) {
-     fprintf(file, "<![CDATA[%s\n]]>", node->text);
-  } else if (node->type == COMMENT) {
-     fprintf(file, "<!--%s-->", node->text);
-  } else if (node->type == TEXT) {/* text */
-     fprintf(file, "%s", node->text);
-  } else if (node->type == ENTITY) {
-     fprintf(file, "<!%s %s>\n", node->name, node->text);
-  } else if (node->type == PI) {
-     fprintf(file, "<?%s %s?>\n", node->name, node->text);
-  } else if (node->type == DOCUMENT) {
-      --depth;
-  }
 
-  /* No work if this is a Document.
-   */
-
-  /* Recurse on child */
-  print(node->child, file, depth + 1);
-
-  if(node->child && (node->type == ELEMENT)) {
-    int j = 0;
-	for(; j < depth; j++) {
-       fprintf(file, "%c", '\t');
+#ifdef DEBUG
+	if(stream->config.nodeflush) {
+		print(node, stream->config.fp, 0);
 	}
-    fprintf(file, "</%s>\n", node->name);
-  } 
-
-  /* Recurse on sibling */
-  print(node->sibling, file, depth);
+#endif
 
-  fflush(file);
-  
+	return 0;
 }
 
-/* Use this to remove attribute from an element */
-void remove_attribute(xml_element * element,
-						      char * name) {
-	if( element && name ) {
-        xml_attribute * p, *q;
-		for( q = p = element->attributes; 
-		     p; 
-			 q = p, p = p->next) {
 
-				 if(strcmp( p->name, name) == 0) {
-					 if(q == p) {
-                        element->attributes = p->next;
-					 } else {
-					    q->next = p->next;
-					 }
-				 }
-		}
-	 }
+/* 
+ * INTERNAL
+ * Reads up to endchar (confirmed by is_endtoken when given). The text is
+ * held in the window as one slice and copied out once, through the
+ * entity/line end processing of process_text unless escape is TEXT_RAW.
+ * In place the slice itself is processed and terminated instead when it
+ * does not grow; then 1 is returned and *ptext points into the buffer.
+ */
+int read_text(stream_t * stream, int endchar, pfn_end_token is_endtoken, 
+              int escape, char ** ptext) {
+	int len;
+	int c;
+	int flag = 0L;
+
+	*ptext = NULL;
+	stream->mark = stream->runlength;
+
+	for(;;) {
+		   c = stream_scan(stream, endchar);
+		   if(c < 0) {
+			   stream->mark = -1;
+			   return c == TEXTLIMIT ? c : TEXTERROR;
+		   }
+
+		   /* the window may move under is_endtoken, keep the length */
+		   len = stream->runlength - stream->mark;
+		   if(stream->config.max_text &&
+		      (unsigned long)len > stream->config.max_text) {
+			   stream->mark = -1;
+			   return TEXTLIMIT;
+		   }
+		   stream->runlength++;
+
+		   /* check for end condition */
+		   if(is_endtoken) {
+		       flag = is_endtoken(stream);
+			   if(flag < 0) {
+				   stream->mark = -1;
+				   return flag; 
+			   }
+		   } else {
+               flag = 1L;
+		   }
+
+		   if(flag == 1L) {
+			   break;
+		   }
+	}
+
+	return slice_text(stream, len, endchar, escape, ptext);
 }
 
-/* Use this to add attribute from an element */
-void add_attribute(xml_element * element,
-				   xml_attribute * attrib) {
+/* INTERNAL - escape_inplace, the time charged to text processing */
+static int stream_escape(stream_t * stream, char * text, int len) {
+	int n;
+#ifdef XMLC_STATS
+	int phase = stats_switch(stream, PHASE_TEXT);
+#else
+	(void)stream;
+#endif
 
-	if( element && attrib ) {
-		if(element->attributes) {
-          xml_attribute * p  = element->attributes;
+	n = escape_inplace(text, len);
+	STAT_PHASE(stream, phase)
+	return n;
+}
 
-          while(p) {
-			  if(strcmp(p->name, attrib->name) == 0) {
-				  if(p->value) free(p->value);
-			      p->value = attrib->value;
-				  return;
-			  }
-			  p = p->next;
-		  }
+/* 
+ * INTERNAL
+ * Takes the len bytes from stream->mark on, the token just read up to
+ * and including endchar, out of the window. See read_text.
+ */
+int slice_text(stream_t * stream, int len, int endchar, int escape,
+               char ** ptext) {
+	char * text;
 
-  		  attrib->next = element->attributes;
+	if(stream->inplace) {
+		int n = len;
+		text = &stream->buf[stream->mark];
+
+		if(escape) {
+			n = stream_escape(stream, text, len);
 		}
 
-  	    element->attributes = attrib;
+		if(n >= 0) {
+			stream->mark = -1;
+			stream_settle(stream);
+
+			/* parse_text gives the '<' back, it is read again */
+			if(n == len && endchar == '<') {
+				stream->pending = (int)(text - stream->buf) + len;
+			} else {
+				text[n] = 0;
+			}
+
+			*ptext = text;
+			return 1;
+		}
+	}
+
+	if(escape == TEXT_EXPAND) {
+		text = escape_refs(stream, &stream->buf[stream->mark], len, 1);
+	} else if(escape == TEXT_ESCAPE) {
+		text = escape_refs(stream, &stream->buf[stream->mark], len, 0);
+	} else {
+		text = (char *)stream_malloc(stream, len + 1);
+		STAT_ADD(stream, bytes_allocated, len + 1)
+		if(text) {
+			memcpy(text, &stream->buf[stream->mark], len);
+			text[len] = 0;
+		}
+	}
+
+	stream->mark = -1;
+
+	if(!text) {
+		return alloc_failed(stream);
 	}
+
+	*ptext = text;
+    return 0;
 }
 
-/* Process text replaces &<ref>; tokens with appropriate characters */
-char * process_text(char * value) {
-	char * buf = NULL;
 
-	if(value) {
-        int len = strlen(value);
-		char * p = value;
-		char * q = NULL;
-	
-		while( *p ) {
-			char c = *p++;
-            
-			/* Relaxed estimate for length */
-			if(c == '"' || 
-			   c == '<' ||
-			   c =='>'  ||
-			   c == '\'' ||
-			   c == '&')
-			   len += 5;
-		}
-        
-        p = value;
-		buf = malloc(len+1);
-		q = buf;
-
-        while( *p ) {
-			char c = *p++;
-			if(c == '"' || c == '\'') {
-              *q++ = '&';
-			  *q++ = 'q';
-			  *q++ = 'u';
-              *q++ = 'o';
-			  *q++ = 't';
-			  *q++ = ';';
-			} else if(c == '`') {
-			  *q++ = '&';
-			  *q++ = 'a';
-			  *q++ = 'p';
-              *q++ = 'o';
-			  *q++ = 's';
-			  *q++ = ';';
-           	} else if( c == '&') {
-  			  if(*p && *(p+1) && *(p+2)) {
-				if(!memcmp(p, "lt;", 3) || !memcmp(p, "gt;", 3)) {
-					*q++ = '&';
-					*q++ = *p;
-					*q++ = *(p+1);
-					*q++ = *(p+2);
-					p = p + 3;
-					continue;
-				} else if (*(p+3) && !memcmp(p, "amp;", 4)) {
-					*q++ = '&';
-					*q++ = 'a';
-					*q++ = 'm';
-					*q++ = 'p';
-					*q++ = ';';
-					p = p + 4;
-					continue;
-				} else if (*(p + 3) && *(p + 4)) {
-					if(!memcmp(p, "quot;", 5) || !memcmp(p, "apos;", 5)) {
-					   *q++ = '&';
-					   *q++ = *p;
-					   *q++ = *(p+1);
-					   *q++ = *(p+2);
-					   *q++ = *(p+3);
-					   *q++ = *(p+4);
-					   p = p + 5;
-					   continue;
-					}
-				}
-			  }
+/* INTERNAL */
+/* Element parsed here */
+int parse_element(stream_t * stream, xml_element * parent) {
+	int c;
+    char * name;
+    char * q;
+    int len;
+    int match;
+	xml_element * elt;
+	xml_node * n;
+	int child = 1L;
+	int nsmark = stream->nscount;
+	int pathmark = stream->pathlen;
+	int offset = stream->base + stream->runlength;
+	int record;
+	unsigned long usednodes, usedbytes;
 
-			  *q++ = '&';
-			  *q++ = 'a';
-			  *q++ = 'm';
-              *q++ = 'p';
-			  *q++ = ';';
-			} else if (c == '<') {
-			  *q++ = '&';
-			  *q++ = 'l';
-			  *q++ = 't';
-			  *q++ = ';';
-			} else if (c == '>') {
-			  *q++ = '&';
-			  *q++ = 'g';
-			  *q++ = 't';
-			  *q++ = ';';
-			} else if (c == '\r') {
-                if(*p && *p == '\n')  {
-                    *q++ = '\n';
-                     ++p;
-                     continue;
-                }
-            } else {
-              *q++ = c;
+	c = get_c(stream);
+	if( c != '<') {
+		RAISE_ERROR(ELEMENTERROR, ELEMENTERROR, stream, "Element should begin with < symbol", "")
+	}
+
+	/* the name is held in the window as a slice, whatever its length,
+	   until the element has its own copy */
+	stream->mark = stream->runlength;
+    
+	while(1) {
+		c = get_c(stream);
+		RAISE_ERROR(c, ELEMENTERROR, stream, "stream error while reading element", "")
+
+		if(c <= 0x20 || c == '>' || c == '/') {
+          break;
+		}
+
+		if(stream->config.max_name &&
+		   stream->runlength - 1 - stream->mark >= stream->config.max_name) {
+          RAISE_ERROR(NAMELIMIT, NAMELIMIT, stream, "Element name too long", "")
+		}
+	}
+
+	/* at the end of input nothing was read past the name */
+	len = stream->runlength - stream->mark - (c >= 0);
+
+	if( c == '/') {
+		c = get_c(stream);
+		if(c != '>') {
+          RAISE_ERROR(ELEMENTERROR, ELEMENTERROR, stream, "Invalid empty element tag", "")
+		}
+		child = 0L;
+	}
+
+	name = &stream->buf[stream->mark];
+	stream->mark = -1;
+
+	if(!len) {
+       RAISE_ERROR(NAMEERROR, NAMEERROR, stream, "Invalid element name", "")
+	}
+
+	if(c == ENDOFFILE) {
+       RAISE_ERROR(NAMEERROR, NAMEERROR, stream, "No end to a start tag", "")
+	}
+
+	/* in place the name ends where the character after it was */
+	if(stream->inplace) {
+		name[len] = 0;
+	}
+
+	if(stream->path && path_push(stream, name, len) < 0) {
+       c = alloc_failed(stream);
+       RAISE_ERROR(c, c, stream, "Out of memory for element", "")
+	}
+
+	/* config.skip, only tag depth is tracked until the end tag */
+	if(stream->config.skip && skip_match(stream, name, len)) {
+       STAT_ADD(stream, skipped, 1)
+       c = skip_element(stream, c, child);
+       if(c == ENDOFFILE) {
+          RAISE_ERROR(NOENDTAG, NOENDTAG, stream, "No End tag for an element skipped in %s", parent->name)
+       }
+       RAISE_ERROR(c, NOENDTAG, stream, "skipping element in %s", parent->name)
+
+       if(stream->path) {
+          stream->pathlen = pathmark;
+          stream->path[pathmark] = 0;
+       }
+       return 0;
+	}
+
+	if(stream->config.max_depth && stream->depth >= stream->config.max_depth) {
+       RAISE_ERROR(DEPTHLIMIT, DEPTHLIMIT, stream, "Elements nested too deep in %s", parent->name)
+	}
+
+	/* config.record, records inside a record are part of it */
+	record = stream->config.record && stream->config.on_record &&
+	         !stream->inrecord && (*stream->config.record == '/' ?
+	         !strcmp(stream->config.record, stream->path) :
+	         name_is(stream->config.record, name, len));
+
+	/* a record is freed once handed over, and what it used with it */
+	usednodes = stream->nodes;
+	usedbytes = stream->bytes;
+
+	/* name */
+	STAT_PHASE(stream, PHASE_TREE)
+	elt = new_named(stream, ELEMENT, name, len);
+	STAT_PHASE(stream, PHASE_TOKENIZE)
+	if(!elt) {
+       c = alloc_failed(stream);
+       RAISE_ERROR(c, c, stream, "Out of memory for element", "")
+	}
+	elt->offset = offset;
+
+#ifdef XMLC_STATS
+	if(stream->config.stats && 
+	   stream->depth + 1 > stream->config.stats->peak_depth) {
+		stream->config.stats->peak_depth = stream->depth + 1;
+	}
+#endif
+
+	/* attributes */
+	if(c <= 0x20) {
+         stream->attributes = 0;
+         c = parse_attributes(stream, elt, &child);
+		 if( c < 0) {
+			 destroy_node(elt);
+			 return c;
+		 }
+	}
+
+	if(stream->config.namespaces) {
+		STAT_PHASE(stream, PHASE_TREE)
+		c = ns_resolve(stream, elt);
+		STAT_PHASE(stream, PHASE_TOKENIZE)
+		if(c < 0) {
+			c = raise_error(stream, c, "Unbound namespace prefix in %s", elt->name);
+			destroy_node(elt);
+			return c;
+		}
+	}
+
+	if(child) {
+
+      stream->inrecord |= record;
+      stream->depth++;
+      c = parse_node(stream, elt);
+      stream->depth--;
+      if(c < 0) {
+        destroy_node(elt);
+        return c;
+      }
+
+      /* child offsets become relative to this element */
+      for(n = elt->child; n; n = n->sibling) {
+        if(n->type == ELEMENT) {
+          n->offset -= elt->offset;
+        }
+      }
+
+      /* the end tag is matched against the name as it is read */
+      c = get_c(stream);
+      if(c >= 0 && (c != '<' || get_c(stream) != '/')) {
+		 c = raise_error(stream, ENDTAGERROR, "No End tag for %s", elt->name);
+		 destroy_node(elt);
+		 return c;
+      }
+
+      q = elt->name;
+      match = 1;
+
+  	  while(c >= 0) {
+			c = get_c(stream);
+			if(c == '>') {
+			  break;
 			}
 
-		} /* while */
+			if(c == '<') {
+			   c = raise_error(stream, ENDTAGERROR, "No End tag for %s", elt->name);
+			   destroy_node(elt);
+			   return c;
+			}
+
+			if(match) {
+			   match = (unsigned char)*q++ == c;
+			}
+		}
 
-		*q = 0;
+	  if(c < 0) {
+		c = raise_error(stream, NOENDTAG, "No End tag for %s", elt->name);
+		destroy_node(elt);
+		return c;
 	  }
 
-	return buf;
-}
+	  if(!match || *q) {
+		c = raise_error(stream, ENDTAGMISMATCH, "Invalid end tag for %s", elt->name);
+		destroy_node(elt);
+		return c;
+	  }
+	}
 
-/* Use this to normalize the tree. This will merge adjacent text nodes */
-void normalize(xml_node * node) {
-    if(node) {
-        xml_node * child = node->child;
+	elt->length = stream->base + stream->runlength - offset;
+	if(record) {
+		stream->inrecord = 0;
+	}
 
-        while(child) {
-            if(child->type == TEXT) {
-                xml_node * sibling = child->sibling;
+	/* the element's bindings go out of scope */
+	stream->nscount = nsmark;
+	if(stream->path) {
+		stream->pathlen = pathmark;
+		stream->path[pathmark] = 0;
+	}
 
-                if(sibling && sibling->type == TEXT) {
-                    if(child->text && sibling->text) {
-                        char * text = malloc(strlen(child->text) + 
-                                             strlen(sibling->text) + 1);
-                        if(text) {
-                           strcpy(text, child->text);
-                           free(child->text);
-                           strcat(text, sibling->text);
-                           free(sibling->text);
+	STAT_PHASE(stream, PHASE_TREE)
+	add_childorsibling(parent, elt);
+	STAT_PHASE(stream, PHASE_TOKENIZE)
 
-                           child->text = text;
-                           sibling->text = NULL;
+#ifdef DEBUG
+	if(stream->config.nodeflush) {
+		print(elt, stream->config.fp, 0);
+	}
+#endif
 
-                           remove_childorsibiling(node, sibling);
-                           destroy_node(sibling);
+	/* handed over in the tree, so its ancestors can be looked at, and
+	   freed once the callback returns */
+	if(record) {
+		if(stream->inplace) {
+			stream_settle(stream);
+		}
 
-                           /* restart from the current child */
+		c = stream->config.on_record(stream->config.recordctx, elt);
+		remove_childorsibiling(parent, elt);
+		destroy_node(elt);
+		stream->nodes = usednodes;
+		stream->bytes = usedbytes;
+		if(c < 0) {
+			return c;
+		}
+	}
 
-                           continue;
-                        }
-                    }
-                }
-            }
+	return 0;
+}
 
-            /* advance */
-            child = child->sibling;
+/* INTERNAL - the next character that is not white space */
+static int get_nonspace(stream_t * stream) {
+	int c = skip_whitespaces(stream);
 
-        }/* while */
-    }/* node */
+	return c < 0 ? c : get_c(stream);
 }
 
-/* Create an attribute with a name and value  */
-xml_attribute * create_attribute(char * name, 
-								 char * value) {
+/* XML Attributes. Each name and value is a slice of the window, the
+   value found with stream_scan, so either may be any length and is only
+   copied when the attribute is made */
+int parse_attributes(stream_t * stream, xml_element * elt, int * pchild) {
+	int c;
+	int quote;
+	int namelen, value, len;
 
-   xml_attribute * attrib = NULL;
+	for(;;) {
+		c = get_nonspace(stream);
+		if(c == ENDOFFILE) {
+		   RAISE_ERROR(NAMEERROR, NAMEERROR, stream, "No end to the start tag of %s", elt->name)
+		}
+		RAISE_ERROR(c, READERROR, stream, "Error while trimming spaces in element %s", elt->name)
 
-   if(!name) return NULL;
-   attrib = (xml_attribute*)calloc(1, sizeof(xml_attribute));
-   if(attrib) {
-	  attrib->name = malloc(strlen(name) + 1);
-	  strcpy(attrib->name, name);
+		if(c == '>') {
+		   return 0;
+		}
 
-	  attrib->value = process_text(value);
-   }
+		if(c == '/') {
+		   c = get_c(stream);
+		   if(c == ENDOFFILE) {
+			  RAISE_ERROR(NAMEERROR, NAMEERROR, stream, "No end to the start tag of %s", elt->name)
+		   }
+		   if(c != '>') {
+			  RAISE_ERROR(ELEMENTERROR, ELEMENTERROR, stream, "Invalid empty element tag %s", elt->name)
+		   }
 
-   return attrib;
+		   *pchild = 0L;
+		   return 0;
+		}
+
+		/* the name, up to the '=' */
+		stream->mark = stream->runlength - 1;
+		while(c > 0x20 && c != '=' && c != '>' && c != '/') {
+		   if(stream->config.max_name &&
+		      stream->runlength - stream->mark > stream->config.max_name) {
+			  stream->mark = -1;
+			  RAISE_ERROR(NAMELIMIT, NAMELIMIT, stream, "Attribute name too long in %s", elt->name)
+		   }
+		   c = get_c(stream);
+		}
+		namelen = stream->runlength - stream->mark - (c >= 0);
+
+		if(c >= 0 && c <= 0x20) {
+		   c = get_nonspace(stream);
+		}
+
+		quote = 0;
+		if(c == '=' && namelen) {
+		   c = get_nonspace(stream);
+		   if(c == '"' || c == '\'') {
+			  quote = c;
+		   }
+		}
+
+		if(!quote) {
+		   stream->mark = -1;
+		   if(c == ENDOFFILE) {
+			  RAISE_ERROR(NAMEERROR, NAMEERROR, stream, "No end to the start tag of %s", elt->name)
+		   }
+		   RAISE_ERROR(c, READERROR, stream, "Stream error while processing for attributes at %s", elt->name)
+		   RAISE_ERROR(ATTRIBUTEERROR, ATTRIBUTEERROR, stream, "Invalid attribute in %s", elt->name)
+		}
+
+		/* the value, up to the same quote */
+		value = stream->runlength - stream->mark;
+		stream->valueat = value;
+		c = stream_scan(stream, quote);
+		stream->valueat = 0;
+		if(c < 0) {
+		   stream->mark = -1;
+		   if(c == ENDOFFILE) {
+			  RAISE_ERROR(NAMEERROR, NAMEERROR, stream, "No end to the start tag of %s", elt->name)
+		   }
+		   RAISE_ERROR(c, READERROR, stream, "Stream error while processing for attributes at %s", elt->name)
+		}
+
+		len = stream->runlength - stream->mark - value;
+		stream->runlength++;
 
+		c = parse_attr(stream, elt, &stream->buf[stream->mark], namelen,
+		               &stream->buf[stream->mark + value], len);
+		stream->mark = -1;
+		RAISE_ERROR(c, ATTRIBUTEERROR, stream, "Invalid attribute in %s", elt->name)
+
+		/* white space, or the end of the tag, comes next */
+		c = get_c(stream);
+		if(c > 0x20 && c != '>' && c != '/') {
+		   RAISE_ERROR(ATTRIBUTEERROR, ATTRIBUTEERROR, stream, "No space after an attribute in %s", elt->name)
+		}
+		unget_c(stream, 1);
+	}
 }
 
+/* INTERNAL */
+int skip_whitespaces(stream_t * stream) {
+	int c;
+	for(;;) {
+		  c = get_c(stream);
+		  if( c < 0)
+			  return c;
+ 		  if(c <= 0x20) {
+			continue;
+		  } else {
+            unget_c(stream, 1);
+		    break;
+		  }
+	}
+
+	return c;
+}
 
-/* use this to add a child or sibling to a node. This is 
-   the most preferred way to add a child or sibling element
+/*
+ * Parse attributes. Makes the attribute of the namelen bytes at name and
+ * the len bytes of its value, slices of the window
  */
-void  add_childorsibling(xml_node * parent, 
-                         xml_node * childorsibling) {
+int parse_attr(stream_t * stream, xml_element * elt, char * name,
+               int namelen, char * value, int len) {
+	xml_attribute * attrib;
 
-	if(parent &&  childorsibling) {
-		if(parent->child == NULL) {
-		   parent->child = childorsibling;
-		} else {
-		  xml_node * p = parent->child; 
-		  xml_node * q = p;
+	if(stream->config.max_attributes &&
+	   ++stream->attributes > stream->config.max_attributes) {
+	   return ATTRIBUTELIMIT;
+	}
 
-		  while(p) {
-			 q = p;
-			 p = p->sibling;
-		  }
-		  q->sibling = childorsibling;
+	if(stream->config.max_text &&
+	   (unsigned long)len > stream->config.max_text) {
+		return TEXTLIMIT;
+	}
+
+	STAT_PHASE(stream, PHASE_TREE)
+	attrib = new_attribute_at(stream, name, namelen, value, len);
+
+	/* the value did not survive entity expansion */
+	if(attrib && !attrib->value) {
+		if(attrib->flags & FREENAME) {
+			xml_free(attrib->name);
 		}
+		xml_free(attrib);
+		attrib = NULL;
+	}
 
-		childorsibling->sibling = NULL;
-        childorsibling->parent = parent;
+	if(!attrib) {
+		STAT_PHASE(stream, PHASE_TOKENIZE)
+		return alloc_failed(stream);
 	}
+
+	add_attribute(elt, attrib);
+	STAT_PHASE(stream, PHASE_TOKENIZE)
+
+	return 0;
 }
 
-/* Use this to remove child or sibling */
-xml_node * remove_childorsibiling(xml_node * parent, 
-                                  xml_node * childorsibling) {
- 
-	if(parent &&  childorsibling) {
-		if(parent->child == NULL) {
-		   return NULL;
-		} else {
-		  xml_node * p = parent->child; 
-          xml_node * q = p;
+#define XML_NS    "http://www.w3.org/XML/1998/namespace"
+#define XMLNS_NS  "http://www.w3.org/2000/xmlns/"
 
-		  while(p) {
+/* A prefix bound by an xmlns attribute. prefix NULL for the default */
+struct ns_binding_t {
+	const char * prefix;
+	const char * uri;      /* NULL when xmlns="" undeclares the default */
+};
+
+/* INTERNAL - the namespace a prefix is bound to in the current scope */
+static int ns_lookup(stream_t * stream, const char * prefix,
+                     const char ** puri) {
+	int i;
+
+	for(i = stream->nscount - 1; i >= 0; i--) {
+		if(stream->ns[i].prefix == prefix) {
+			*puri = stream->ns[i].uri;
+			return 0;
+		}
+	}
+
+	if(!prefix) {
+		*puri = NULL;
+		return 0;
+	}
+
+	if(!strcmp(prefix, "xml")) {
+		*puri = intern(stream, XML_NS, (int)strlen(XML_NS), 1);
+		return *puri ? 0 : alloc_failed(stream);
+	}
+
+	return NAMESPACEERROR;
+}
+
+/* INTERNAL - splits name into an interned prefix (NULL if none) and
+   local name, and resolves the prefix */
+static int ns_name(stream_t * stream, const char * name, int isattr,
+                   const char ** pns, const char ** plocal) {
+	const char * col = strchr(name, ':');
+	const char * prefix = NULL;
+
+	if(col && col != name && col[1]) {
+		prefix = intern(stream, name, (int)(col - name), 1);
+		if(!prefix) {
+			return alloc_failed(stream);
+		}
+		name = col + 1;
+	}
+
+	*plocal = intern(stream, name, (int)strlen(name), 1);
+	if(!*plocal) {
+		return alloc_failed(stream);
+	}
+
+	/* unprefixed attributes are in no namespace */
+	if(isattr && !prefix) {
+		*pns = NULL;
+		return 0;
+	}
+
+	return ns_lookup(stream, prefix, pns);
+}
+
+/* 
+ * INTERNAL
+ * Namespace processing for an element whose attributes have been read.
+ * Its xmlns attributes are pushed as bindings, which parse_element pops
+ * again at the end tag, then the element and its attributes get their
+ * interned (ns, localname) pairs.
+ */
+int ns_resolve(stream_t * stream, xml_element * elt) {
+	xml_attribute * a;
+	int c;
+
+	for(a = elt->attributes; a; a = a->next) {
+		const char * prefix;
+
+		if(!strcmp(a->name, "xmlns")) {
+			prefix = NULL;
+		} else if(!strncmp(a->name, "xmlns:", 6) && a->name[6]) {
+			prefix = intern(stream, &a->name[6], (int)strlen(&a->name[6]), 1);
+			if(!prefix) {
+				return alloc_failed(stream);
+			}
+		} else {
+			continue;
+		}
+
+		if(stream->nscount == stream->nssize) {
+			int size = stream->nssize ? stream->nssize * 2 : 16;
+			struct ns_binding_t * ns = (struct ns_binding_t *)
+				stream_realloc(stream, stream->ns,
+				               stream->nssize * sizeof(struct ns_binding_t),
+				               size * sizeof(struct ns_binding_t));
+			if(!ns) {
+				return NOMEMORY;
+			}
+			stream->ns = ns;
+			stream->nssize = size;
+		}
+
+		stream->ns[stream->nscount].prefix = prefix;
+		stream->ns[stream->nscount].uri = NULL;
+		if(*a->value) {
+			stream->ns[stream->nscount].uri = 
+				intern(stream, a->value, (int)strlen(a->value), 1);
+			if(!stream->ns[stream->nscount].uri) {
+				return alloc_failed(stream);
+			}
+		}
+		stream->nscount++;
+
+		a->ns = intern(stream, XMLNS_NS, (int)strlen(XMLNS_NS), 1);
+		a->localname = prefix ? prefix : intern(stream, "xmlns", 5, 1);
+		if(!a->ns || !a->localname) {
+			return alloc_failed(stream);
+		}
+	}
+
+	c = ns_name(stream, elt->name, 0, &elt->ns, &elt->localname);
+	if(c < 0) {
+		return c;
+	}
+
+	for(a = elt->attributes; a; a = a->next) {
+		if(!a->localname) {
+			c = ns_name(stream, a->name, 1, &a->ns, &a->localname);
+			if(c < 0) {
+				return c;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* INTERNAL */
+int comment_end_token(stream_t * stream) {
+	int c1;
+    c1 = get_c(stream);
+    if(c1 < 0)
+	   return c1;
+
+    if(c1 == '-') {
+ 	   c1 = get_c(stream);
+	   if(c1 < 0)
+	      return c1;
+			  
+
+	   if( c1 == '>') {
+		  return 1;
+	   } else {
+	 	 unget_c(stream, 1);
+		 unget_c(stream, 1);
+	   }
+	} else {
+	  unget_c(stream, 1);
+	}
+
+	return 0;
+}
+
+/*
+ *
+ * Parse comments 
+ * 
+ */
+int parse_comment(stream_t * stream, xml_node * parent) {
+
+  char * comment = NULL;
+  xml_node * node;
+
+  int c = read_text(stream, '-', comment_end_token, TEXT_ESCAPE, &comment);
+  if(c == TEXTERROR) {
+    RAISE_ERROR(c, TEXTERROR, stream, "Error while looking for comment end char for %s", parent->name)
+  } else if(c == NOMEMORY) {
+    RAISE_ERROR(c, NOMEMORY, stream, "Comment size too big for %s", parent->name)
+  }
+  RAISE_ERROR(c, c, stream, "Invalid comment in %s", parent->name)
+
+  if(comment && *comment) {
+     STAT_PHASE(stream, PHASE_TREE)
+     node = new_textnode(stream, COMMENT, comment, c == 0);
+     add_childorsibling(parent, node);
+     STAT_PHASE(stream, PHASE_TOKENIZE)
+     if(!node) {
+        c = alloc_failed(stream);
+        RAISE_ERROR(c, c, stream, "Out of memory for a comment in %s", parent->name)
+     }
+  } else if(c == 0) {
+     xml_free(comment);
+  }
+
+    
+
+#ifdef DEBUG
+  if(stream->config.nodeflush) {
+ 	 print(node, stream->config.fp, 0);
+  }
+#endif
+
+  return 0;
+}
+
+/* INTERNAL */
+int scan_comment(stream_t * stream) {
+
+  int c1, c2 ,c;
+  c1 = c2 = c = 0;
+
+  for(;;) {
+		c2 = c1;
+		c1 = c;
+		c = get_c(stream);
+		if ( c < 0) return COMMENTERROR;
+		
+        if(c == '>' && c1 =='-' && c2 =='-') 
+			return c;
+  }
+  
+  /* to shut the compiler */
+  return 0;
+}
+
+
+/* INTERNAL - appends /name, len bytes, to the element path, see
+   config.skip */
+int path_push(stream_t * stream, const char * name, int len) {
+  if(stream->pathlen + len + 2 > stream->pathsize) {
+	int size = stream->pathsize * 2;
+	char * p;
+
+	while(stream->pathlen + len + 2 > size) {
+	  size *= 2;
+	}
+
+	p = (char *)stream_realloc(stream, stream->path, stream->pathsize, size);
+	if(!p) {
+	  return NOMEMORY;
+	}
+
+	stream->path = p;
+	stream->pathsize = size;
+  }
+
+  stream->path[stream->pathlen++] = '/';
+  memcpy(&stream->path[stream->pathlen], name, len);
+  stream->pathlen += len;
+  stream->path[stream->pathlen] = 0;
+  return 0;
+}
+
+/* INTERNAL - whether config.skip names the element being read */
+int skip_match(stream_t * stream, const char * name, int len) {
+  const char ** skip;
+
+  for(skip = stream->config.skip; *skip; skip++) {
+	if(**skip == '/' ? !strcmp(*skip, stream->path) :
+	                   name_is(*skip, name, len)) {
+	  return 1;
+	}
+  }
+
+  return 0;
+}
+
+/* INTERNAL - to the '>' closing a tag, quoted values may hold '>'.
+   Returns 1 for an empty element tag */
+static int skip_tag(stream_t * stream) {
+  int quote = 0;
+  int prev = 0;
+  int c;
+
+  for(;;) {
+	c = get_c(stream);
+	if(c < 0) {
+	  return c;
+	}
+
+	if(quote) {
+	  if(c == quote) {
+		quote = 0;
+	  }
+	} else if(c == '"' || c == '\'') {
+	  quote = c;
+	} else if(c == '>') {
+	  return prev == '/';
+	}
+
+	prev = c;
+  }
+}
+
+/* INTERNAL - past the end token of a comment, CDATA section or PI,
+   whose last character is '>'. The window keeps the bytes before the
+   read position, so the rest of the token is checked there */
+static int skip_until(stream_t * stream, const char * end) {
+  int len = (int)strlen(end) - 1;
+
+  for(;;) {
+	int c = stream_scan(stream, '>');
+	if(c < 0) {
+	  return c;
+	}
+
+	stream->runlength++;
+	if(!memcmp(&stream->buf[stream->runlength - 1 - len], end, len)) {
+	  return 0;
+	}
+  }
+}
+
+/* 
+ * INTERNAL
+ * config.skip. Reads past an element whose name has been read, c being
+ * the character after it, without building anything: the content is
+ * scanned a window at a time for '<' and only the tag depth is kept.
+ * Skipped content is not checked beyond its tags balancing.
+ */
+int skip_element(stream_t * stream, int c, int child) {
+  int depth = 1;
+
+  if(c != '>') {
+	c = skip_tag(stream);
+	if(c < 0) {
+	  return c;
+	}
+	child = !c;
+  }
+
+  if(!child) {
+	return 0;
+  }
+
+  while(depth) {
+	c = stream_scan(stream, '<');
+	if(c >= 0) {
+	  stream->runlength++;
+	  c = get_c(stream);
+	}
+	if(c < 0) {
+	  return c;
+	}
+
+	if(c == '/') {
+	  c = skip_tag(stream);
+	  depth--;
+	} else if(c == '?') {
+	  c = skip_until(stream, "?>");
+	} else if(c == '!') {
+	  c = get_c(stream);
+	  if(c == '-') {
+		c = skip_until(stream, "-->");
+	  } else if(c == '[') {
+		c = skip_until(stream, "]]>");
+	  } else if(c >= 0) {
+		c = skip_tag(stream);
+	  }
+	} else {
+	  unget_c(stream, 1);
+	  c = skip_tag(stream);
+	  if(c == 0) {
+		depth++;
+	  }
+	}
+
+	if(c < 0) {
+	  return c;
+	}
+  }
+
+  return 0;
+}
+
+/* Use print to print a tree from a given node */
+void print(xml_node * node, void *fp, int depth) {
+  FILE * file = (FILE *)fp;
+
+  if(file == NULL) {
+	  return;
+  }
+
+  /* Siblings are looped over rather than recursed on, so wide trees
+     do not cost a stack frame per sibling */
+  for(; node; node = node->sibling) {
+    int level = depth;
+    int i = 0;
+
+    for(; i < level; i++) {
+         fprintf(file, "%c", '\t');
+    }
+
+    if(node->type == ELEMENT) {
+      xml_element * element = node;
+
+      fprintf(file, "<%s", element->name);
+      if(element->attributes) {
+	     xml_attribute * p = element->attributes;
+         for (p =  element->attributes; p; p = p->next) {
+	 	    fprintf(file, " %s=\"%s\"", p->name, p->value);
+	    }
+	  }
+	  if(node->child)
+        fprintf(file, "%c\n", '>');
+	  else {
+        fprintf(file, "%s\n", "/>");
+	  }
+    } else if ( node->type == CDATA) {
+       fprintf(file, "<![CDATA[%s\n]]>", node->text);
+    } else if (node->type == COMMENT) {
+       fprintf(file, "<!--%s-->", node->text);
+    } else if (node->type == TEXT) {/* text */
+       fprintf(file, "%s", node->text);
+    } else if (node->type == ENTITY) {
+       fprintf(file, "<!%s %s>\n", node->name, node->text);
+    } else if (node->type == PI) {
+       fprintf(file, "<?%s %s?>\n", node->name, node->text);
+    } else if (node->type == DOCUMENT) {
+        --level;
+    }
+
+    /* No work if this is a Document.
+     */
+
+    /* Recurse on child */
+    print(node->child, file, level + 1);
+
+    if(node->child && (node->type == ELEMENT)) {
+      int j = 0;
+	  for(; j < level; j++) {
+         fprintf(file, "%c", '\t');
+	  }
+      fprintf(file, "</%s>\n", node->name);
+    } 
+  }
+
+  fflush(file);
+  
+}
+
+/* Use this to remove attribute from an element */
+void remove_attribute(xml_element * element,
+						      char * name) {
+	if( element && name ) {
+        xml_attribute * p, *q;
+		for( q = p = element->attributes; 
+		     p; 
+			 q = p, p = p->next) {
+
+				 if(strcmp( p->name, name) == 0) {
+					 index_attribute(index_of(element), element, p, 0);
+					 if(q == p) {
+                        element->attributes = p->next;
+					 } else {
+					    q->next = p->next;
+					 }
+					 xml_touch(element);
+
+					 if(p->flags & FREENAME) {
+						 xml_free(p->name);
+					 }
+					 if(p->flags & FREETEXT) {
+						 xml_free(p->value);
+					 }
+					 if(!(p->flags & INARENA)) {
+						 xml_free(p);
+					 }
+					 break;
+				 }
+		}
+	 }
+}
+
+/* Use this to add attribute from an element */
+void add_attribute(xml_element * element,
+				   xml_attribute * attrib) {
+
+	if( element && attrib ) {
+		xml_index * ix = index_of(element);
+
+		xml_touch(element);
+		if(element->attributes) {
+          xml_attribute * p  = element->attributes;
+
+          while(p) {
+			  if(strcmp(p->name, attrib->name) == 0) {
+				  index_attribute(ix, element, p, 0);
+				  if(p->value && (p->flags & FREETEXT)) xml_free(p->value);
+			      p->value = attrib->value;
+				  p->flags = (p->flags & ~FREETEXT) | (attrib->flags & FREETEXT);
+				  index_attribute(ix, element, p, 1);
+
+				  if(attrib->flags & FREENAME) xml_free(attrib->name);
+				  xml_free(attrib);
+				  return;
+			  }
+			  p = p->next;
+		  }
+
+  		  attrib->next = element->attributes;
+		}
+
+  	    element->attributes = attrib;
+		index_attribute(ix, element, attrib, 1);
+	}
+}
+
+/* Characters process_text rewrites, 1 + the most each can grow by */
+static const unsigned char text_special[256] = {
+	['"'] = 6, ['\''] = 6, ['`'] = 6, ['&'] = 5,
+	['<'] = 4, ['>'] = 4, ['\r'] = 1
+};
+
+/* INTERNAL - length of the predefined entity reference p starts with
+   (past the '&'), 0 if none */
+static int predefined_ref(const char * p, const char * end) {
+	if(end - p >= 3 && (!memcmp(p, "lt;", 3) || !memcmp(p, "gt;", 3))) {
+		return 3;
+	}
+	if(end - p >= 4 && !memcmp(p, "amp;", 4)) {
+		return 4;
+	}
+	if(end - p >= 5 && (!memcmp(p, "quot;", 5) || !memcmp(p, "apos;", 5))) {
+		return 5;
+	}
+
+	return 0;
+}
+
+/* INTERNAL - length of the character reference p starts with (at the
+   '#'), its code point in *pcp. 0 if none or not an XML character */
+static int char_ref(const char * p, const char * end, unsigned long * pcp) {
+	const char * q = p + 1;
+	unsigned long cp = 0;
+	int hex = 0;
+	int digits = 0;
+
+	if(q < end && *q == 'x') {
+		hex = 1;
+		q++;
+	}
+
+	for(; q < end && *q != ';'; q++, digits++) {
+		int c = (unsigned char)*q;
+		int d;
+
+		if(c >= '0' && c <= '9') {
+			d = c - '0';
+		} else if(hex && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+			d = (c | 0x20) - 'a' + 10;
+		} else {
+			return 0;
+		}
+
+		cp = cp * (hex ? 16 : 10) + d;
+		if(cp > 0x10FFFF) {
+			return 0;
+		}
+	}
+
+	if(q == end || !digits) {
+		return 0;
+	}
+
+	if(cp < 0x20 ? (cp != 0x9 && cp != 0xA && cp != 0xD) :
+	   (cp >= 0xD800 && cp <= 0xDFFF) || cp == 0xFFFE || cp == 0xFFFF) {
+		return 0;
+	}
+
+	*pcp = cp;
+	return (int)(q - p) + 1;
+}
+
+/* INTERNAL - writes c as process_text would, returns the new end */
+static char * escape_char(char * q, int c) {
+	const char * s;
+
+	switch(c) {
+	case '"':
+	case '\'': s = "&quot;"; break;
+	case '`':  s = "&apos;"; break;
+	case '&':  s = "&amp;"; break;
+	case '<':  s = "&lt;"; break;
+	case '>':  s = "&gt;"; break;
+	default:
+		*q++ = (char)c;
+		return q;
+	}
+
+	while(*s) {
+		*q++ = *s++;
+	}
+
+	return q;
+}
+
+/* INTERNAL - code point cp as UTF-8 */
+static char * put_utf8(char * q, unsigned long cp) {
+	if(cp < 0x80) {
+		*q++ = (char)cp;
+		return q;
+	}
+
+	if(cp < 0x800) {
+		*q++ = (char)(0xC0 | (cp >> 6));
+	} else {
+		if(cp < 0x10000) {
+			*q++ = (char)(0xE0 | (cp >> 12));
+		} else {
+			*q++ = (char)(0xF0 | (cp >> 18));
+			*q++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+		}
+		*q++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+	}
+	*q++ = (char)(0x80 | (cp & 0x3F));
+
+	return q;
+}
+
+/* INTERNAL - code point cp as UTF-8, escaped like any other character.
+   A referenced \r is kept, it is not a line end */
+static char * put_char(char * q, unsigned long cp) {
+	if(cp < 0x80) {
+		return escape_char(q, (int)cp);
+	}
+
+	return put_utf8(q, cp);
+}
+
+/*
+ * Encodings. The parser works on UTF-8. With config.validate_utf8 the
+ * input is checked as it is read; runs of ASCII, which is most of any
+ * document, are skipped 32 bytes at a time. UTF-16 (told by its BOM) is
+ * transcoded before parsing.
+ */
+
+/* INTERNAL - 1 if the 32 bytes at p are all ASCII */
+static int ascii32(const unsigned char * p) {
+#if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	return !_mm256_movemask_epi8(v);
+#elif defined(__SSE2__)
+	__m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)p),
+	                         _mm_loadu_si128((const __m128i *)(p + 16)));
+	return !_mm_movemask_epi8(v);
+#else
+	uint64_t w[4];
+	memcpy(w, p, sizeof(w));
+	return !((w[0] | w[1] | w[2] | w[3]) & 0x8080808080808080ULL);
+#endif
+}
+
+/* 
+ * INTERNAL
+ * Checks len more bytes of UTF-8. state carries a sequence split between
+ * calls: 0 to start with, and 0 is returned when the bytes end on a
+ * character boundary. Returns -1 for malformed input, overlongs,
+ * surrogates and code points past U+10FFFF included.
+ */
+int utf8_validate(int state, const char * text, int len) {
+	const unsigned char * p = (const unsigned char *)text;
+	const unsigned char * end = p + len;
+	int need = state >> 16;
+	int lo = (state >> 8) & 0xFF;
+	int hi = state & 0xFF;
+
+	while(p < end) {
+		const unsigned char * stop;
+
+		if(!need && end - p >= 32 && ascii32(p)) {
+			p += 32;
+			continue;
+		}
+
+		/* a block with something else in it, a byte at a time */
+		stop = end - p > 32 ? p + 32 : end;
+		while(p < stop) {
+			int c = *p++;
+
+			if(need) {
+				if(c < lo || c > hi) {
+					return -1;
+				}
+				need--;
+				lo = 0x80;
+				hi = 0xBF;
+			} else if(c >= 0x80) {
+				if(c < 0xC2) {
+					return -1;
+				} else if(c < 0xE0) {
+					need = 1;
+					lo = 0x80;
+					hi = 0xBF;
+				} else if(c < 0xF0) {
+					need = 2;
+					lo = (c == 0xE0) ? 0xA0 : 0x80;
+					hi = (c == 0xED) ? 0x9F : 0xBF;
+				} else if(c < 0xF5) {
+					need = 3;
+					lo = (c == 0xF0) ? 0x90 : 0x80;
+					hi = (c == 0xF4) ? 0x8F : 0xBF;
+				} else {
+					return -1;
+				}
+			}
+		}
+	}
+
+	return need ? (need << 16 | lo << 8 | hi) : 0;
+}
+
+/* INTERNAL - 1 for big endian UTF-16, 0 for little, -1 if no BOM */
+int utf16_bom(const char * buf, int len) {
+	const unsigned char * p = (const unsigned char *)buf;
+
+	if(len >= 2 && p[0] == 0xFE && p[1] == 0xFF) {
+		return 1;
+	}
+	if(len >= 2 && p[0] == 0xFF && p[1] == 0xFE) {
+		return 0;
+	}
+
+	return -1;
+}
+
+/* 
+ * INTERNAL
+ * Converts whole UTF-16 units from in to UTF-8, while room lasts. A
+ * surrogate pair split at the end of in is left for the next call
+ * unless final. *pused gets the bytes of in consumed. Returns the bytes
+ * written, -1 for an unpaired surrogate or an odd trailing byte.
+ */
+static int utf16_convert(const unsigned char * in, int len, int bigendian,
+                         char * out, int room, int * pused, int final) {
+	char * q = out;
+	int i = 0;
+
+	while(len - i >= 2 && room - (q - out) >= 4) {
+		unsigned long u = bigendian ? (in[i] << 8 | in[i + 1]) :
+		                              (in[i + 1] << 8 | in[i]);
+		int n = 2;
+
+		if(u >= 0xD800 && u <= 0xDBFF) {
+			unsigned long low;
+
+			if(len - i < 4) {
+				if(final) {
+					return -1;
+				}
+				break;
+			}
+
+			low = bigendian ? (in[i + 2] << 8 | in[i + 3]) :
+			                  (in[i + 3] << 8 | in[i + 2]);
+			if(low < 0xDC00 || low > 0xDFFF) {
+				return -1;
+			}
+
+			u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+			n = 4;
+		} else if(u >= 0xDC00 && u <= 0xDFFF) {
+			return -1;
+		}
+
+		q = put_utf8(q, u);
+		i += n;
+	}
+
+	if(final && len - i == 1) {
+		return -1;
+	}
+
+	*pused = i;
+	return (int)(q - out);
+}
+
+/* 
+ * INTERNAL
+ * buf, UTF-16 with a BOM, as a new UTF-8 buffer. The length goes to
+ * *plen, or the error code when NULL is returned.
+ */
+char * utf16_decode(const char * buf, int len, int * plen) {
+	int bigendian = utf16_bom(buf, len);
+	char * out;
+	int used;
+	int n;
+
+	/* a unit is at most 3 bytes of UTF-8, a pair 4 */
+	out = (char *)xml_malloc(len / 2 * 3 + 4);
+	if(!out) {
+		*plen = NOMEMORY;
+		return NULL;
+	}
+
+	n = utf16_convert((const unsigned char *)buf + 2, len - 2, bigendian,
+	                  out, len / 2 * 3 + 4, &used, 1);
+	if(n < 0) {
+		xml_free(out);
+		*plen = ENCODINGERROR;
+		return NULL;
+	}
+
+	*plen = n;
+	return out;
+}
+
+/* UTF-16 transcoding source, stacked on the real one by stream_bom */
+typedef struct utf16_source_t {
+	pfn_read read;
+	void * ctx;
+	int bigendian;
+	int * invalid;        /* the stream's, set on bad input */
+	unsigned char * in;   /* raw bytes read but not converted yet */
+	int inlen;
+	int size;
+	int eof;
+} utf16_source;
+
+/* INTERNAL - pfn_read for utf16_source */
+int utf16_read(void * ctx, char * buf, int len) {
+	utf16_source * src = (utf16_source *)ctx;
+
+	for(;;) {
+		int used = 0;
+		int n = utf16_convert(src->in, src->inlen, src->bigendian,
+		                      buf, len, &used, src->eof);
+		if(n < 0) {
+			*src->invalid = 1;
+			return -1;
+		}
+
+		memmove(src->in, src->in + used, src->inlen - used);
+		src->inlen -= used;
+
+		if(n > 0 || src->eof) {
+			return n;
+		}
+
+		n = src->read(src->ctx, (char *)src->in + src->inlen,
+		              src->size - src->inlen);
+		if(n < 0) {
+			return n;
+		}
+
+		src->eof = (n == 0);
+		src->inlen += n;
+	}
+}
+
+/* 
+ * INTERNAL
+ * Looks at the start of the input for a byte order mark. A UTF-8 one is
+ * skipped. For UTF-16 from a source, utf16_read is put in front of it
+ * and the bytes already read are handed over to it. Returns < 0 on error.
+ */
+int stream_bom(stream_t * stream) {
+	char * p = &stream->buf[stream->runlength];
+	int len = stream->length - stream->runlength;
+	utf16_source * src;
+
+	if(len >= 3 && !memcmp(p, "\xEF\xBB\xBF", 3)) {
+		stream->runlength += 3;
+		return 0;
+	}
+
+	if(!stream->read || utf16_bom(p, len) < 0) {
+		return 0;
+	}
+
+	src = (utf16_source *)stream_calloc(stream, 1, sizeof(utf16_source));
+	if(!src) {
+		return NOMEMORY;
+	}
+
+	src->size = len > READ_SIZE ? len : READ_SIZE;
+	src->in = (unsigned char *)stream_malloc(stream, src->size);
+	if(!src->in) {
+		xml_free(src);
+		return NOMEMORY;
+	}
+
+	src->read = stream->read;
+	src->ctx = stream->readctx;
+	src->bigendian = utf16_bom(p, len);
+	src->invalid = &stream->invalid;
+	src->eof = stream->eof;
+	src->inlen = len - 2;
+	memcpy(src->in, p + 2, len - 2);
+
+	stream->read = utf16_read;
+	stream->readctx = src;
+	stream->utf16 = src;
+	stream->length = stream->runlength;
+	stream->eof = 0;
+	stream->utf8 = 0;
+
+	return stream_fill(stream) < 0 ? FILEERROR : 0;
+}
+
+/* INTERNAL */
+void utf16_free(void * source) {
+	utf16_source * src = (utf16_source *)source;
+
+	if(src) {
+		xml_free(src->in);
+		xml_free(src);
+	}
+}
+
+/*
+ * Compressed input. gzip and zstd, told by their magic bytes, are
+ * inflated by a source stacked on the real one, as for UTF-16, so the
+ * parser only sees the XML. Members (frames) written one after another
+ * are read on to the end. Built with XMLC_ZLIB and XMLC_ZSTD.
+ */
+typedef struct inflate_source_t {
+	pfn_read read;
+	void * ctx;
+	int kind;
+	int * corrupt;        /* the stream's, set on bad or truncated input */
+	unsigned char * in;   /* compressed bytes, inpos to inlen not used yet */
+	int inpos;
+	int inlen;
+	int size;
+	int eof;
+	int between;          /* a member has ended, another may follow */
+	int end;              /* nothing follows */
+#ifdef XMLC_ZLIB
+	z_stream z;
+#endif
+#ifdef XMLC_ZSTD
+	ZSTD_DStream * zd;
+#endif
+} inflate_source;
+
+/* INTERNAL - which compression buf starts with, COMPRESS_NONE if any */
+int compress_magic(const char * buf, int len) {
+	if(len >= 2 && !memcmp(buf, "\x1F\x8B", 2)) {
+		return COMPRESS_GZIP;
+	}
+	if(len >= 4 && !memcmp(buf, "\x28\xB5\x2F\xFD", 4)) {
+		return COMPRESS_ZSTD;
+	}
+	return COMPRESS_NONE;
+}
+
+#ifdef XMLC_ZLIB
+/* INTERNAL - zlib allocates through xml_malloc too, charged to the
+   stream passed as opaque */
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+	return stream_malloc((stream_t *)opaque, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf p) {
+	(void)opaque;
+	xml_free(p);
+}
+#endif
+
+/* INTERNAL - inflates what is in src->in into buf, returns bytes made */
+static int inflate_block(inflate_source * src, char * buf, int len) {
+	int n = -1;
+
+#if !defined(XMLC_ZLIB) && !defined(XMLC_ZSTD)
+	(void)src;
+	(void)buf;
+	(void)len;
+#endif
+
+#ifdef XMLC_ZLIB
+	if(src->kind == COMPRESS_GZIP) {
+		int ret;
+
+		if(src->between) {
+			inflateReset(&src->z);
+			src->between = 0;
+		}
+
+		src->z.next_in = src->in + src->inpos;
+		src->z.avail_in = src->inlen - src->inpos;
+		src->z.next_out = (Bytef *)buf;
+		src->z.avail_out = len;
+
+		ret = inflate(&src->z, Z_NO_FLUSH);
+		if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+			return -1;
+		}
+
+		src->inpos = src->inlen - src->z.avail_in;
+		src->between = (ret == Z_STREAM_END);
+		n = len - src->z.avail_out;
+	}
+#endif
+
+#ifdef XMLC_ZSTD
+	if(src->kind == COMPRESS_ZSTD) {
+		ZSTD_inBuffer in;
+		ZSTD_outBuffer out;
+		size_t ret;
+
+		in.src = src->in;
+		in.size = src->inlen;
+		in.pos = src->inpos;
+		out.dst = buf;
+		out.size = len;
+		out.pos = 0;
+
+		/* a new frame starts by itself once one ends */
+		ret = ZSTD_decompressStream(src->zd, &out, &in);
+		if(ZSTD_isError(ret)) {
+			return -1;
+		}
+
+		src->inpos = (int)in.pos;
+		src->between = (ret == 0);
+		n = (int)out.pos;
+	}
+#endif
+
+	return n;
+}
+
+/* INTERNAL - pfn_read for inflate_source */
+int inflate_read(void * ctx, char * buf, int len) {
+	inflate_source * src = (inflate_source *)ctx;
+
+	while(!src->end) {
+		int n;
+
+		if(src->inpos == src->inlen && !src->eof) {
+			n = src->read(src->ctx, (char *)src->in, src->size);
+			if(n < 0) {
+				return n;
+			}
+
+			src->eof = (n == 0);
+			src->inpos = 0;
+			src->inlen = n;
+		}
+
+		/* the input ends where a member does */
+		if(src->between && src->inpos == src->inlen) {
+			src->end = 1;
+			break;
+		}
+
+		n = inflate_block(src, buf, len);
+		if(n < 0) {
+			*src->corrupt = 1;
+			return -1;
+		}
+
+		if(n > 0) {
+			return n;
+		}
+
+		/* ... and not in the middle of one */
+		if(src->inpos == src->inlen && src->eof && !src->between) {
+			*src->corrupt = 1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* INTERNAL */
+void inflate_free(void * source) {
+	inflate_source * src = (inflate_source *)source;
+
+	if(src) {
+#ifdef XMLC_ZLIB
+		if(src->kind == COMPRESS_GZIP) {
+			inflateEnd(&src->z);
+		}
+#endif
+#ifdef XMLC_ZSTD
+		if(src->kind == COMPRESS_ZSTD) {
+			ZSTD_freeDStream(src->zd);
+		}
+#endif
+		xml_free(src->in);
+		xml_free(src);
+	}
+}
+
+/* 
+ * INTERNAL
+ * Looks at the start of the input for gzip or zstd. For either,
+ * inflate_read is put in front of the source and the bytes already read
+ * are handed over to it. COMPRESSERROR for compressed input the library
+ * was built without support for. Returns < 0 on error.
+ */
+int stream_inflate(stream_t * stream) {
+	char * p = &stream->buf[stream->runlength];
+	int len = stream->length - stream->runlength;
+	int kind = compress_magic(p, len);
+	inflate_source * src;
+
+	if(!stream->read || kind == COMPRESS_NONE) {
+		return 0;
+	}
+
+#ifndef XMLC_ZLIB
+	if(kind == COMPRESS_GZIP) {
+		return COMPRESSERROR;
+	}
+#endif
+#ifndef XMLC_ZSTD
+	if(kind == COMPRESS_ZSTD) {
+		return COMPRESSERROR;
+	}
+#endif
+
+	src = (inflate_source *)stream_calloc(stream, 1, sizeof(inflate_source));
+	if(!src) {
+		return NOMEMORY;
+	}
+
+	src->size = len > READ_SIZE ? len : READ_SIZE;
+	src->in = (unsigned char *)stream_malloc(stream, src->size);
+	if(!src->in) {
+		xml_free(src);
+		return NOMEMORY;
+	}
+
+#ifdef XMLC_ZLIB
+	if(kind == COMPRESS_GZIP) {
+		src->z.zalloc = zlib_alloc;
+		src->z.zfree = zlib_free;
+		src->z.opaque = stream;
+
+		/* 15 + 32, the largest window and a gzip header */
+		if(inflateInit2(&src->z, 15 + 32) != Z_OK) {
+			xml_free(src->in);
+			xml_free(src);
+			return NOMEMORY;
+		}
+	}
+#endif
+#ifdef XMLC_ZSTD
+	/* zstd allocates with malloc, its custom allocators are not stable API */
+	if(kind == COMPRESS_ZSTD) {
+		src->zd = ZSTD_createDStream();
+		if(!src->zd || ZSTD_isError(ZSTD_initDStream(src->zd))) {
+			ZSTD_freeDStream(src->zd);
+			xml_free(src->in);
+			xml_free(src);
+			return NOMEMORY;
+		}
+	}
+#endif
+
+	src->kind = kind;
+	src->read = stream->read;
+	src->ctx = stream->readctx;
+	src->corrupt = &stream->corrupt;
+	src->eof = stream->eof;
+	src->inlen = len;
+	memcpy(src->in, p, len);
+
+	stream->read = inflate_read;
+	stream->readctx = src;
+	stream->inflate = src;
+	stream->length = stream->runlength;
+	stream->eof = 0;
+
+	if(stream_fill(stream) < 0) {
+		return stream->corrupt ? COMPRESSERROR : FILEERROR;
+	}
+	return 0;
+}
+
+/*
+ * Internal entities, declared in the DOCTYPE internal subset.
+ * Declarations go into a hash table that lives for one parse. An entity
+ * is expanded on first use and the result kept, so each one is built
+ * once however often it is referenced. Everything expansion produces
+ * is charged against config.max_entity_bytes, and entities may nest
+ * config.max_entity_depth deep, which stops "billion laughs" documents.
+ */
+typedef struct entity_t {
+	char * name;         /* NULL for a free slot. One block with value */
+	int namelen;
+	char * value;        /* replacement text as declared */
+	int valuelen;
+	char * expanded;     /* value through expand_text, once used */
+	int expandedlen;
+	int busy;            /* being expanded, catches recursion */
+} entity_t;
+
+struct entity_table_t {
+	entity_t * slots;    /* open addressing, size is a power of 2 */
+	int size;
+	int count;
+	int depth;
+	int max_depth;
+	unsigned long bytes; /* produced by expansion so far */
+	unsigned long max_bytes;
+	int failed;          /* a limit was hit, see read_text */
+};
+
+#define ENTITY_DEPTH 16
+#define ENTITY_BYTES (8UL * 1024 * 1024)
+
+/* INTERNAL */
+static entity_t * entity_slot(entity_table * table, const char * name,
+                              int namelen) {
+	int i = (int)(hash_bytes(name, namelen, 0) & (table->size - 1));
+
+	for(;;) {
+		entity_t * e = &table->slots[i];
+		if(!e->name || (e->namelen == namelen &&
+		                !memcmp(e->name, name, namelen))) {
+			return e;
+		}
+		i = (i + 1) & (table->size - 1);
+	}
+}
+
+/* INTERNAL */
+static int entity_failed(entity_table * entities) {
+	return entities && entities->failed;
+}
+
+/* INTERNAL */
+static void entity_table_free(entity_table * table) {
+	int i;
+
+	if(!table) {
+		return;
+	}
+
+	for(i = 0; i < table->size; i++) {
+		xml_free(table->slots[i].name);
+		xml_free(table->slots[i].expanded);
+	}
+
+	xml_free(table->slots);
+	xml_free(table);
+}
+
+/* INTERNAL - the first declaration of a name is the one used */
+static void entity_declare(stream_t * stream, const char * name, int namelen,
+                           const char * value, int valuelen) {
+	config_t * config = &stream->config;
+	entity_table * entities = stream->entities;
+	entity_t * e;
+
+	if(!entities) {
+		entities = (entity_table *)stream_calloc(stream, 1, sizeof(entity_table));
+		if(!entities) {
+			return;
+		}
+
+		entities->size = 16;
+		entities->slots = (entity_t *)stream_calloc(stream, entities->size,
+		                                            sizeof(entity_t));
+		entities->max_depth = config->max_entity_depth > 0 ?
+		                      config->max_entity_depth : ENTITY_DEPTH;
+		entities->max_bytes = config->max_entity_bytes > 0 ?
+		                      config->max_entity_bytes : ENTITY_BYTES;
+		if(!entities->slots) {
+			xml_free(entities);
+			return;
+		}
+		stream->entities = entities;
+	}
+
+	if((entities->count + 1) * 4 > entities->size * 3) {
+		entity_table grown = *entities;
+		int i;
+
+		grown.size *= 2;
+		grown.slots = (entity_t *)stream_calloc(stream, grown.size,
+		                                        sizeof(entity_t));
+		if(!grown.slots) {
+			return;
+		}
+
+		for(i = 0; i < entities->size; i++) {
+			entity_t * old = &entities->slots[i];
+			if(old->name) {
+				*entity_slot(&grown, old->name, old->namelen) = *old;
+			}
+		}
+
+		stream_free(stream, entities->slots,
+		            entities->size * sizeof(entity_t));
+		*entities = grown;
+	}
+
+	e = entity_slot(entities, name, namelen);
+	if(e->name) {
+		return;
+	}
+
+	e->name = (char *)stream_malloc(stream, namelen + valuelen + 2);
+	if(!e->name) {
+		return;
+	}
+
+	memcpy(e->name, name, namelen);
+	e->name[namelen] = 0;
+	e->namelen = namelen;
+	e->value = e->name + namelen + 1;
+	memcpy(e->value, value, valuelen);
+	e->value[valuelen] = 0;
+	e->valuelen = valuelen;
+	entities->count++;
+}
+
+/* INTERNAL - the declared entity p names (past the '&'), expanded, with
+   the length of the reference in *pn. NULL if there is none or it could
+   not be expanded, entities->failed tells */
+static entity_t * entity_ref(stream_t * stream, const char * p,
+                             const char * end, int * pn) {
+	entity_table * entities = stream->entities;
+	const char * semi;
+	entity_t * e;
+
+	semi = (const char *)memchr(p, ';', end - p);
+	if(!semi || semi == p) {
+		return NULL;
+	}
+
+	e = entity_slot(entities, p, (int)(semi - p));
+	if(!e->name) {
+		return NULL;
+	}
+
+	if(!e->expanded) {
+		if(e->busy || entities->depth >= entities->max_depth) {
+			entities->failed = 1;
+			return NULL;
+		}
+
+		e->busy = 1;
+		entities->depth++;
+		e->expanded = escape_refs(stream, e->value, e->valuelen, 1);
+		entities->depth--;
+		e->busy = 0;
+
+		if(!e->expanded) {
+			return NULL;
+		}
+
+		e->expandedlen = (int)strlen(e->expanded);
+	}
+
+	*pn = (int)(semi - p) + 1;
+	return e;
+}
+
+/* INTERNAL
+ * Registers the <!ENTITY name "value"> declarations of a DOCTYPE's
+ * internal subset, p being the declaration past "<!DOCTYPE". Parameter
+ * entities and external (SYSTEM/PUBLIC) entities are skipped.
+ */
+void declare_entities(stream_t * stream, const char * p, int len) {
+	const char * end = p + len;
+	int quote = 0;
+
+	/* the subset starts at the first '[' outside the quoted ids */
+	for(; p < end; p++) {
+		if(quote) {
+			quote = (*p == quote) ? 0 : quote;
+		} else if(*p == '"' || *p == '\'') {
+			quote = *p;
+		} else if(*p == '[') {
+			break;
+		}
+	}
+
+	for(++p; p < end && *p != ']';) {
+		if((unsigned char)*p <= 0x20) {
+			p++;
+			continue;
+		}
+
+		if(end - p >= 4 && !memcmp(p, "<!--", 4)) {
+			for(p += 4; end - p >= 3 && memcmp(p, "-->", 3); p++)
+				;
+			p += 3;
+			continue;
+		}
+
+		if(end - p > 9 && !memcmp(p, "<!ENTITY", 8) &&
+		   (unsigned char)p[8] <= 0x20) {
+			const char * name;
+			const char * value;
+
+			for(p += 8; p < end && (unsigned char)*p <= 0x20; p++)
+				;
+			for(name = p; p < end && (unsigned char)*p > 0x20 && *p != '>'; p++)
+				;
+			len = (int)(p - name);
+
+			for(; p < end && (unsigned char)*p <= 0x20; p++)
+				;
+
+			if(*name != '%' && p < end && (*p == '"' || *p == '\'')) {
+				quote = *p++;
+				value = p;
+				while(p < end && *p != quote) {
+					p++;
+				}
+
+				if(p < end) {
+					entity_declare(stream, name, len, value, (int)(p++ - value));
+				}
+			}
+		}
+
+		/* whatever else this is, it ends at the next unquoted '>' */
+		for(quote = 0; p < end; p++) {
+			if(quote) {
+				quote = (*p == quote) ? 0 : quote;
+			} else if(*p == '"' || *p == '\'') {
+				quote = *p;
+			} else if(*p == '>') {
+				p++;
+				break;
+			}
+		}
+	}
+}
+
+/* Process text replaces &<ref>; tokens with appropriate characters */
+char * process_text(char * value) {
+	if(value) {
+		return expand_text(value, strlen(value));
+	}
+
+	return NULL;
+}
+
+/* 
+ * INTERNAL
+ * process_text over len bytes, which need not be NUL terminated, but
+ * with references left as they are (CDATA, comments).
+ */
+char * escape_text(const char * value, int len) {
+	return escape_refs(NULL, value, len, 0);
+}
+
+/* 
+ * INTERNAL
+ * process_text over len bytes, which need not be NUL terminated.
+ * Character references are decoded to UTF-8 and references to declared
+ * entities replaced by their text.
+ */
+char * expand_text(const char * value, int len) {
+	return escape_refs(NULL, value, len, 1);
+}
+
+/* 
+ * INTERNAL
+ * Runs without special characters are copied as they are, so text
+ * without any is a single memcpy. The first pass sizes the result; a
+ * character reference never outgrows the room counted for a bare '&',
+ * only entities need looking up there, and only once declared.
+ */
+static char * escape_refs(stream_t * stream, const char * value,
+                          int len, int refs) {
+	entity_table * entities = stream ? stream->entities : NULL;
+	const char * p = value;
+	const char * end = value + len;
+	char * buf = NULL;
+	char * q = NULL;
+	unsigned long extra = 0;
+#ifdef XMLC_STATS
+	int phase = stats_switch(stream, PHASE_TEXT);
+#endif
+
+	while(p < end) {
+		int grow = text_special[(unsigned char)*p++];
+		if(grow) {
+			extra += grow - 1;
+
+			if(refs && entities && p[-1] == '&' && !predefined_ref(p, end)) {
+				int n;
+				entity_t * e = entity_ref(stream, p, end, &n);
+
+				if(e) {
+					entities->bytes += e->expandedlen;
+					extra += e->expandedlen;
+					p += n;
+				}
+
+				if(entities->failed || entities->bytes > entities->max_bytes) {
+					entities->failed = 1;
+					STAT_PHASE(stream, phase)
+					return NULL;
+				}
+			}
+		}
+	}
+
+	buf = stream_malloc(stream, len + extra + 1);
+	STAT_ADD(stream, bytes_allocated, len + extra + 1)
+	if(!buf) {
+		STAT_PHASE(stream, phase)
+		return NULL;
+	}
+
+	p = value;
+	q = buf;
+
+	while(p < end) {
+		const char * run = p;
+		char c;
+
+		while(p < end && !text_special[(unsigned char)*p]) {
+			p++;
+		}
+
+		memcpy(q, run, p - run);
+		q += p - run;
+
+		if(p == end) {
+			break;
+		}
+
+		c = *p++;
+		if( c == '&') {
+		  int n = predefined_ref(p, end);
+		  if(n) {
+			*q++ = '&';
+			memcpy(q, p, n);
+			q += n;
+			p += n;
+			continue;
+		  }
+
+		  if(refs && p < end) {
+			unsigned long cp;
+			entity_t * e;
+
+			if(*p == '#' && (n = char_ref(p, end, &cp))) {
+			   q = put_char(q, cp);
+			   p += n;
+			   continue;
+			}
+
+			if(entities && (e = entity_ref(stream, p, end, &n))) {
+			   memcpy(q, e->expanded, e->expandedlen);
+			   q += e->expandedlen;
+			   p += n;
+			   continue;
+			}
+		  }
+
+		  q = escape_char(q, c);
+		} else if (c == '\r') {
+            if(p < end && *p == '\n')  {
+                *q++ = '\n';
+                 ++p;
+            }
+        } else {
+		  q = escape_char(q, c);
+		}
+	} /* while */
+
+	*q = 0;
+
+	STAT_PHASE(stream, phase)
+	return buf;
+}
+
+/* 
+ * INTERNAL
+ * process_text within value itself, for parse_inplace. That is only
+ * possible when nothing needs escaping, as the text can then only
+ * shrink (\r\n to \n). Returns the new length, -1 if it would grow.
+ */
+int escape_inplace(char * value, int len) {
+	char * p = value;
+	char * end = value + len;
+	char * q;
+
+	while(p < end) {
+		int c = (unsigned char)*p++;
+		int n;
+
+		if(!text_special[c] || c == '\r') {
+			continue;
+		}
+
+		if(c == '&' && (n = predefined_ref(p, end))) {
+			p += n;
+			continue;
+		}
+
+		return -1;
+	}
+
+	/* a lone \r is dropped too, so every \r goes */
+	q = p = (char *)memchr(value, '\r', len);
+	if(p) {
+		for(; p < end; p++) {
+			if(*p != '\r') {
+				*q++ = *p;
+			}
+		}
+
+		len = (int)(q - value);
+	}
+
+	return len;
+}
+
+/*
+ * Streaming writer. Markup goes into a WRITE_SIZE buffer handed to the
+ * write callback whenever it fills, so documents of any size are written
+ * in constant memory, without a tree. Only the names of the open
+ * elements are kept, for their end tags. A start tag is left open until
+ * whatever follows it, so attributes can still be added and an element
+ * with nothing in it ends with "/>".
+ */
+struct xml_writer_t {
+	pfn_write write;
+	void * ctx;
+	char * buf;
+	int len;
+	int open;         /* a start tag is waiting for its '>' */
+	int depth;
+	char * names;     /* names of the open elements, each NUL ended */
+	int nameslen;
+	int namessize;
+	int error;        /* once set, every call fails with it */
+};
+
+/* INTERNAL - pfn_write to a FILE */
+int file_write(void * fp, const char * buf, int len) {
+	if(fwrite(buf, 1, len, (FILE *)fp) != (size_t)len) {
+		return -1;
+	}
+	return len;
+}
+
+/**
+  * Use this API to write XML as it is made, without building a tree
+  * write --> called with each buffer full of output, see pfn_write.
+  *           file_write writes to a FILE
+  * ctx --> passed back to write
+  * Returns NULL when out of memory. End with xw_close.
+  */
+xml_writer * xw_create(pfn_write write, void * ctx) {
+	xml_writer * w = (xml_writer *)xml_calloc(1, sizeof(xml_writer));
+	if(!w) {
+		return NULL;
+	}
+
+	w->buf = (char *)xml_malloc(WRITE_SIZE);
+	w->namessize = 256;
+	w->names = (char *)xml_malloc(w->namessize);
+	if(!w->buf || !w->names) {
+		xml_free(w->buf);
+		xml_free(w->names);
+		xml_free(w);
+		return NULL;
+	}
+
+	w->write = write;
+	w->ctx = ctx;
+	return w;
+}
+
+/* Use this to hand what has been written so far to the write callback */
+int xw_flush(xml_writer * w) {
+	if(w->error) {
+		return w->error;
+	}
+
+	if(w->len > 0 && w->write(w->ctx, w->buf, w->len) < 0) {
+		w->error = WRITEERROR;
+	}
+
+	w->len = 0;
+	return w->error;
+}
+
+/* INTERNAL - n bytes of output, written straight through when large */
+static int xw_put(xml_writer * w, const char * s, int n) {
+	if(w->len + n > WRITE_SIZE && xw_flush(w) < 0) {
+		return w->error;
+	}
+
+	if(n >= WRITE_SIZE) {
+		if(w->write(w->ctx, s, n) < 0) {
+			w->error = WRITEERROR;
+		}
+		return w->error;
+	}
+
+	memcpy(&w->buf[w->len], s, n);
+	w->len += n;
+	return 0;
+}
+
+/* INTERNAL - text written with the rules of process_text: predefined
+   references kept, character references resolved, special characters
+   escaped and line ends normalized. Entities are not expanded */
+static int xw_escaped(xml_writer * w, const char * p) {
+	const char * end = p + strlen(p);
+
+	while(p < end) {
+		const char * run = p;
+		char * q;
+		char c;
+
+		while(p < end && !text_special[(unsigned char)*p]) {
+			p++;
+		}
+
+		if(p > run && xw_put(w, run, (int)(p - run)) < 0) {
+			return w->error;
+		}
+
+		if(p == end) {
+			break;
+		}
+
+		/* no escape takes more than 8 bytes */
+		if(w->len + 8 > WRITE_SIZE && xw_flush(w) < 0) {
+			return w->error;
+		}
+
+		q = &w->buf[w->len];
+		c = *p++;
+		if(c == '&') {
+			unsigned long cp;
+			int n = predefined_ref(p, end);
+
+			if(n) {
+				*q++ = '&';
+				memcpy(q, p, n);
+				q += n;
+				p += n;
+			} else if(p < end && *p == '#' && (n = char_ref(p, end, &cp))) {
+				q = put_char(q, cp);
+				p += n;
+			} else {
+				q = escape_char(q, c);
+			}
+		} else if(c == '\r') {
+			if(p < end && *p == '\n') {
+				*q++ = '\n';
+				++p;
+			}
+		} else {
+			q = escape_char(q, c);
+		}
+
+		w->len = (int)(q - w->buf);
+	}
+
+	return 0;
+}
+
+/* INTERNAL - the '>' of a start tag left open */
+static int xw_close_tag(xml_writer * w) {
+	if(w->open) {
+		w->open = 0;
+		return xw_put(w, ">", 1);
+	}
+	return 0;
+}
+
+/* Use this to start an element, its attributes may follow */
+int xw_start_element(xml_writer * w, const char * name) {
+	int len = (int)strlen(name);
+
+	if(w->error || xw_close_tag(w) < 0) {
+		return w->error;
+	}
+
+	if(w->nameslen + len + 1 > w->namessize) {
+		int size = w->namessize * 2;
+		char * p;
+
+		while(w->nameslen + len + 1 > size) {
+			size *= 2;
+		}
+
+		p = (char *)xml_realloc(w->names, size);
+		if(!p) {
+			w->error = NOMEMORY;
+			return w->error;
+		}
+
+		w->names = p;
+		w->namessize = size;
+	}
+
+	memcpy(&w->names[w->nameslen], name, len + 1);
+	w->nameslen += len + 1;
+	w->depth++;
+	w->open = 1;
+
+	if(xw_put(w, "<", 1) < 0 || xw_put(w, name, len) < 0) {
+		return w->error;
+	}
+	return 0;
+}
+
+/* Use this to add an attribute to the element just started */
+int xw_attribute(xml_writer * w, const char * name, const char * value) {
+	if(w->error) {
+		return w->error;
+	}
+
+	if(!w->open) {
+		w->error = WRITEERROR;
+		return w->error;
+	}
+
+	if(xw_put(w, " ", 1) < 0 || xw_put(w, name, (int)strlen(name)) < 0 ||
+	   xw_put(w, "=\"", 2) < 0 || xw_escaped(w, value) < 0 ||
+	   xw_put(w, "\"", 1) < 0) {
+		return w->error;
+	}
+	return 0;
+}
+
+/* Use this to write text in the element open */
+int xw_text(xml_writer * w, const char * text) {
+	if(w->error || xw_close_tag(w) < 0) {
+		return w->error;
+	}
+
+	return xw_escaped(w, text);
+}
+
+/* Use this to write markup of your own, such as a declaration, as is */
+int xw_raw(xml_writer * w, const char * text, int len) {
+	if(w->error || xw_close_tag(w) < 0) {
+		return w->error;
+	}
+
+	return xw_put(w, text, len);
+}
+
+/* Use this to end the element open */
+int xw_end_element(xml_writer * w) {
+	char * name;
+	int len;
+
+	if(w->error) {
+		return w->error;
+	}
+
+	if(!w->depth) {
+		w->error = WRITEERROR;
+		return w->error;
+	}
+
+	/* the name before the last NUL */
+	name = &w->names[w->nameslen - 1];
+	while(name > w->names && name[-1]) {
+		name--;
+	}
+	len = (int)(&w->names[w->nameslen - 1] - name);
+	w->nameslen -= len + 1;
+	w->depth--;
+
+	if(w->open) {
+		w->open = 0;
+		return xw_put(w, "/>", 2);
+	}
+
+	if(xw_put(w, "</", 2) < 0 || xw_put(w, name, len) < 0 ||
+	   xw_put(w, ">", 1) < 0) {
+		return w->error;
+	}
+	return 0;
+}
+
+/**
+  * Use this API to finish writing: ends the elements still open, hands
+  * the rest of the output to the write callback and frees the writer.
+  * Returns the first error met while writing, 0 if none.
+  */
+int xw_close(xml_writer * w) {
+	int ret;
+
+	if(!w) {
+		return 0;
+	}
+
+	while(w->depth && xw_end_element(w) >= 0)
+		;
+
+	ret = xw_flush(w);
+	xml_free(w->names);
+	xml_free(w->buf);
+	xml_free(w);
+	return ret;
+}
+
+/* INTERNAL - merges the run of TEXT siblings starting at first into it:
+   measured once, allocated once, copied once */
+static void merge_text(xml_node * first) {
+    xml_node * end;
+    xml_node * n;
+    size_t len = 0;
+    char * text;
+    char * p;
+
+    for(end = first; end && end->type == TEXT; end = end->sibling) {
+        len += end->text ? strlen(end->text) : 0;
+    }
+
+    text = xml_malloc(len + 1);
+    if(!text) {
+        return;
+    }
+
+    p = text;
+    for(n = first; n != end; n = n->sibling) {
+        if(n->text) {
+            size_t k = strlen(n->text);
+            memcpy(p, n->text, k);
+            p += k;
+        }
+    }
+    *p = 0;
+
+    if(first->flags & FREETEXT) {
+        xml_free(first->text);
+    }
+    first->text = text;
+    first->flags |= FREETEXT;
+
+    /* unlinked at once, no search for each */
+    n = first->sibling;
+    first->sibling = end;
+    while(n != end) {
+        xml_node * next = n->sibling;
+        destroy_node(n);
+        n = next;
+    }
+
+    xml_touch(first);
+}
+
+/* INTERNAL - does normalize have anything to do under node */
+static int needs_normalize(xml_node * node) {
+    xml_node * child;
+
+    for(child = node->child; child; child = child->sibling) {
+        if(child->type == TEXT && child->sibling && 
+           child->sibling->type == TEXT) {
+            return 1;
+        }
+        if(child->child && needs_normalize(child)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* 
+ * Use this to normalize the tree. This will merge adjacent text nodes 
+ * in node and everything under it, in one pass
+ */
+void normalize(xml_node * node) {
+    xml_node * child;
+
+    if(!node) {
+        return;
+    }
+
+    /* borrowed subtrees are only copied when something changes in them */
+    if((node->flags & SHARED) && !needs_normalize(node)) {
+        return;
+    }
+
+    if(unshare_children(node) < 0) {
+        return;
+    }
+
+    for(child = node->child; child; child = child->sibling) {
+        if(child->type == TEXT) {
+            if(child->sibling && child->sibling->type == TEXT) {
+                merge_text(child);
+            }
+        } else if(child->child) {
+            normalize(child);
+        }
+    }
+}
+
+/* Create an attribute with a name and value  */
+xml_attribute * create_attribute(char * name, 
+								 char * value) {
+
+   xml_attribute * attrib = NULL;
+
+   if(!name) return NULL;
+   attrib = (xml_attribute*)xml_calloc(1, sizeof(xml_attribute));
+   if(attrib) {
+	  attrib->name = xml_malloc(strlen(name) + 1);
+	  if(!attrib->name) {
+		 xml_free(attrib);
+		 return NULL;
+	  }
+	  strcpy(attrib->name, name);
+
+	  attrib->value = process_text(value);
+	  attrib->flags = FREENAME | FREETEXT;
+   }
+
+   return attrib;
+
+}
+
+/* INTERNAL - an attribute of the namelen and len bytes of a name and
+   value just read, neither terminated. In place both stay in the buffer
+   unless the value grows in processing, otherwise they are copied. NULL
+   when out of memory, or with a NULL value when expansion failed */
+xml_attribute * new_attribute_at(stream_t * stream, char * name, int namelen,
+                                 char * value, int len) {
+   xml_attribute * attrib = (xml_attribute*)stream_calloc(stream, 1,
+                                                          sizeof(xml_attribute));
+   int n;
+
+   STAT_ADD(stream, attributes, 1)
+   STAT_ADD(stream, bytes_allocated, sizeof(xml_attribute))
+   if(!attrib) {
+	  return NULL;
+   }
+
+   if(stream->inplace) {
+	  name[namelen] = 0;
+	  attrib->name = name;
+
+	  n = stream_escape(stream, value, len);
+	  if(n >= 0) {
+		 value[n] = 0;
+		 attrib->value = value;
+	  } else {
+		 attrib->value = escape_refs(stream, value, len, 1);
+		 attrib->flags = FREETEXT;
+	  }
+	  return attrib;
+   }
+
+   attrib->name = stream_malloc(stream, namelen + 1);
+   STAT_ADD(stream, bytes_allocated, namelen + 1)
+   if(!attrib->name) {
+	  xml_free(attrib);
+	  return NULL;
+   }
+
+   memcpy(attrib->name, name, namelen);
+   attrib->name[namelen] = 0;
+   attrib->value = escape_refs(stream, value, len, 1);
+   attrib->flags = FREENAME | FREETEXT;
+   return attrib;
+}
+
+
+/* use this to add a child or sibling to a node. This is 
+   the most preferred way to add a child or sibling element
+ */
+void  add_childorsibling(xml_node * parent, 
+                         xml_node * childorsibling) {
+
+	if(parent &&  childorsibling) {
+		if(unshare_children(parent) < 0) {
+		   return;
+		}
+
+		if(parent->child == NULL) {
+		   parent->child = childorsibling;
+		} else {
+		  xml_node * p = parent->child; 
+		  xml_node * q = p;
+
+		  while(p) {
+			 q = p;
+			 p = p->sibling;
+		  }
+		  q->sibling = childorsibling;
+		}
+
+		childorsibling->sibling = NULL;
+        childorsibling->parent = parent;
+		xml_touch(parent);
+		index_tree(index_of(parent), childorsibling, 1);
+	}
+}
+
+/* Use this to remove child or sibling */
+xml_node * remove_childorsibiling(xml_node * parent, 
+                                  xml_node * childorsibling) {
+ 
+	if(parent &&  childorsibling) {
+		if(unshare_children(parent) < 0) {
+		   return NULL;
+		}
+
+		if(childorsibling->parent != parent) {
+		   xml_node * n;
+
+		   /* a borrowed child was asked for, see xml_share; its copy goes */
+		   for(n = parent->child; n; n = n->sibling) {
+			  if(n->origin == childorsibling) {
+				 childorsibling = n;
+				 break;
+			  }
+		   }
+		}
+
+		if(parent->child == NULL) {
+		   return NULL;
+		} else {
+		  xml_node * p = parent->child; 
+          xml_node * q = p;
+
+		  while(p) {
  		       if(p == childorsibling) {
+                   index_tree(index_of(parent), p, 0);
                    if(p == parent->child) {
                      parent->child = p->sibling;
                    } else {
                      q->sibling = p->sibling;
                    }
+                   xml_touch(parent);
                    return p;
                }
-               q = p;
-               p = p->sibling;
-		  }
+               q = p;
+               p = p->sibling;
+		  }
+        }
+	}
+
+    return NULL;
+}
+
+/* INTERNAL - see xml_equal */
+int is_equal(xml_node * child1, xml_node * child2) {
+	return xml_equal(child1, child2);
+}
+
+/*
+ * Cloning.
+ *
+ * xml_clone copies a subtree into one block. The clone's root is the
+ * block, everything below it is flagged INARENA and goes with it.
+ *
+ * xml_share copies just a root and borrows its children (SHARED) from
+ * the template, which stays alive and read-only for as long as the copy
+ * does, by reference count as for cached trees. xml_unshare copies the
+ * path down to a node that is to be changed: each level it passes is
+ * turned into copies of the template's nodes borrowing their children
+ * in turn. A tree differing from its template in a few places costs
+ * those paths.
+ */
+
+/* INTERNAL - what a clone of node needs */
+static void clone_count(xml_node * node, int * pnodes, int * pattrs,
+                        size_t * pstrings) {
+	xml_attribute * a;
+	xml_node * n;
+
+	(*pnodes)++;
+	*pstrings += (node->name ? strlen(node->name) + 1 : 0) +
+	             (node->text ? strlen(node->text) + 1 : 0);
+
+	for(a = node->attributes; a; a = a->next) {
+		(*pattrs)++;
+		*pstrings += strlen(a->name) + 1 + (a->value ? strlen(a->value) + 1 : 0);
+	}
+
+	for(n = node->child; n; n = n->sibling) {
+		clone_count(n, pnodes, pattrs, pstrings);
+	}
+}
+
+/* INTERNAL */
+static char * clone_string(const char * s, char ** pstrings) {
+	char * copy = *pstrings;
+	size_t n;
+
+	if(!s) {
+		return NULL;
+	}
+
+	n = strlen(s) + 1;
+	memcpy(copy, s, n);
+	*pstrings += n;
+	return copy;
+}
+
+/* INTERNAL - lays the clone of node out in the block */
+static xml_node * clone_into(xml_node * node, xml_node ** pnodes,
+                             xml_attribute ** pattrs, char ** pstrings) {
+	xml_node * copy = (*pnodes)++;
+	xml_attribute * a, ** pa;
+	xml_node * n, ** pn;
+
+	memset(copy, 0, sizeof(xml_node));
+	copy->type = node->type;
+	copy->flags = INARENA;
+	copy->name = clone_string(node->name, pstrings);
+	copy->text = clone_string(node->text, pstrings);
+	copy->ns = node->ns;
+	copy->localname = node->localname;
+	copy->offset = node->offset;
+	copy->length = node->length;
+	copy->hash = node->hash;
+
+	pa = &copy->attributes;
+	for(a = node->attributes; a; a = a->next) {
+		xml_attribute * b = (*pattrs)++;
+
+		memset(b, 0, sizeof(xml_attribute));
+		b->name = clone_string(a->name, pstrings);
+		b->value = clone_string(a->value, pstrings);
+		b->flags = INARENA;
+		b->ns = a->ns;
+		b->localname = a->localname;
+		*pa = b;
+		pa = &b->next;
+	}
+
+	pn = &copy->child;
+	for(n = node->child; n; n = n->sibling) {
+		*pn = clone_into(n, pnodes, pattrs, pstrings);
+		(*pn)->parent = copy;
+		pn = &(*pn)->sibling;
+	}
+
+	return copy;
+}
+
+/* 
+ * Use this to copy a subtree. The copy is one allocation and is freed
+ * with destroy_node on its root; nodes taken out of it live no longer
+ * than that. Returns NULL when out of memory.
+ */
+xml_node * xml_clone(xml_node * node) {
+	int nodes = 0, attrs = 0;
+	size_t strings = 0;
+	xml_node * pn, * copy;
+	xml_attribute * pa;
+	char * ps;
+
+	if(!node) {
+		return NULL;
+	}
+
+	clone_count(node, &nodes, &attrs, &strings);
+
+	pn = (xml_node *)xml_malloc(nodes * sizeof(xml_node) + 
+	                            attrs * sizeof(xml_attribute) + strings);
+	if(!pn) {
+		return NULL;
+	}
+
+	pa = (xml_attribute *)(pn + nodes);
+	ps = (char *)(pa + attrs);
+
+	/* the root is the block */
+	copy = clone_into(node, &pn, &pa, &ps);
+	copy->flags = 0;
+	return copy;
+}
+
+/* INTERNAL - a copy of node borrowing its strings and its children */
+static xml_node * share_node(xml_node * node) {
+	xml_node * copy = (xml_node *)xml_malloc(sizeof(xml_node));
+	xml_attribute * a, ** pa;
+
+	if(!copy) {
+		return NULL;
+	}
+
+	*copy = *node;
+	copy->flags = node->child ? SHARED : 0;
+	copy->refcount = 0;
+	copy->origin = node;
+	copy->index = NULL;
+	copy->parent = NULL;
+	copy->sibling = NULL;
+	copy->attributes = NULL;
+
+	/* attributes are copied, add_attribute changes them in place */
+	pa = &copy->attributes;
+	for(a = node->attributes; a; a = a->next) {
+		*pa = (xml_attribute *)xml_malloc(sizeof(xml_attribute));
+		if(!*pa) {
+			destroy_node(copy);
+			return NULL;
+		}
+		**pa = *a;
+		(*pa)->flags = 0;
+		(*pa)->next = NULL;
+		pa = &(*pa)->next;
+	}
+
+	return copy;
+}
+
+/* INTERNAL - gives a SHARED node children of its own, copies that
+   borrow theirs. The tree functions call this before changing the
+   children of a node */
+int unshare_children(xml_node * node) {
+	xml_node * first = NULL;
+	xml_node ** pn = &first;
+	xml_node * n;
+	xml_index * ix;
+
+	if(!(node->flags & SHARED)) {
+		return 0;
+	}
+
+	for(n = node->child; n; n = n->sibling) {
+		*pn = share_node(n);
+		if(!*pn) {
+			while(first) {
+				n = first->sibling;
+				destroy_node(first);
+				first = n;
+			}
+			return NOMEMORY;
+		}
+		(*pn)->parent = node;
+		pn = &(*pn)->sibling;
+	}
+
+	/* the copies take the borrowed children's place in an index */
+	ix = index_of(node);
+	if(ix) {
+		xml_node * c = first;
+
+		for(n = node->child; n; n = n->sibling, c = c->sibling) {
+			index_rename(ix, n, c);
+		}
+	}
+
+	node->child = first;
+	node->flags &= ~SHARED;
+	return 0;
+}
+
+/* 
+ * Use this to start a copy on write copy of a tree, template being its
+ * root. The copy borrows the template's nodes until xml_unshare is used
+ * to change them. The template is shared from then on: read-only, and
+ * given up with xml_release rather than destroy_node. Copies are freed
+ * with destroy_node. Returns NULL when out of memory.
+ */
+xml_node * xml_share(xml_node * template) {
+	xml_node * copy;
+
+	if(!template) {
+		return NULL;
+	}
+
+	copy = share_node(template);
+	if(!copy) {
+		return NULL;
+	}
+
+	/* the owner's reference, then the copy's */
+	COUNT_ADD(template->refcount, COUNT_GET(template->refcount) ? 1 : 2);
+	copy->flags |= HOLDSREF;
+
+	return copy;
+}
+
+/* 
+ * Use this before changing node in a copy from xml_share. node is a
+ * node seen in the copy, borrowed or not. Returns the copy's own node to
+ * change instead, NULL if node is not in the copy or out of memory.
+ */
+xml_node * xml_unshare(xml_node * root, xml_node * node) {
+	xml_node ** path;
+	xml_node * cur = root;
+	xml_node * t;
+	int depth = 0, i;
+
+	for(t = node; t; t = t->parent) {
+		if(t == root) {
+			return node;
+		}
+	}
+
+	if(!root || !(root->flags & HOLDSREF)) {
+		return NULL;
+	}
+
+	for(t = node; t && t != root->origin; t = t->parent) {
+		depth++;
+	}
+	if(!t) {
+		return NULL;
+	}
+
+	path = (xml_node **)xml_malloc((depth + 1) * sizeof(xml_node *));
+	if(!path) {
+		return NULL;
+	}
+	for(t = node, i = depth; i > 0; t = t->parent) {
+		path[--i] = t;
+	}
+
+	for(i = 0; i < depth && cur; i++) {
+		if(unshare_children(cur) < 0) {
+			cur = NULL;
+			break;
+		}
+
+		for(cur = cur->child; cur && cur->origin != path[i]; cur = cur->sibling)
+			;
+	}
+
+	xml_free(path);
+	return cur;
+}
+
+/*
+ * Tree diff and patch.
+ *
+ * xml_diff returns an edit script turning one tree into another. The
+ * script is a tree itself, ops applying to the children of the node
+ * they sit in, i being a position among its children before the patch:
+ *
+ *   <diff>                        the root's own ops
+ *     <set name="k" value="v"/>   attribute added or changed
+ *     <unset name="k"/>           attribute removed
+ *     <delete i="2"/>             child removed
+ *     <insert i="3">...</insert>  subtree put before child i (or last)
+ *     <text i="4" value="t"/>     new text for a text, CDATA, comment..
+ *     <node i="5">...</node>      ops for an element child
+ *   </diff>
+ *
+ * Ops come in order of i. Subtrees are compared by their hashes, so an
+ * identical region costs one comparison however big it is.
+ */
+
+/* Longest search for a counterpart among unmatched old children */
+#define DIFF_WINDOW 32
+
+/* INTERNAL */
+static uint64_t hash_string(const char * s, uint64_t seed) {
+	return s ? hash_bytes(s, strlen(s), seed) : seed;
+}
+
+/* 
+ * Use this to get a 64 bit hash of the subtree at node: its type, name,
+ * text, attributes (in any order) and children (in order). Hashes are
+ * kept in the nodes, so asking again is O(1) until the subtree changes.
+ * The tree functions let go of them as they change a tree; after
+ * changing nodes by hand call xml_touch.
+ */
+uint64_t xml_hash(xml_node * node) {
+	uint64_t h;
+	uint64_t attrs = 0;
+	xml_attribute * a;
+	xml_node * n;
+
+	if(!node) {
+		return 0;
+	}
+
+	/* a hash kept in a node implies one in every node below it */
+	if(node->hash) {
+		return node->hash;
+	}
+
+	h = (uint64_t)node->type;
+	h = hash_string(node->name, h);
+	h = hash_string(node->text, h);
+
+	for(a = node->attributes; a; a = a->next) {
+		attrs += hash_string(a->value, hash_string(a->name, 1));
+	}
+	h = hash_bytes(&attrs, sizeof(attrs), h);
+
+	for(n = node->child; n; n = n->sibling) {
+		uint64_t c = xml_hash(n);
+		h = hash_bytes(&c, sizeof(c), h);
+	}
+
+	/* 0 means no hash kept */
+	node->hash = h ? h : 1;
+	return node->hash;
+}
+
+/* Use this after changing a node's fields directly, so that the hashes
+   kept for it and the nodes above it are made again (see xml_hash) */
+void xml_touch(xml_node * node) {
+	/* nodes above one without a hash have none either */
+	for(; node && node->hash; node = node->parent) {
+		node->hash = 0;
+	}
+}
+
+/* INTERNAL - attributes of a all found in b with the same values */
+static int attributes_within(xml_node * a, xml_node * b) {
+	xml_attribute * x, * y;
+
+	for(x = a->attributes; x; x = x->next) {
+		for(y = b->attributes; y && strcmp(x->name, y->name); y = y->next)
+			;
+		if(!y || strcmp(x->value, y->value)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* INTERNAL */
+static int string_equal(const char * a, const char * b) {
+	return a == b || (a && b && !strcmp(a, b));
+}
+
+/* 
+ * Use this to compare two subtrees deeply: type, name, text, attributes
+ * (in any order) and children (in order). Subtrees whose kept hashes
+ * differ are told apart at once; equal hashes are confirmed node by
+ * node.
+ */
+int xml_equal(xml_node * a, xml_node * b) {
+	xml_node * x, * y;
+
+	if(a == b) {
+		return 1;
+	}
+
+	if(!a || !b || xml_hash(a) != xml_hash(b)) {
+		return 0;
+	}
+
+	if(a->type != b->type || !string_equal(a->name, b->name) ||
+	   !string_equal(a->text, b->text) ||
+	   !attributes_within(a, b) || !attributes_within(b, a)) {
+		return 0;
+	}
+
+	for(x = a->child, y = b->child; x && y; x = x->sibling, y = y->sibling) {
+		if(!xml_equal(x, y)) {
+			return 0;
+		}
+	}
+
+	return !x && !y;
+}
+
+/* INTERNAL */
+static char * copy_string(const char * s) {
+	char * copy;
+
+	if(!s) {
+		return NULL;
+	}
+
+	copy = (char *)xml_malloc(strlen(s) + 1);
+	if(copy) {
+		strcpy(copy, s);
+	}
+	return copy;
+}
+
+/* INTERNAL - an attribute owning copies of name and value, nothing
+   processed */
+static xml_attribute * copy_attribute(const char * name, const char * value) {
+	xml_attribute * a = (xml_attribute *)xml_calloc(1, sizeof(xml_attribute));
+
+	if(a) {
+		a->name = copy_string(name);
+		a->value = copy_string(value);
+		a->flags = FREENAME | FREETEXT;
+		if(!a->name || (value && !a->value)) {
+			xml_free(a->name);
+			xml_free(a->value);
+			xml_free(a);
+			return NULL;
+		}
+	}
+
+	return a;
+}
+
+/* INTERNAL - script being built, ops are appended at tail */
+typedef struct diff_ops_t {
+	xml_node * op;
+	xml_node * tail;
+} diff_ops;
+
+/* INTERNAL - appends a new op named name, with i unless it is < 0 */
+static xml_node * diff_op(diff_ops * ops, char * name, int i) {
+	xml_node * op = create_element(name);
+	char index[16];
+
+	if(!op) {
+		return NULL;
+	}
+
+	if(i >= 0) {
+		sprintf(index, "%d", i);
+		op->attributes = copy_attribute("i", index);
+		if(!op->attributes) {
+			destroy_node(op);
+			return NULL;
+		}
+	}
+
+	op->parent = ops->op;
+	if(ops->tail) {
+		ops->tail->sibling = op;
+	} else {
+		ops->op->child = op;
+	}
+	ops->tail = op;
+
+	return op;
+}
+
+/* INTERNAL - adds name="value" to an op */
+static int diff_attr(xml_node * op, const char * name, const char * value) {
+	xml_attribute * a = copy_attribute(name, value);
+
+	if(!a) {
+		return NOMEMORY;
+	}
+
+	a->next = op->attributes;
+	op->attributes = a;
+	return 0;
+}
+
+/* INTERNAL - whether b can be had from a by ops on a */
+static int diff_pairs(xml_node * a, xml_node * b) {
+	if(a->type != b->type) {
+		return 0;
+	}
+
+	if(a->name && b->name) {
+		return !strcmp(a->name, b->name);
+	}
+
+	return a->name == b->name;
+}
+
+static int diff_node(xml_node * a, xml_node * b, diff_ops * ops);
+
+/* INTERNAL - ops for old children A[i0..i1) that have no identical new
+   ones, becoming B[j0..j1). Children are paired in order with the
+   nearest one of the same kind, the rest deleted or inserted */
+static int diff_gap(xml_node ** A, int i0, int i1, xml_node ** B, int j0,
+                    int j1, diff_ops * ops) {
+	int p = i0;
+	int j, q;
+
+	for(j = j0; j < j1; j++) {
+		int end = (p + DIFF_WINDOW < i1) ? p + DIFF_WINDOW : i1;
+
+		for(q = p; q < end && !diff_pairs(A[q], B[j]); q++)
+			;
+
+		if(q == end) {
+			xml_node * op = diff_op(ops, "insert", p);
+			xml_node * copy = op ? xml_clone(B[j]) : NULL;
+			if(!copy) {
+				return NOMEMORY;
+			}
+			copy->parent = op;
+			op->child = copy;
+			continue;
+		}
+
+		for(; p < q; p++) {
+			if(!diff_op(ops, "delete", p)) {
+				return NOMEMORY;
+			}
+		}
+
+		if(A[q]->hash != B[j]->hash) {
+			if(A[q]->type == ELEMENT) {
+				diff_ops sub;
+				sub.op = diff_op(ops, "node", q);
+				sub.tail = NULL;
+				if(!sub.op || diff_node(A[q], B[j], &sub) < 0) {
+					return NOMEMORY;
+				}
+			} else {
+				xml_node * op = diff_op(ops, "text", q);
+				if(!op || diff_attr(op, "value", B[j]->text ? B[j]->text : "") < 0) {
+					return NOMEMORY;
+				}
+			}
+		}
+		p = q + 1;
+	}
+
+	for(; p < i1; p++) {
+		if(!diff_op(ops, "delete", p)) {
+			return NOMEMORY;
+		}
+	}
+
+	return 0;
+}
+
+/* INTERNAL - the children of a node as an array, *pcount of them */
+static xml_node ** child_array(xml_node * node, int * pcount) {
+	xml_node ** arr;
+	xml_node * n;
+	int count = 0;
+
+	for(n = node->child; n; n = n->sibling) {
+		count++;
+	}
+
+	arr = (xml_node **)xml_malloc((count + 1) * sizeof(xml_node *));
+	if(arr) {
+		count = 0;
+		for(n = node->child; n; n = n->sibling) {
+			arr[count++] = n;
+		}
+	}
+
+	*pcount = count;
+	return arr;
+}
+
+/* INTERNAL - ops turning a's children into b's. Subtrees identical in
+   both, found by hash in order, anchor the diff; diff_gap deals with
+   what lies between them */
+static int diff_children(xml_node * a, xml_node * b, diff_ops * ops) {
+	xml_node ** A, ** B;
+	int * next = NULL, * heads = NULL;
+	int na, nb, pa = 0, pb = 0, ea, eb;
+	int size, mask, i, j, last, gap;
+	int ret = NOMEMORY;
+
+	A = child_array(a, &na);
+	B = child_array(b, &nb);
+	if(!A || !B) {
+		goto done;
+	}
+
+	/* unchanged runs at both ends */
+	ea = na;
+	eb = nb;
+	while(pa < ea && pb < eb && A[pa]->hash == B[pb]->hash) {
+		pa++;
+		pb++;
+	}
+	while(ea > pa && eb > pb && A[ea - 1]->hash == B[eb - 1]->hash) {
+		ea--;
+		eb--;
+	}
+
+	/* old children by hash, each chain in increasing order */
+	for(size = 16; size < 2 * (ea - pa); size *= 2)
+		;
+	mask = size - 1;
+	heads = (int *)xml_malloc(size * sizeof(int));
+	next = (int *)xml_malloc((na + 1) * sizeof(int));
+	if(!heads || !next) {
+		goto done;
+	}
+	for(i = 0; i < size; i++) {
+		heads[i] = -1;
+	}
+	for(i = ea - 1; i >= pa; i--) {
+		int slot = (int)(A[i]->hash & mask);
+		next[i] = heads[slot];
+		heads[slot] = i;
+	}
+
+	/* identical pairs in order, what lies between them is a gap */
+	last = pa - 1;
+	gap = pb;
+	for(j = pb; j < eb; j++) {
+		int slot = (int)(B[j]->hash & mask);
+		int q;
+
+		for(q = heads[slot]; q >= 0 && (q <= last || A[q]->hash != B[j]->hash);
+		    q = next[q])
+			;
+		if(q < 0) {
+			continue;
+		}
+
+		if(diff_gap(A, last + 1, q, B, gap, j, ops) < 0) {
+			goto done;
+		}
+		last = q;
+		gap = j + 1;
+	}
+
+	ret = diff_gap(A, last + 1, ea, B, gap, eb, ops);
+
+done:
+	xml_free(A);
+	xml_free(B);
+	xml_free(heads);
+	xml_free(next);
+	return ret;
+}
+
+/* INTERNAL - ops turning a into b, which have the same name */
+static int diff_node(xml_node * a, xml_node * b, diff_ops * ops) {
+	xml_attribute * x, * y;
+
+	for(y = b->attributes; y; y = y->next) {
+		for(x = a->attributes; x && strcmp(x->name, y->name); x = x->next)
+			;
+		if(!x || strcmp(x->value, y->value)) {
+			xml_node * op = diff_op(ops, "set", -1);
+			if(!op || diff_attr(op, "value", y->value) < 0 ||
+			   diff_attr(op, "name", y->name) < 0) {
+				return NOMEMORY;
+			}
+		}
+	}
+
+	for(x = a->attributes; x; x = x->next) {
+		for(y = b->attributes; y && strcmp(x->name, y->name); y = y->next)
+			;
+		if(!y) {
+			xml_node * op = diff_op(ops, "unset", -1);
+			if(!op || diff_attr(op, "name", x->name) < 0) {
+				return NOMEMORY;
+			}
+		}
+	}
+
+	return diff_children(a, b, ops);
+}
+
+/* 
+ * Use this to get the edit script turning tree a into tree b, see
+ * xml_patch. Both roots must be the same kind of node with the same
+ * name (two documents, say). Returns NULL if not, or out of memory.
+ * Neither tree is changed, hashes are kept as by xml_hash.
+ */
+xml_node * xml_diff(xml_node * a, xml_node * b) {
+	diff_ops ops;
+
+	if(!a || !b || !diff_pairs(a, b)) {
+		return NULL;
+	}
+
+	xml_hash(a);
+	xml_hash(b);
+
+	ops.op = create_element("diff");
+	ops.tail = NULL;
+	if(ops.op && diff_node(a, b, &ops) < 0) {
+		destroy_node(ops.op);
+		return NULL;
+	}
+
+	return ops.op;
+}
+
+/* INTERNAL - i of an op, -1 if it has none */
+static int op_index(xml_node * op) {
+	char * i = get_attribute(op, "i");
+	return i ? atoi(i) : -1;
+}
+
+/* INTERNAL - whether the ops in op fit node, so that patching it
+   cannot fail half way */
+static int patch_check(xml_node * node, xml_node * op) {
+	xml_node ** arr;
+	xml_node * o;
+	int count, last = 0;
+	int ret = 0;
+
+	arr = child_array(node, &count);
+	if(!arr) {
+		return NOMEMORY;
+	}
+
+	for(o = op->child; o && !ret; o = o->sibling) {
+		int i = op_index(o);
+
+		if(o->type != ELEMENT) {
+			ret = PATCHERROR;
+		} else if(!strcmp(o->name, "set") || !strcmp(o->name, "unset")) {
+			if(!get_attribute(o, "name") ||
+			   (o->name[0] == 's' && !get_attribute(o, "value"))) {
+				ret = PATCHERROR;
+			}
+		} else if(i < last || i > count) {
+			ret = PATCHERROR;
+		} else if(!strcmp(o->name, "insert")) {
+			if(!o->child || o->child->sibling) {
+				ret = PATCHERROR;
+			}
+		} else if(i == count) {
+			ret = PATCHERROR;
+		} else if(!strcmp(o->name, "node")) {
+			ret = (arr[i]->type == ELEMENT) ? patch_check(arr[i], o) : PATCHERROR;
+		} else if(!strcmp(o->name, "text")) {
+			if(arr[i]->type == ELEMENT || arr[i]->type == DOCUMENT ||
+			   !get_attribute(o, "value")) {
+				ret = PATCHERROR;
+			}
+		} else if(strcmp(o->name, "delete")) {
+			ret = PATCHERROR;
+		}
+
+		last = (i < 0) ? last : i;
+	}
+
+	xml_free(arr);
+	return ret;
+}
+
+/* INTERNAL - applies checked ops to node, see patch_check */
+static int patch_node(xml_node * node, xml_node * op) {
+	xml_node ** arr;
+	xml_node * o;
+	xml_node ** tail = &node->child;
+	xml_index * ix;
+	int count, k;
+
+	if(unshare_children(node) < 0) {
+		return NOMEMORY;
+	}
+
+	ix = index_of(node);
+
+	arr = child_array(node, &count);
+	if(!arr) {
+		return NOMEMORY;
+	}
+
+	/* the attributes first, then the children in one merge */
+	for(o = op->child; o; o = o->sibling) {
+		char * name = get_attribute(o, "name");
+		xml_attribute * a, ** pa;
+
+		if(!strcmp(o->name, "set")) {
+			a = copy_attribute(name, get_attribute(o, "value"));
+			if(!a) {
+				xml_free(arr);
+				return NOMEMORY;
+			}
+			add_attribute(node, a);
+		} else if(!strcmp(o->name, "unset")) {
+			for(pa = &node->attributes; *pa; pa = &(*pa)->next) {
+				if(!strcmp((*pa)->name, name)) {
+					a = *pa;
+					index_attribute(ix, node, a, 0);
+					*pa = a->next;
+					if(a->flags & FREENAME) {
+						xml_free(a->name);
+					}
+					if(a->flags & FREETEXT) {
+						xml_free(a->value);
+					}
+					if(!(a->flags & INARENA)) {
+						xml_free(a);
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	o = op->child;
+	for(k = 0; k <= count; k++) {
+		int keep = k < count;
+
+		for(; o && op_index(o) <= k; o = o->sibling) {
+			if(op_index(o) < 0) {
+				continue;
+			}
+
+			if(!strcmp(o->name, "insert")) {
+				xml_node * copy = xml_clone(o->child);
+				if(!copy) {
+					xml_free(arr);
+					return NOMEMORY;
+				}
+				copy->parent = node;
+				*tail = copy;
+				tail = &copy->sibling;
+				index_tree(ix, copy, 1);
+			} else if(!strcmp(o->name, "delete")) {
+				keep = 0;
+			} else if(!strcmp(o->name, "node")) {
+				if(patch_node(arr[k], o) < 0) {
+					xml_free(arr);
+					return NOMEMORY;
+				}
+			} else if(!strcmp(o->name, "text")) {
+				char * text = copy_string(get_attribute(o, "value"));
+				if(!text) {
+					xml_free(arr);
+					return NOMEMORY;
+				}
+				if(arr[k]->flags & FREETEXT) {
+					xml_free(arr[k]->text);
+				}
+				arr[k]->text = text;
+				arr[k]->flags |= FREETEXT;
+				arr[k]->hash = 0;
+			}
+		}
+
+		if(keep) {
+			*tail = arr[k];
+			tail = &arr[k]->sibling;
+		} else if(k < count) {
+			index_tree(ix, arr[k], 0);
+			arr[k]->sibling = NULL;
+			destroy_node(arr[k]);
+		}
+	}
+
+	*tail = NULL;
+	xml_free(arr);
+	xml_touch(node);
+	return 0;
+}
+
+/* 
+ * Use this to apply an edit script from xml_diff to a tree, which the
+ * script must have been made against (or one equal to it). Returns 0,
+ * PATCHERROR if the script does not fit the tree, which is then left as
+ * it was, or NOMEMORY when out of memory.
+ */
+int xml_patch(xml_node * root, xml_node * diff) {
+	int ret;
+
+	if(!root || !diff) {
+		return PATCHERROR;
+	}
+
+	ret = patch_check(root, diff);
+	if(ret < 0) {
+		return ret;
+	}
+
+	return patch_node(root, diff);
+}
+
+/* INTERNAL - a blank node, every field cleared */
+xml_node * new_node(xml_type type) {
+   xml_node * n;
+
+   n = (xml_node *)xml_calloc(1, sizeof(xml_node));
+   if(n) {
+	   n->type = type;
+	   n->flags = FREENAME | FREETEXT;
+   }
+
+   return n;
+}
+
+/* INTERNAL - a blank node made by a parse, counted against
+   config.max_nodes and charged to config.max_bytes */
+static xml_node * stream_node(stream_t * stream, xml_type type) {
+   xml_node * n;
+
+   if(stream->config.max_nodes && ++stream->nodes > stream->config.max_nodes) {
+	   stream->limited = NODELIMIT;
+	   return NULL;
+   }
+
+   if(stream_charge(stream, sizeof(xml_node)) < 0) {
+	   return NULL;
+   }
+
+   n = new_node(type);
+   STAT_ADD(stream, nodes[type], 1)
+   STAT_ADD(stream, bytes_allocated, sizeof(xml_node))
+   if(!n) {
+	   stream_credit(stream, sizeof(xml_node));
+   }
+   return n;
+}
+
+/* INTERNAL - takes over text already run through process_text. Unless
+   owned, text is left in place (parse_inplace) and never freed */
+xml_node * new_textnode(stream_t * stream, xml_type type, char * text,
+                        int owned) {
+   xml_node * n = stream_node(stream, type);
+
+   if(n) {
+	   n->text = text;
+	   if(!owned) {
+		  n->flags &= ~FREETEXT;
+	   }
+   } else if(owned) {
+	   xml_free(text);
+   }
+
+   return n;
+}
+
+/* INTERNAL - an element or entity named by the len bytes of a token
+   just read. In place the name, terminated there, is left where it is,
+   otherwise it is copied */
+xml_node * new_named(stream_t * stream, xml_type type, char * name, int len) {
+   xml_node * n = stream_node(stream, type);
+
+   if(!n) {
+	   return NULL;
+   }
+
+   if(stream->inplace) {
+	   n->name = name;
+	   n->flags &= ~FREENAME;
+	   return n;
+   }
+
+   n->name = stream_malloc(stream, len + 1);
+   STAT_ADD(stream, bytes_allocated, len + 1)
+   if(!n->name) {
+	   stream_free(stream, n, sizeof(xml_node));
+	   return NULL;
+   }
+
+   memcpy(n->name, name, len);
+   n->name[len] = 0;
+   return n;
+}
+
+/* create text node */
+xml_node * create_text(char * text) {
+   xml_node * n = new_node(TEXT);
+
+   if(n) {
+	   if(text) {
+	      n->text = process_text(text);
+       }
+   }
+
+   return n;
+}
+
+/* Create a PI node */
+xml_element * create_PI(char * name) {
+  /* kindda hacky */
+  /* PIs also have attributes etc. so we make give it element status */
+  xml_element * pi = create_element(name);
+  if(pi) {
+    pi->type = PI;
+  }
+  return pi;
+}
+
+/* Create the root doc */
+xml_node * create_document() {
+    return create_splnode(DOCUMENT, NULL);
+}
+
+/* Create a CDATAsection node */
+xml_node * create_CDATA(char * text) {
+	return create_splnode(CDATA, text);
+}
+
+/* Create a Comment node. Comments can be first class citizens */
+xml_node * create_comment(char * text) {
+	return create_splnode(COMMENT, text);
+}
+
+/* Create an entity */
+xml_node * create_entity(char * name) {
+   xml_node * n = new_node(ENTITY);
+
+   if(n) {
+   	   if(name) {
+	      n->name = xml_malloc(strlen(name) + 1);
+	      if(!n->name) {
+	         xml_free(n);
+	         return NULL;
+	      }
+	      strcpy(n->name, name); 
+	   }
+   }
+
+   return n;
+}
+
+/* INTERNAL */
+xml_node * create_splnode(xml_type type, char * text) {
+   xml_node * n = new_node(type);
+
+   if(n) {
+	   n->text = process_text(text);
+   }
+
+   return n;
+}
+
+
+/* Use this to create an element node */
+xml_element * create_element(char * name) {
+    
+   xml_element * e = new_node(ELEMENT);
+   if(e) {
+	   if(name) {
+	      e->name = xml_malloc(strlen(name) + 1);
+	      if(!e->name) {
+	         xml_free(e);
+	         return NULL;
+	      }
+	      strcpy(e->name, name); 
+	   }
+   }
+
+   return e;
+}
+
+
+/*
+ * XPath iterators. xpath_iter_init parses the path into steps once, and
+ * xpath_iter_next walks them depth first, one match per call, in the
+ * order select_nodes returns them. Nothing is allocated: the iterator
+ * lives on the caller's stack and points into the path.
+ */
+
+/* INTERNAL - is s the len bytes at name */
+static int name_is(const char * s, const char * name, int len) {
+    return s && !strncmp(s, name, len) && s[len] == 0;
+}
+
+/* INTERNAL - one step of len bytes at s, by the rules of select. Its
+   names are looked up in the intern table: a tree can only hold names
+   already there. A step kept for trees parsed later sets insert, so it
+   holds the same pointers they will. Returns 0, or NOMEMORY */
+static int xpath_step_init(xpath_step * st, const char * s, int len,
+                           int insert) {
+    const char * p;
+
+    memset(st, 0, sizeof(xpath_step));
+    st->name = s;
+    st->len = len;
+
+    if(len > 0 && *s == '@') {
+        const char * eq = (const char *)memchr(s, '=', len);
+
+        st->attr = 1;
+        st->name = s + 1;
+        st->len = len - 1;
+        if(eq && eq + 1 < s + len && eq != s + 1) {
+            st->len = (int)(eq - s) - 1;
+            st->value = eq + 1;
+            st->valuelen = (int)(s + len - eq) - 1;
+        }
+    } else if(len > 0 && *s == '{' && (p = (const char *)memchr(s, '}', len))) {
+        st->clark = 1;
+        st->ns = (p > s + 1) ? intern(NULL, s + 1, (int)(p - s) - 1, insert) : NULL;
+        st->local = intern(NULL, p + 1, (int)(s + len - p) - 1, insert);
+        if(p > s + 1 && !st->ns) {
+            st->local = NULL;     /* unknown namespace, nothing matches */
+        }
+    } else if(memchr(s, ':', len)) {
+        st->prefixed = 1;
+    } else {
+        st->local = intern(NULL, s, len, insert);
+    }
+
+    return (insert && !st->attr && !st->prefixed && !st->local) ? NOMEMORY : 0;
+}
+
+/* INTERNAL - does node match a name step */
+static int xpath_step_match(xpath_step * st, xml_node * node) {
+    const char * col;
+
+    if(node->localname) {
+        if(st->clark) {
+            return node->localname == st->local && node->ns == st->ns;
+        }
+        if(st->prefixed) {
+            return name_is(node->name, st->name, st->len);
+        }
+        return node->localname == st->local;
+    }
+
+    if(st->clark || !node->name) {
+        return 0;
+    }
+
+    if(name_is(node->name, st->name, st->len)) {
+        return 1;
+    }
+
+    col = strchr(node->name, ':');
+    return col && *(col + 1) && name_is(col + 1, st->name, st->len);
+}
+
+/* INTERNAL - does node pass an @ step */
+static int xpath_step_filter(xpath_step * st, xml_node * node) {
+    xml_attribute * a;
+
+    for(a = node->attributes; a; a = a->next) {
+        if(name_is(a->name, st->name, st->len) && 
+           (!st->value || name_is(a->value, st->value, st->valuelen))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+  * Use this API to go through the nodes an xpath selects, without
+  * allocating
+  * it --> the iterator, usually on the stack
+  * current, xpath --> as for select_nodes; xpath must outlive it
+  * Returns 0, or XPATHERROR for paths of more than XPATH_MAX_STEPS
+  * steps. The tree must not change while iterating.
+  */
+int xpath_iter_init(xpath_iter * it, xml_node * current, const char * xpath) {
+    const char * q = xpath;
+
+    it->start = current;
+    it->steps = 0;
+    it->level = 0;
+    it->at[0] = NULL;
+
+    if(!current || !xpath) {
+        it->level = -1;
+        return 0;
+    }
+
+    if(*q == '/') {
+        while(current->parent) {
+            current = current->parent;
+        }
+        it->start = current;
+        q++;
+
+        /* keyed lookups go through the index when there is one */
+        if(current->index) {
+            xml_node * node;
+            int ret = select_indexed(current, q, &node);
+
+            if(ret >= 0) {
+                it->start = node;
+                it->level = ret ? 0 : -1;
+                return 0;
+            }
+        }
+    }
+
+    while(*q) {
+        /* a {uri} step may hold '/'s of its own */
+        const char * p = (*q == '{') ? strchr(q, '}') : q;
+        const char * end;
+
+        p = p ? strchr(p, '/') : NULL;
+        end = p ? p : q + strlen(q);
+
+        if(it->steps == XPATH_MAX_STEPS) {
+            it->level = -1;
+            return XPATHERROR;
+        }
+
+        xpath_step_init(&it->step[it->steps++], q, (int)(end - q), 0);
+        q = p ? p + 1 : end;
+    }
+
+    return 0;
+}
+
+/* Use this to get the next node of an xpath iterator, NULL at the end */
+xml_node * xpath_iter_next(xpath_iter * it) {
+    int k = it->level;
+
+    if(k < 0) {
+        return NULL;
+    }
+
+    if(it->steps == 0) {
+        it->level = -1;
+        return it->start;
+    }
+
+    while(k >= 0) {
+        xml_node * parent = k ? it->at[k - 1] : it->start;
+        xpath_step * st = &it->step[k];
+        xml_node * n;
+
+        if(st->attr) {
+            /* a filter, the node so far passes once or not at all */
+            n = (!it->at[k] && xpath_step_filter(st, parent)) ? parent : NULL;
+        } else {
+            n = it->at[k] ? it->at[k]->sibling : parent->child;
+            while(n && !xpath_step_match(st, n)) {
+                n = n->sibling;
+            }
+        }
+
+        it->at[k] = n;
+        if(!n) {
+            k--;
+        } else if(k == it->steps - 1) {
+            it->level = k;
+            return n;
+        } else {
+            it->at[++k] = NULL;
+        }
+    }
+
+    it->level = -1;
+    return NULL;
+}
+
+/**
+  * Use this API to select nodes into an array of your own
+  * nodes, size --> the array, filled with the first size matches
+  * Returns the number of matches, which may be more than size (call
+  * again with a larger array), or XPATHERROR as xpath_iter_init
+  */
+int select_nodes_into(xml_node * current, const char * xpath,
+                      xml_node ** nodes, int size) {
+    xpath_iter it;
+    xml_node * node;
+    int count = 0;
+    int ret;
+
+    ret = xpath_iter_init(&it, current, xpath);
+    if(ret < 0) {
+        return ret;
+    }
+
+    while((node = xpath_iter_next(&it)) != NULL) {
+        if(count < size) {
+            nodes[count] = node;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * Batch xpaths. xpath_batch_compile merges a set of paths into a trie
+ * of steps, shared prefixes once. xpath_batch_run then evaluates all of
+ * them in one depth first pass, carrying down the set of trie states the
+ * path to each node matches, and fills a slot per path. Plain name steps
+ * are found through a table by state and name, so a node costs one hash
+ * and a probe per state however many paths branch there.
+ */
+typedef struct batch_state_t {
+    xpath_step step;
+    const char * src;    /* the step as written */
+    int srclen;
+    int parent;
+    int child;           /* first state one step on, -1 for none */
+    int sibling;
+    int other;           /* first such state not a plain name step */
+    int othersib;
+    int query;           /* first path ending here, -1 for none */
+} batch_state;
+
+struct xpath_batch_t {
+    char * paths;            /* copies of the paths, steps point in */
+    batch_state * states;    /* [0] absolute paths, [1] relative ones */
+    int nstates;
+    int depth;               /* most name steps in a path */
+    int * next;              /* paths ending at the same state */
+    int nqueries;
+    int * table;             /* plain name steps by parent and name */
+    int tablesize;
+};
+
+/* INTERNAL - a plain name step, matched by name alone */
+static int batch_plain(xpath_step * st) {
+    return !st->attr && !st->clark && !st->prefixed;
+}
+
+/* INTERNAL - what plain name steps are compared with: the local name */
+static const char * batch_key(xml_node * node) {
+    const char * col;
+
+    if(node->localname || !node->name) {
+        return node->localname;
+    }
+
+    col = strchr(node->name, ':');
+    return (col && *(col + 1)) ? col + 1 : node->name;
+}
+
+/* INTERNAL */
+static int batch_slot(xpath_batch * batch, int parent, uint64_t h) {
+    return (int)((h + (uint64_t)parent * 0x9E3779B97F4A7C15ULL) >> 7 & 
+                 (batch->tablesize - 1));
+}
+
+/* INTERNAL - the state one step of len bytes at s on from parent */
+static int batch_state_add(xpath_batch * batch, int * psize, int parent,
+                           const char * s, int len) {
+    batch_state * st;
+    int k;
+
+    for(k = batch->states[parent].child; k >= 0; k = batch->states[k].sibling) {
+        if(batch->states[k].srclen == len && 
+           !memcmp(batch->states[k].src, s, len)) {
+            return k;
+        }
+    }
+
+    if(batch->nstates == *psize) {
+        batch_state * states = (batch_state *)xml_realloc(batch->states, 
+                                *psize * 2 * sizeof(batch_state));
+        if(!states) {
+            return NOMEMORY;
+        }
+        batch->states = states;
+        *psize *= 2;
+    }
+
+    k = batch->nstates++;
+    st = &batch->states[k];
+    if(xpath_step_init(&st->step, s, len, 1) < 0) {
+        batch->nstates--;
+        return NOMEMORY;
+    }
+    st->src = s;
+    st->srclen = len;
+    st->parent = parent;
+    st->child = -1;
+    st->other = -1;
+    st->othersib = -1;
+    st->query = -1;
+    st->sibling = batch->states[parent].child;
+    batch->states[parent].child = k;
+
+    if(!batch_plain(&st->step)) {
+        st->othersib = batch->states[parent].other;
+        batch->states[parent].other = k;
+    }
+    return k;
+}
+
+/* 
+ * Use this to compile xpaths for xpath_batch_run, once for any number of
+ * runs. paths are copied, and the names in them interned so trees parsed
+ * with namespaces later still match: free the batch before
+ * xml_intern_reset. Returns NULL when out of memory.
+ */
+xpath_batch * xpath_batch_compile(const char ** paths, int count) {
+    xpath_batch * batch = (xpath_batch *)xml_calloc(1, sizeof(xpath_batch));
+    size_t bytes = 0;
+    int size = 16;
+    char * q;
+    int i;
+
+    if(!batch) {
+        return NULL;
+    }
+
+    for(i = 0; i < count; i++) {
+        bytes += strlen(paths[i]) + 1;
+    }
+
+    batch->paths = (char *)xml_malloc(bytes + 1);
+    batch->states = (batch_state *)xml_malloc(size * sizeof(batch_state));
+    batch->next = (int *)xml_malloc((count + 1) * sizeof(int));
+    if(!batch->paths || !batch->states || !batch->next) {
+        xpath_batch_free(batch);
+        return NULL;
+    }
+
+    for(i = 0; i < 2; i++) {
+        memset(&batch->states[i], 0, sizeof(batch_state));
+        batch->states[i].parent = -1;
+        batch->states[i].child = -1;
+        batch->states[i].sibling = -1;
+        batch->states[i].other = -1;
+        batch->states[i].othersib = -1;
+        batch->states[i].query = -1;
+    }
+    batch->nstates = 2;
+    batch->nqueries = count;
+
+    q = batch->paths;
+    for(i = 0; i < count; i++) {
+        int state = (*paths[i] == '/') ? 0 : 1;
+        int depth = 0;
+
+        strcpy(q, paths[i]);
+        if(*q == '/') {
+            q++;
+        }
+
+        /* split as select_nodes does */
+        while(*q) {
+            char * p = (*q == '{') ? strchr(q, '}') : q;
+            char * end;
+
+            p = p ? strchr(p, '/') : NULL;
+            end = p ? p : q + strlen(q);
+
+            state = batch_state_add(batch, &size, state, q, (int)(end - q));
+            if(state < 0) {
+                xpath_batch_free(batch);
+                return NULL;
+            }
+
+            if(*q != '@') {
+                depth++;
+            }
+            q = p ? p + 1 : end;
+        }
+        q++;
+
+        batch->next[i] = batch->states[state].query;
+        batch->states[state].query = i;
+
+        if(depth > batch->depth) {
+            batch->depth = depth;
+        }
+    }
+
+    for(batch->tablesize = 16; batch->tablesize < 2 * batch->nstates; ) {
+        batch->tablesize *= 2;
+    }
+    batch->table = (int *)xml_malloc(batch->tablesize * sizeof(int));
+
+    if(!batch->table) {
+        xpath_batch_free(batch);
+        return NULL;
+    }
+
+    for(i = 0; i < batch->tablesize; i++) {
+        batch->table[i] = -1;
+    }
+
+    for(i = 2; i < batch->nstates; i++) {
+        batch_state * st = &batch->states[i];
+
+        if(batch_plain(&st->step)) {
+            int k = batch_slot(batch, st->parent, hash_bytes(st->src, st->srclen, 0));
+
+            while(batch->table[k] >= 0) {
+                k = (k + 1) & (batch->tablesize - 1);
+            }
+            batch->table[k] = i;
+        }
+    }
+
+    return batch;
+}
+
+/* Frees what xpath_batch_compile made */
+void xpath_batch_free(xpath_batch * batch) {
+    if(batch) {
+        xml_free(batch->paths);
+        xml_free(batch->states);
+        xml_free(batch->next);
+        xml_free(batch->table);
+        xml_free(batch);
+    }
+}
+
+/* ints of states a run keeps on the stack, see xpath_batch_run */
+#define BATCH_SETS 512
+
+/* INTERNAL - the context of a run */
+typedef struct batch_run_t {
+    xpath_batch * batch;
+    xml_node ** first;
+    int * counts;
+    int found;
+} batch_run;
+
+/* INTERNAL - node with the count states in set matching the path to it.
+   Returns 1 once every path has its first match and no counts are kept */
+static int batch_visit(batch_run * run, xml_node * node, int * set, int count) {
+    xpath_batch * batch = run->batch;
+    xml_node * n;
+    int i, k;
+
+    /* @ steps filter in place, and may follow one another */
+    for(i = 0; i < count; i++) {
+        for(k = batch->states[set[i]].other; k >= 0; k = batch->states[k].othersib) {
+            if(batch->states[k].step.attr && 
+               xpath_step_filter(&batch->states[k].step, node)) {
+                set[count++] = k;
+            }
+        }
+    }
+
+    for(i = 0; i < count; i++) {
+        int q;
+
+        for(q = batch->states[set[i]].query; q >= 0; q = batch->next[q]) {
+            if(!run->first[q]) {
+                run->first[q] = node;
+                run->found++;
+            }
+            if(run->counts) {
+                run->counts[q]++;
+            }
+        }
+    }
+
+    if(!run->counts && run->found == batch->nqueries) {
+        return 1;
+    }
+
+    for(n = node->child; n; n = n->sibling) {
+        const char * key = batch_key(n);
+        int * next = set + batch->nstates;
+        uint64_t h = 0;
+        int len = 0;
+        int c = 0;
+
+        if(key) {
+            len = (int)strlen(key);
+            h = hash_bytes(key, len, 0);
+        }
+
+        for(i = 0; i < count; i++) {
+            if(key) {
+                int slot = batch_slot(batch, set[i], h);
+
+                for(; (k = batch->table[slot]) >= 0; 
+                    slot = (slot + 1) & (batch->tablesize - 1)) {
+                    if(batch->states[k].parent == set[i] && 
+                       batch->states[k].srclen == len && 
+                       !memcmp(batch->states[k].src, key, len)) {
+                        next[c++] = k;
+                        break;
+                    }
+                }
+            }
+
+            for(k = batch->states[set[i]].other; k >= 0; k = batch->states[k].othersib) {
+                batch_state * st = &batch->states[k];
+
+                if(!st->step.attr && xpath_step_match(&st->step, n)) {
+                    next[c++] = k;
+                }
+            }
+        }
+
+        if(c && batch_visit(run, n, next, c)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+  * Use this API to evaluate compiled xpaths in one pass over a tree
+  * node --> where relative paths start; absolute ones start at its top
+  * first --> a slot per path, set to its first match in document order
+  * (the first select_nodes would return), NULL for none
+  * counts --> NULL, or a slot per path set to its number of matches.
+  * Without counts the pass stops once every path has a match
+  * Returns the number of paths that matched, or NOMEMORY. The batch is
+  * only read, so runs of it may go on at once; each keeps the states it
+  * is in itself, on the stack unless the batch is large.
+  */
+int xpath_batch_run(xpath_batch * batch, xml_node * node, xml_node ** first,
+                    int * counts) {
+    int local[BATCH_SETS];
+    int * sets = local;
+    size_t size;
+    xml_node * top = node;
+    batch_run run;
+    int i;
+
+    if(!batch || !node) {
+        return 0;
+    }
+
+    /* active states, depth + 1 levels */
+    size = (size_t)(batch->depth + 1) * batch->nstates;
+    if(size > BATCH_SETS) {
+        sets = (int *)xml_malloc(size * sizeof(int));
+        if(!sets) {
+            return NOMEMORY;
+        }
+    }
+
+    for(i = 0; i < batch->nqueries; i++) {
+        first[i] = NULL;
+        if(counts) {
+            counts[i] = 0;
+        }
+    }
+
+    while(top->parent) {
+        top = top->parent;
+    }
+
+    run.batch = batch;
+    run.first = first;
+    run.counts = counts;
+    run.found = 0;
+
+    if(top == node) {
+        sets[0] = 0;
+        sets[1] = 1;
+        batch_visit(&run, node, sets, 2);
+    } else {
+        sets[0] = 0;
+        if(!batch_visit(&run, top, sets, 1)) {
+            sets[0] = 1;
+            batch_visit(&run, node, sets, 1);
+        }
+    }
+
+    if(sets != local) {
+        xml_free(sets);
+    }
+    return run.found;
+}
+
+/* INTERNAL - select_nodes a step at a time, for paths too long for an
+   iterator */
+static xml_node ** select_walk(xml_node * current, 
+                               int * pcount, 
+                               char * xpathstr) {
+    char * p;
+    char * q; 
+    xml_node **nodearr;
+
+    int count  = 1;
+    char *xpath = NULL;
+
+    xpath = xml_malloc(strlen(xpathstr) + 1);
+    strcpy(xpath, xpathstr);
+    q = xpath;
+    
+    if(*q == '/') {
+       xml_node * c = current;
+       while(c) {
+             current = c;
+             c = c->parent;
+       }
+       q++;
+    }
+
+    nodearr = xml_malloc(sizeof(xml_node *));
+    nodearr[0] = current;
+    
+    for(;q && *q;) {
+        xml_node **tmparr;
+
+        /* a {uri} step may hold '/'s of its own */
+        p = (*q == '{') ? strchr(q, '}') : q;
+        p = p ? strchr(p, '/') : NULL;
+
+        if(p) {
+          *p = 0;
+        }
+
+        tmparr = select(nodearr, &count, q);
+        if(tmparr) {
+            xml_free(nodearr);
+            nodearr = tmparr;
+
+        }
+        q = p ? p + 1 : NULL;
+    }
+
+    *pcount = count;
+    xml_free(xpath);
+    return nodearr;
+}
+
+/* Use this to select a set of nodes using a given xpath.
+   pcount --> should point to an int that will hold the count of nodes returned
+   xpathstr --> is XPath.
+   Returns an array to xml_free. See xpath_iter_init and select_nodes_into
+   for selecting without allocating.
+   Note that only a limited XPath syntax( very common one) is supported and tested! 
+*/
+xml_node** select_nodes(xml_node* current, 
+                        int *pcount, 
+                        char * xpathstr) {
+    xml_node ** nodearr;
+    xml_node * node;
+    xpath_iter it;
+    int size = 4;
+    int count = 0;
+
+    if(xpathstr == NULL) {
+       return NULL;
+    }
+
+    if(xpath_iter_init(&it, current, xpathstr) < 0) {
+       return select_walk(current, pcount, xpathstr);
+    }
+
+    nodearr = xml_malloc(size * sizeof(xml_node *));
+    if(!nodearr) {
+       *pcount = 0;
+       return NULL;
+    }
+
+    while((node = xpath_iter_next(&it)) != NULL) {
+        if(count == size) {
+            xml_node ** tmparr = xml_realloc(nodearr, size * 2 * sizeof(xml_node *));
+            if(!tmparr) {
+                /* Warn for memory error */
+                break;
+            }
+            nodearr = tmparr;
+            size *= 2;
+        }
+
+        nodearr[count++] = node;
+    }
+
+    *pcount = count;
+    return nodearr;
+}
+
+/* Returns an attribute's value given the key and a node */
+char * get_attribute(xml_node * node, 
+                     char * name) {
+    if(node && name) {
+        xml_attribute * attrib = node->attributes;
+        while(attrib) {
+            if(!strcmp(attrib->name, name)) {
+               return attrib->value;  
+            }
+            attrib = attrib->next;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns an attribute's value given an xpath. Stops at the first node
+   the xpath selects */
+char * get_attrib_value(xml_node * current, 
+                        char *xpath) {
+   char * at = xpath ? strchr(xpath, '@') : NULL;
+   xml_node * node;
+   xpath_iter it;
+
+   if(!at || !*(at + 1)) {
+       return NULL;
+   }
+
+   if(xpath_iter_init(&it, current, xpath) < 0) {
+       int count;
+       xml_node ** nodes = select_walk(current, &count, xpath);
+       node = count > 0 ? nodes[0] : NULL;
+       xml_free(nodes);
+   } else {
+       node = xpath_iter_next(&it);
+   }
+
+   return node ? get_attribute(node, at + 1) : NULL;
+}
+
+/*
+ * INTERNAL
+ * Selects a node given an partial path ( not XPath)
+ * 
+ */
+xml_node** select(xml_node ** current, 
+                  int *pcount, 
+                  char * path) {
+    xml_node **nodearr = NULL;
+    int maxindex = 0;
+    int index = 0;
+    int j = 0;
+    xml_node * node;
+    char * p;
+
+    /* pcount is input and output */
+    int nodecount = *pcount;
+
+    if(!current || !path) {
+        *pcount = 0;
+        return current;
+    }
+
+    if(path[0] == '@') { /* attribute */
+          /* one should search for attributes in the nodes themselves */
+          char * name, *value = NULL;
+          p = &path[1];
+          parse_name_value(p, &name, &value);
+
+          for(j = 0; j < nodecount; j++) {
+            node = current[j];
+
+            if(find_attribute(node, name, value)) {
+               if(index == maxindex) {
+                 int size = maxindex ? maxindex * 2 : 4;
+                 xml_node** tmparr = xml_realloc(nodearr, size * sizeof(xml_node *));
+                 if(!tmparr) {
+                       /* Warn for memory error */
+                      return nodearr;
+                 }
+
+                 nodearr = tmparr;
+                 maxindex = size;
+               }
+
+               nodearr[index++] = node;
+            }
+          }
+
+          if(name) xml_free(name);
+          if(value) xml_free(value);
+
+    } else {
+        /* matched as xpath_iter matches a step; names not yet
+           interned can not be in the tree, so none are added */
+        xpath_step step;
+
+        xpath_step_init(&step, path, (int)strlen(path), 0);
+
+        for(j = 0; j < nodecount; j++) {
+            node = current[j]->child;
+
+            while(node) {
+               if(xpath_step_match(&step, node)) {
+                  if(index == maxindex) {
+                    int size = maxindex ? maxindex * 2 : 4;
+                    xml_node** tmparr = xml_realloc(nodearr, size * sizeof(xml_node *));
+                    if(!tmparr) {
+                       /* Warn for memory error */
+                       return nodearr;
+                    }
+
+                    nodearr = tmparr;
+                    maxindex = size;
+                  }
+
+                  nodearr[index++] = node;
+               }
+
+               node = node->sibling;
+            }
+        }
+    }
+
+    *pcount = index;
+    return nodearr;
+}
+
+void parse_name_value(char *p, 
+                      char** name, 
+                      char** value) {
+    char * q = strchr(p, '=');
+    *value = *name = NULL;
+    if( q && *(q + 1) &&(*p != *q) ) {
+        *q = 0;
+        *value = (char *)xml_malloc(strlen(q + 1) + 1);
+        strcpy(*value, q + 1);
+    }
+
+    *name = (char *)xml_malloc(strlen(p) + 1);
+    strcpy(*name, p);
+}
+
+/* Finds an attribute of a tree parsed with namespaces by its namespace
+   and local name, both interned (see xml_intern). ns NULL for none */
+xml_attribute * find_attribute_ns(xml_node * node, const char * ns,
+                                  const char * localname) {
+    if(node != NULL) {
+        xml_attribute * attrib = node->attributes;
+
+        for(; attrib; attrib = attrib->next) {
+            if(attrib->localname == localname && attrib->ns == ns) {
+                return attrib;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+xml_attribute * find_attribute(xml_node * node,
+                               char * name , 
+                               char * value) {
+
+    if(node != NULL) {
+        xml_attribute * attrib = node->attributes;
+
+        while(attrib) {
+            if(name && !strcmp(attrib->name, name)) {
+                if(value) {
+                  if(!strcmp(attrib->value, value))
+                      return attrib; 
+                } else {
+                   return attrib;
+                }
+            }
+
+            attrib = attrib->next;
+        }
+    }
+
+    return NULL;
+}
+
+
+char * get_text(xml_node * current) {
+    if(current && current->type == ELEMENT) {
+        xml_node *node = current->child;
+
+        while(node && node->type != TEXT) {
+           node = node->sibling;
+        }
+
+        if(node) {
+           return node->text;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+
+
+/*
+ * INTERNAL
+ * 64 bit non-cryptographic hash (XXH64). Eight bytes at a time over
+ * four independent lanes, so it runs close to memory speed.
+ */
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_P3 0x165667B19E3779F9ULL
+#define HASH_P4 0x85EBCA77C2B2AE63ULL
+#define HASH_P5 0x27D4EB2F165667C5ULL
+
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * HASH_P2;
+    acc = HASH_ROTL(acc, 31);
+    return acc * HASH_P1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t val) {
+    acc ^= hash_round(0, val);
+    return acc * HASH_P1 + HASH_P4;
+}
+
+uint64_t hash_bytes(const void * data, size_t len, uint64_t seed) {
+    const unsigned char * p = (const unsigned char *)data;
+    const unsigned char * end = p + len;
+    uint64_t h, k;
+    uint32_t w;
+
+    if(len >= 32) {
+        uint64_t v1 = seed + HASH_P1 + HASH_P2;
+        uint64_t v2 = seed + HASH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_P1;
+
+        do {
+            memcpy(&k, p, 8);      v1 = hash_round(v1, k);
+            memcpy(&k, p + 8, 8);  v2 = hash_round(v2, k);
+            memcpy(&k, p + 16, 8); v3 = hash_round(v3, k);
+            memcpy(&k, p + 24, 8); v4 = hash_round(v4, k);
+            p += 32;
+        } while(p + 32 <= end);
+
+        h = HASH_ROTL(v1, 1) + HASH_ROTL(v2, 7) + 
+            HASH_ROTL(v3, 12) + HASH_ROTL(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = seed + HASH_P5;
+    }
+
+    h += (uint64_t)len;
+
+    while(p + 8 <= end) {
+        memcpy(&k, p, 8);
+        h ^= hash_round(0, k);
+        h = HASH_ROTL(h, 27) * HASH_P1 + HASH_P4;
+        p += 8;
+    }
+
+    if(p + 4 <= end) {
+        memcpy(&w, p, 4);
+        h ^= (uint64_t)w * HASH_P1;
+        h = HASH_ROTL(h, 23) * HASH_P2 + HASH_P3;
+        p += 4;
+    }
+
+    while(p < end) {
+        h ^= (*p++) * HASH_P5;
+        h = HASH_ROTL(h, 11) * HASH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/*
+ * Interned strings. One table for the process: equal strings share one
+ * copy, so interned names compare by pointer. Strings stay until
+ * xml_intern_reset. Every lookup and insert holds intern_lock, so the
+ * slot array can be grown (and the old one freed) while other threads
+ * parse or select; the strings themselves never move.
+ */
+typedef struct intern_slot_t {
+    char * s;         /* NULL for a free slot */
+    int len;
+    uint64_t hash;
+} intern_slot;
+
+static intern_slot * interns;
+static int intern_size;
+static int intern_count;
+
+#ifdef XMLC_THREADS
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+#define INTERN_LOCK() pthread_mutex_lock(&intern_lock);
+#define INTERN_UNLOCK() pthread_mutex_unlock(&intern_lock);
+#else
+#define INTERN_LOCK()
+#define INTERN_UNLOCK()
+#endif
+
+/* INTERNAL - intern with intern_lock held */
+static const char * intern_locked(stream_t * stream, const char * s, int len,
+                                  int insert) {
+    uint64_t h = hash_bytes(s, len, 0);
+    intern_slot * slot;
+    char * copy;
+    int i;
+
+    if(intern_size) {
+        for(i = (int)(h & (intern_size - 1)); interns[i].s;
+            i = (i + 1) & (intern_size - 1)) {
+            if(interns[i].hash == h && interns[i].len == len &&
+               !memcmp(interns[i].s, s, len)) {
+                return interns[i].s;
+            }
         }
-	}
+    }
+
+    if(!insert) {
+        return NULL;
+    }
+
+    if((intern_count + 1) * 4 > intern_size * 3) {
+        int size = intern_size ? intern_size * 2 : 256;
+        intern_slot * slots;
+
+        /* the parse that grows the table pays for the growth */
+        if(stream_charge(stream, (size - intern_size) * sizeof(intern_slot)) < 0) {
+            return NULL;
+        }
+        slots = (intern_slot *)xml_calloc(size, sizeof(intern_slot));
+        if(!slots) {
+            stream_credit(stream, (size - intern_size) * sizeof(intern_slot));
+            return NULL;
+        }
+
+        for(i = 0; i < intern_size; i++) {
+            if(interns[i].s) {
+                int k = (int)(interns[i].hash & (size - 1));
+                while(slots[k].s) {
+                    k = (k + 1) & (size - 1);
+                }
+                slots[k] = interns[i];
+            }
+        }
+
+        xml_free(interns);
+        interns = slots;
+        intern_size = size;
+    }
+
+    copy = (char *)stream_malloc(stream, len + 1);
+    if(!copy) {
+        return NULL;
+    }
+
+    for(i = (int)(h & (intern_size - 1)); interns[i].s;
+        i = (i + 1) & (intern_size - 1))
+        ;
+
+    slot = &interns[i];
+    memcpy(copy, s, len);
+    copy[len] = 0;
+    slot->s = copy;
+    slot->len = len;
+    slot->hash = h;
+    intern_count++;
+
+    return slot->s;
+}
+
+/* INTERNAL - the interned copy of len bytes at s. Added if insert is
+   set, otherwise NULL when there is none. What a parse adds is charged
+   to stream (NULL for none), against config.max_bytes: it outlives the
+   tree, so it is never credited back */
+const char * intern(stream_t * stream, const char * s, int len, int insert) {
+    const char * p;
+
+    INTERN_LOCK()
+    p = intern_locked(stream, s, len, insert);
+    INTERN_UNLOCK()
+    return p;
+}
+
+/* Returns the interned copy of s, the handle namespace aware nodes use
+   for their ns and localname */
+const char * xml_intern(const char * s) {
+    return s ? intern(NULL, s, (int)strlen(s), 1) : NULL;
+}
+
+/* Frees every interned string. Only safe with no tree parsed with
+   namespaces left, and nothing parsing or selecting in another thread */
+void xml_intern_reset(void) {
+    int i;
+
+    INTERN_LOCK()
+    for(i = 0; i < intern_size; i++) {
+        xml_free(interns[i].s);
+    }
+
+    xml_free(interns);
+    interns = NULL;
+    intern_size = 0;
+    intern_count = 0;
+    INTERN_UNLOCK()
+}
+
+/*
+ * Secondary indexes. xml_index_build gives a tree a table from element
+ * names, and from the values of chosen attributes, to the nodes having
+ * them. The table hangs off the top node and the tree functions keep it
+ * up to date: a key and its nodes are found in O(1), and a node is taken
+ * out in O(1) through a second table by node.
+ */
+typedef struct index_key_t {
+    struct index_key_t * next;       /* bucket chain */
+    struct index_entry_t * first;    /* nodes having it, oldest first */
+    struct index_entry_t * last;
+    uint64_t hash;
+    int count;
+    char * value;                    /* NULL for an element name */
+    char name[1];                    /* name, then value */
+} index_key;
+
+typedef struct index_entry_t {
+    index_key * key;
+    xml_node * node;
+    struct index_entry_t * prev;     /* among the key's nodes */
+    struct index_entry_t * next;
+    struct index_entry_t * chain;    /* bucket chain by node */
+} index_entry;
+
+struct xml_index_t {
+    char ** attrs;          /* attribute names indexed, NULL terminated */
+    index_key ** keys;
+    int keysize, keycount;
+    index_entry ** nodes;
+    int nodesize, nodecount;
+    int failed;             /* out of memory keeping it: not used */
+};
+
+/* indexes in existence, nodes look for theirs only if there are any */
+static int index_live;
+
+#define INDEX_SIZE 256
+
+/* INTERNAL */
+static uint64_t index_hash(const char * name, const char * value) {
+    uint64_t h = hash_bytes(name, strlen(name), 0);
+    return value ? hash_bytes(value, strlen(value), h) : h;
+}
+
+/* INTERNAL */
+static int node_slot(xml_node * node, int size) {
+    return (int)(((uint64_t)(size_t)node * HASH_P1) >> 40) & (size - 1);
+}
+
+/* INTERNAL */
+static index_key * index_key_find(xml_index * ix, const char * name,
+                                  const char * value, uint64_t h) {
+    index_key * key = ix->keys[h & (ix->keysize - 1)];
+
+    for(; key; key = key->next) {
+        if(key->hash == h && !strcmp(key->name, name) && 
+           (value ? key->value && !strcmp(key->value, value) : !key->value)) {
+            return key;
+        }
+    }
+
+    return NULL;
+}
+
+/* INTERNAL - doubles either table once it is as full as it is long */
+static int index_grow(xml_index * ix, int nodes) {
+    int size = (nodes ? ix->nodesize : ix->keysize) * 2;
+    void ** table = (void **)xml_calloc(size, sizeof(void *));
+    int i;
+
+    if(!table) {
+        return NOMEMORY;
+    }
+
+    if(nodes) {
+        for(i = 0; i < ix->nodesize; i++) {
+            index_entry * e, * next;
+            for(e = ix->nodes[i]; e; e = next) {
+                int k = node_slot(e->node, size);
+                next = e->chain;
+                e->chain = (index_entry *)table[k];
+                table[k] = e;
+            }
+        }
+        xml_free(ix->nodes);
+        ix->nodes = (index_entry **)table;
+        ix->nodesize = size;
+    } else {
+        for(i = 0; i < ix->keysize; i++) {
+            index_key * key, * next;
+            for(key = ix->keys[i]; key; key = next) {
+                int k = (int)(key->hash & (size - 1));
+                next = key->next;
+                key->next = (index_key *)table[k];
+                table[k] = key;
+            }
+        }
+        xml_free(ix->keys);
+        ix->keys = (index_key **)table;
+        ix->keysize = size;
+    }
+
+    return 0;
+}
+
+/* INTERNAL */
+static void index_add(xml_index * ix, xml_node * node, const char * name,
+                      const char * value) {
+    uint64_t h = index_hash(name, value);
+    index_key * key = index_key_find(ix, name, value, h);
+    index_entry * e;
+    int slot;
+
+    if(!key) {
+        size_t n = strlen(name) + 1;
+        size_t v = value ? strlen(value) + 1 : 0;
+
+        if(ix->keycount >= ix->keysize && index_grow(ix, 0) < 0) {
+            ix->failed = 1;
+            return;
+        }
+
+        key = (index_key *)xml_malloc(sizeof(index_key) + n + v);
+        if(!key) {
+            ix->failed = 1;
+            return;
+        }
+
+        memcpy(key->name, name, n);
+        key->value = value ? &key->name[n] : NULL;
+        if(value) {
+            memcpy(key->value, value, v);
+        }
+        key->hash = h;
+        key->count = 0;
+        key->first = key->last = NULL;
+
+        slot = (int)(h & (ix->keysize - 1));
+        key->next = ix->keys[slot];
+        ix->keys[slot] = key;
+        ix->keycount++;
+    }
+
+    if(ix->nodecount >= ix->nodesize && index_grow(ix, 1) < 0) {
+        ix->failed = 1;
+        return;
+    }
+
+    e = (index_entry *)xml_malloc(sizeof(index_entry));
+    if(!e) {
+        ix->failed = 1;
+        return;
+    }
+
+    e->key = key;
+    e->node = node;
+    e->next = NULL;
+    e->prev = key->last;
+    if(key->last) {
+        key->last->next = e;
+    } else {
+        key->first = e;
+    }
+    key->last = e;
+    key->count++;
+
+    slot = node_slot(node, ix->nodesize);
+    e->chain = ix->nodes[slot];
+    ix->nodes[slot] = e;
+    ix->nodecount++;
+}
+
+/* INTERNAL */
+static void index_remove(xml_index * ix, xml_node * node, const char * name,
+                         const char * value) {
+    index_key * key = index_key_find(ix, name, value, index_hash(name, value));
+    index_entry ** pe;
+    index_entry * e;
+
+    if(!key) {
+        return;
+    }
+
+    for(pe = &ix->nodes[node_slot(node, ix->nodesize)]; *pe; pe = &(*pe)->chain) {
+        if((*pe)->node == node && (*pe)->key == key) {
+            break;
+        }
+    }
+
+    e = *pe;
+    if(!e) {
+        return;
+    }
+
+    *pe = e->chain;
+    ix->nodecount--;
+
+    if(e->prev) {
+        e->prev->next = e->next;
+    } else {
+        key->first = e->next;
+    }
+    if(e->next) {
+        e->next->prev = e->prev;
+    } else {
+        key->last = e->prev;
+    }
+    xml_free(e);
+
+    if(--key->count == 0) {
+        index_key ** pk = &ix->keys[key->hash & (ix->keysize - 1)];
+
+        while(*pk != key) {
+            pk = &(*pk)->next;
+        }
+        *pk = key->next;
+        ix->keycount--;
+        xml_free(key);
+    }
+}
+
+/* INTERNAL - is attribute name one ix indexes */
+static int index_wanted(xml_index * ix, const char * name) {
+    char ** attr;
+
+    for(attr = ix->attrs; *attr; attr++) {
+        if(!strcmp(*attr, name)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* INTERNAL - the index of the tree node is in, NULL for none */
+xml_index * index_of(xml_node * node) {
+    if(!COUNT_GET(index_live) || !node) {
+        return NULL;
+    }
+
+    while(node->parent) {
+        node = node->parent;
+    }
+
+    return (node->index && !node->index->failed) ? node->index : NULL;
+}
+
+/* INTERNAL - adds a to or takes it out of ix, for node */
+void index_attribute(xml_index * ix, xml_node * node, xml_attribute * a,
+                     int add) {
+    if(!ix || ix->failed || !a->value || !index_wanted(ix, a->name)) {
+        return;
+    }
+
+    if(add) {
+        index_add(ix, node, a->name, a->value);
+    } else {
+        index_remove(ix, node, a->name, a->value);
+    }
+}
+
+/* INTERNAL - adds the subtree at node to ix, or takes it out */
+void index_tree(xml_index * ix, xml_node * node, int add) {
+    xml_attribute * a;
+    xml_node * n;
+
+    if(!ix || ix->failed) {
+        return;
+    }
+
+    if(node->type == ELEMENT && node->name) {
+        if(add) {
+            index_add(ix, node, node->name, NULL);
+        } else {
+            index_remove(ix, node, node->name, NULL);
+        }
+    }
+
+    if(node->type == ELEMENT || node->type == PI) {
+        for(a = node->attributes; a; a = a->next) {
+            index_attribute(ix, node, a, add);
+        }
+    }
+
+    for(n = node->child; n; n = n->sibling) {
+        index_tree(ix, n, add);
+    }
+}
+
+/* INTERNAL - to now stands for from, see unshare_children */
+void index_rename(xml_index * ix, xml_node * from, xml_node * to) {
+    index_entry ** pe = &ix->nodes[node_slot(from, ix->nodesize)];
+
+    while(*pe) {
+        index_entry * e = *pe;
+
+        if(e->node == from) {
+            int slot = node_slot(to, ix->nodesize);
+
+            *pe = e->chain;
+            e->node = to;
+            e->chain = ix->nodes[slot];
+            ix->nodes[slot] = e;
+        } else {
+            pe = &e->chain;
+        }
+    }
+}
+
+/* Drops the index of the tree node is in, if any */
+void xml_index_drop(xml_node * node) {
+    xml_index * ix;
+    int i;
+
+    if(!node) {
+        return;
+    }
+
+    while(node->parent) {
+        node = node->parent;
+    }
+
+    ix = node->index;
+    if(!ix) {
+        return;
+    }
+
+    for(i = 0; i < ix->nodesize; i++) {
+        index_entry * e, * next;
+        for(e = ix->nodes[i]; e; e = next) {
+            next = e->chain;
+            xml_free(e);
+        }
+    }
+
+    for(i = 0; i < ix->keysize; i++) {
+        index_key * key, * next;
+        for(key = ix->keys[i]; key; key = next) {
+            next = key->next;
+            xml_free(key);
+        }
+    }
+
+    if(ix->attrs) {
+        for(i = 0; ix->attrs[i]; i++) {
+            xml_free(ix->attrs[i]);
+        }
+    }
+
+    xml_free(ix->attrs);
+    xml_free(ix->keys);
+    xml_free(ix->nodes);
+    xml_free(ix);
+
+    node->index = NULL;
+    COUNT_ADD(index_live, -1);
+}
+
+/**
+  * Use this API to index a tree for xml_lookup and select_nodes
+  * node --> any node of the tree, the index belongs to its top node
+  * attrs --> NULL terminated names of the attributes whose values are
+  * indexed, such as "id". Element names are always indexed
+  * The tree functions keep the index up to date; after changing names
+  * or attribute values directly, build it again. It goes with the tree
+  * or with xml_index_drop. Returns 0, or NOMEMORY when out of memory
+  */
+int xml_index_build(xml_node * node, const char ** attrs) {
+    xml_index * ix;
+    int count = 0;
+    int i;
+
+    if(!node) {
+        return 0;
+    }
+
+    while(node->parent) {
+        node = node->parent;
+    }
+
+    xml_index_drop(node);
+
+    ix = (xml_index *)xml_calloc(1, sizeof(xml_index));
+    if(!ix) {
+        return NOMEMORY;
+    }
+
+    node->index = ix;
+    COUNT_ADD(index_live, 1);
+
+    while(attrs && attrs[count]) {
+        count++;
+    }
+
+    ix->attrs = (char **)xml_calloc(count + 1, sizeof(char *));
+    ix->keys = (index_key **)xml_calloc(INDEX_SIZE, sizeof(index_key *));
+    ix->nodes = (index_entry **)xml_calloc(INDEX_SIZE, sizeof(index_entry *));
+    ix->keysize = ix->nodesize = INDEX_SIZE;
+
+    if(!ix->attrs || !ix->keys || !ix->nodes) {
+        xml_index_drop(node);
+        return NOMEMORY;
+    }
+
+    for(i = 0; i < count; i++) {
+        ix->attrs[i] = copy_string(attrs[i]);
+        if(!ix->attrs[i]) {
+            xml_index_drop(node);
+            return NOMEMORY;
+        }
+    }
+
+    index_tree(ix, node, 1);
+    if(ix->failed) {
+        xml_index_drop(node);
+        return NOMEMORY;
+    }
+
+    return 0;
+}
+
+/* INTERNAL - indexes to's tree by the attributes from's index has */
+int index_like(xml_node * to, xml_node * from) {
+    return xml_index_build(to, (const char **)from->index->attrs);
+}
+
+/* INTERNAL - what xml_lookup finds without an index, in document order.
+   Returns 1 once it has the first when all is not set */
+static int lookup_scan(xml_node * node, const char * name, const char * value,
+                       xml_node *** parr, int * pcount, int all) {
+    xml_node * n;
+    int match;
+
+    if(value) {
+        match = (node->type == ELEMENT || node->type == PI) && 
+                find_attribute(node, (char *)name, (char *)value);
+    } else {
+        match = node->type == ELEMENT && node->name && 
+                !strcmp(node->name, name);
+    }
+
+    if(match) {
+        /* grows at powers of two */
+        if(!(*pcount & (*pcount - 1))) {
+            xml_node ** arr = (xml_node **)xml_realloc(*parr, 
+                              (*pcount ? *pcount * 2 : 1) * sizeof(xml_node *));
+            if(!arr) {
+                return NOMEMORY;
+            }
+            *parr = arr;
+        }
+
+        (*parr)[(*pcount)++] = node;
+        if(!all) {
+            return 1;
+        }
+    }
+
+    for(n = node->child; n; n = n->sibling) {
+        int ret = lookup_scan(n, name, value, parr, pcount, all);
+        if(ret != 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/**
+  * Use this API to find nodes by element name or attribute value
+  * node --> any node of the tree, the whole tree is searched
+  * name, value --> an attribute and its value (as stored, escaped), or
+  * with value NULL an element name
+  * pcount --> should point to an int that will hold the count of nodes
+  * Returns an array to xml_free, NULL when nothing matches. The nodes
+  * come in the order they were indexed, which is document order unless
+  * the tree changed since. Without an index, the tree is searched.
+  */
+xml_node ** xml_lookup_all(xml_node * node, const char * name,
+                           const char * value, int * pcount) {
+    xml_node ** arr = NULL;
+    xml_index * ix;
+    int count = 0;
+
+    *pcount = 0;
+    if(!node || !name) {
+        return NULL;
+    }
+
+    while(node->parent) {
+        node = node->parent;
+    }
+
+    ix = node->index;
+    if(ix && !ix->failed && (!value || index_wanted(ix, name))) {
+        index_key * key = index_key_find(ix, name, value, index_hash(name, value));
+        index_entry * e;
+
+        if(!key) {
+            return NULL;
+        }
+
+        arr = (xml_node **)xml_malloc(key->count * sizeof(xml_node *));
+        if(!arr) {
+            return NULL;
+        }
+
+        for(e = key->first; e; e = e->next) {
+            arr[count++] = e->node;
+        }
+    } else if(lookup_scan(node, name, value, &arr, &count, 1) < 0) {
+        xml_free(arr);
+        return NULL;
+    }
+
+    *pcount = count;
+    return arr;
+}
+
+/* Use this to find the first node xml_lookup_all would return, such as
+   the element with a given id. O(1) with an index */
+xml_node * xml_lookup(xml_node * node, const char * name, const char * value) {
+    xml_node ** arr = NULL;
+    xml_index * ix;
+    int count = 0;
+
+    if(!node || !name) {
+        return NULL;
+    }
+
+    while(node->parent) {
+        node = node->parent;
+    }
+
+    ix = node->index;
+    if(ix && !ix->failed && (!value || index_wanted(ix, name))) {
+        index_key * key = index_key_find(ix, name, value, index_hash(name, value));
+        return key ? key->first->node : NULL;
+    }
+
+    lookup_scan(node, name, value, &arr, &count, 0);
+    node = count ? arr[0] : NULL;
+    xml_free(arr);
+    return node;
+}
+
+/* INTERNAL - does node match step, len bytes of a path without prefix */
+static int step_matches(xml_node * node, const char * step, int len) {
+    const char * name = node->localname ? node->localname : node->name;
+    const char * col;
+
+    if(!name) {
+        return 0;
+    }
+
+    if((int)strlen(name) == len && !memcmp(name, step, len)) {
+        return 1;
+    }
+
+    col = node->localname ? NULL : strchr(name, ':');
+    return col && (int)strlen(col + 1) == len && !memcmp(col + 1, step, len);
+}
+
+/*
+ * INTERNAL
+ * Absolute paths of plain steps ending in @name=value, with name indexed:
+ * the one node having it is looked up and its parents checked against
+ * the steps. path is past the leading '/'. Returns 1 with the node in
+ * *pnode, 0 for none, -1 when the path is not of that kind or the value
+ * is not unique, for the steps to be walked instead.
+ */
+int select_indexed(xml_node * top, const char * path, xml_node ** pnode) {
+    xml_index * ix = top->index;
+    const char * at = strrchr(path, '@');
+    const char * eq;
+    const char * p;
+    char name[64];
+    index_key * key;
+    xml_node * node;
+
+    if(!ix || ix->failed || !at || at == path || at[-1] != '/' || 
+       strchr(at, '/') || !(eq = strchr(at, '=')) || eq == at + 1 || !eq[1] ||
+       eq - at > (int)sizeof(name)) {
+        return -1;
+    }
+
+    for(p = path; p < at; p++) {
+        if(*p == '@' || *p == ':' || *p == '{' || *p == '=') {
+            return -1;
+        }
+    }
+
+    memcpy(name, at + 1, eq - at - 1);
+    name[eq - at - 1] = 0;
+
+    if(!index_wanted(ix, name)) {
+        return -1;
+    }
 
-    return NULL;
-}
+    key = index_key_find(ix, name, eq + 1, index_hash(name, eq + 1));
+    if(!key) {
+        return 0;
+    }
+    if(key->count > 1) {
+        return -1;
+    }
 
-/* INTERNAL - not used */
-int is_equal(xml_node * child1, xml_node * child2) {
+    /* the steps right to left against the node and its parents */
+    node = key->first->node;
+    p = at - 1;
+    while(node && p > path) {
+        const char * step = p;
 
-	if(child1 == NULL && child2 == NULL)
-		return 1L;
+        while(step > path && step[-1] != '/') {
+            step--;
+        }
 
-    if(child1->type != child2->type)
-		return 0L;
+        if(!step_matches(node, step, (int)(p - step))) {
+            break;
+        }
 
-	if(child1->type == TEXT) {
-        return (strcmp(child1->text, child2->text) == 0);
-	} else {
-		/* element comparison */
-		if(strcmp(child1->name, child2->name) == 0) {
-			return 1L;
-		}
+        node = node->parent;
+        p = step > path ? step - 1 : path;
+    }
 
-		/* TODO */
-	}
+    if(p == path && node == top) {
+        *pnode = key->first->node;
+        return 1;
+    }
 
-	return 0L;
+    return 0;
 }
 
-/* create text node */
-xml_node * create_text(char * text) {
-   xml_node * n = (xml_node *)malloc(sizeof(xml_node));
+/* INTERNAL - approximate heap bytes held by a tree */
+size_t tree_size(xml_node * node) {
+    size_t size = 0;
 
-   if(n) {
-	   n->sibling = n->child = NULL;
-	   if(text) {
-	      n->text = process_text(text);
-       }
+    while(node) {
+        xml_attribute * attrib;
 
-       n->parent = NULL;
-	   
-	   n->type = TEXT;
-   }
+        size += sizeof(xml_node);
+        if(node->name) size += strlen(node->name) + 1;
+        if(node->text) size += strlen(node->text) + 1;
 
-   return n;
-}
+        if(node->type == ELEMENT || node->type == PI) {
+            for(attrib = node->attributes; attrib; attrib = attrib->next) {
+                size += sizeof(xml_attribute);
+                if(attrib->name) size += strlen(attrib->name) + 1;
+                if(attrib->value) size += strlen(attrib->value) + 1;
+            }
+        }
 
-/* Create a PI node */
-xml_element * create_PI(char * name) {
-  /* kindda hacky */
-  /* PIs also have attributes etc. so we make give it element status */
-  xml_element * pi = create_element(name);
-  pi->type = PI;
-  return pi;
-}
+        size += tree_size(node->child);
+        node = node->sibling;
+    }
 
-/* Create the root doc */
-xml_node * create_document() {
-    return create_splnode(DOCUMENT, NULL);
+    return size;
 }
 
-/* Create a CDATAsection node */
-xml_node * create_CDATA(char * text) {
-	return create_splnode(CDATA, text);
+/* Use this to give back a tree. Shared trees are freed by their last holder */
+void xml_release(xml_node * node) {
+    if(node && COUNT_ADD(node->refcount, -1) <= 0) {
+        destroy_node(node);
+    }
 }
 
-/* Create a Comment node. Comments can be first class citizens */
-xml_node * create_comment(char * text) {
-	return create_splnode(COMMENT, text);
-}
+/* INTERNAL - one cached document */
+typedef struct cache_entry_t {
+    struct cache_entry_t * chain;    /* hash bucket */
+    struct cache_entry_t * prev;     /* LRU list, most recent first */
+    struct cache_entry_t * next;
+
+    uint64_t hash;
+    char * bytes;
+    int len;
+    size_t cost;
+    xml_node * document;
+} cache_entry;
+
+struct xml_cache_t {
+    cache_entry ** buckets;
+    unsigned long nbuckets;          /* power of 2 */
+    cache_entry * head;
+    cache_entry * tail;
+    config_t config;
+    xml_cache_stats stats;
+#ifdef XMLC_THREADS
+    pthread_mutex_t lock;            /* all of the above */
+#endif
+};
+
+#ifdef XMLC_THREADS
+#define CACHE_LOCK(cache) pthread_mutex_lock(&(cache)->lock);
+#define CACHE_UNLOCK(cache) pthread_mutex_unlock(&(cache)->lock);
+#else
+#define CACHE_LOCK(cache)
+#define CACHE_UNLOCK(cache)
+#endif
 
-/* Create an entity */
-xml_node * create_entity(char * name) {
-   xml_node * n = (xml_node *)malloc(sizeof(xml_node));
+#define CACHE_INITIAL_BUCKETS 64
 
-   if(n) {
-	   n->sibling = n->child = NULL;
-       n->text = NULL;
-   	   if(name) {
-	      n->name = malloc(strlen(name) + 1);
-	      strcpy(n->name, name); 
-	   } else {
-		  n->name = NULL;
-	   }
-	   n->type = ENTITY;
-       n->parent = NULL;
-   }
+/* Create a cache holding at most budget bytes of documents */
+xml_cache * xml_cache_create(size_t budget, config_t config) {
+    xml_cache * cache = (xml_cache *)xml_calloc(1, sizeof(xml_cache));
 
-   return n;
-}
+    if(cache) {
+        cache->buckets = (cache_entry **)xml_calloc(CACHE_INITIAL_BUCKETS, 
+                                                sizeof(cache_entry *));
+        if(!cache->buckets) {
+            xml_free(cache);
+            return NULL;
+        }
 
-/* INTERNAL */
-xml_node * create_splnode(xml_type type, char * text) {
-   xml_node * n = (xml_node *)malloc(sizeof(xml_node));
+#ifdef XMLC_THREADS
+        if(pthread_mutex_init(&cache->lock, NULL)) {
+            xml_free(cache->buckets);
+            xml_free(cache);
+            return NULL;
+        }
+#endif
 
-   if(n) {
-	   n->sibling = n->child = NULL;
-	   n->text = process_text(text);
-       n->name = NULL;
-	   n->type = type;
-       n->parent = NULL;
-   }
+        cache->nbuckets = CACHE_INITIAL_BUCKETS;
+        cache->config = config;
+        cache->stats.budget = budget;
+    }
 
-   return n;
+    return cache;
 }
 
+/* INTERNAL */
+static void cache_unlink(xml_cache * cache, cache_entry * entry) {
+    cache_entry ** pp = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
 
-/* Use this to create an element node */
-xml_element * create_element(char * name) {
-    
-   xml_element * e = (xml_element *)malloc(sizeof(xml_element));
-   if(e) {
-	   e->sibling = e->child = NULL;
-	   e->text = NULL;
-	   e->attributes = NULL;
-       e->parent = NULL;
-       
-	   e->type = ELEMENT;
-
-	   if(name) {
-	      e->name = malloc(strlen(name) + 1);
-	      strcpy(e->name, name); 
-	   }
-   }
+    while(*pp != entry) {
+        pp = &(*pp)->chain;
+    }
+    *pp = entry->chain;
 
-   return e;
-}
+    if(entry->prev) entry->prev->next = entry->next;
+    else cache->head = entry->next;
 
+    if(entry->next) entry->next->prev = entry->prev;
+    else cache->tail = entry->prev;
 
-/* Use this to select a set of nodes using a given xpath.
-   pcount --> should point to an int that will hold the count of nodes returned
-   xpathstr --> is XPath.
-   Note that only a limited XPath syntax( very common one) is supported and tested! 
-*/
-xml_node** select_nodes(xml_node* current, 
-                        int *pcount, 
-                        char * xpathstr) {
-    char * p;
-    char * q; 
-    xml_node **nodearr;
+    cache->stats.entries--;
+    cache->stats.bytes -= entry->cost;
+}
 
-    int count  = 1;
-    char *xpath = NULL;
+/* INTERNAL - the tree lives on with whoever still holds it */
+static void cache_free_entry(cache_entry * entry) {
+    xml_release(entry->document);
+    xml_free(entry->bytes);
+    xml_free(entry);
+}
 
-    if(xpathstr == NULL) {
-       return NULL;
-    }
+/* INTERNAL */
+static void cache_grow(xml_cache * cache) {
+    unsigned long n = cache->nbuckets * 2;
+    unsigned long i;
+    cache_entry ** buckets = (cache_entry **)xml_calloc(n, sizeof(cache_entry *));
 
-    xpath = malloc(strlen(xpathstr) + 1);
-    strcpy(xpath, xpathstr);
-    q = xpath;
-    
-    if(*q == '/') {
-       xml_node * c = current;
-       while(c) {
-             current = c;
-             c = c->parent;
-       }
-       q++;
+    if(!buckets) {
+        return; /* longer chains, still correct */
     }
 
-    nodearr = malloc(sizeof(xml_node *));
-    nodearr[0] = current;
-    
-    for(;q && *q;) {
-        xml_node **tmparr;
-        p = strchr(q, '/');
-
-        if(p) {
-          *p = 0;
-        }
-
-        tmparr = select(nodearr, &count, q);
-        if(tmparr) {
-            free(nodearr);
-            nodearr = tmparr;
+    for(i = 0; i < cache->nbuckets; i++) {
+        cache_entry * entry = cache->buckets[i];
 
+        while(entry) {
+            cache_entry * chain = entry->chain;
+            entry->chain = buckets[entry->hash & (n - 1)];
+            buckets[entry->hash & (n - 1)] = entry;
+            entry = chain;
         }
-        q = p ? p + 1 : NULL;
     }
 
-    *pcount = count;
-    free(xpath);
-    return nodearr;
+    xml_free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = n;
 }
 
-/* Returns an attribute's value given the key and a node */
-char * get_attribute(xml_node * node, 
-                     char * name) {
-    if(node && name) {
-        xml_attribute * attrib = node->attributes;
-        while(attrib) {
-            if(!strcmp(attrib->name, name)) {
-               return attrib->value;  
-            }
-            attrib = attrib->next;
+/* INTERNAL - the entry for len bytes of buf, NULL for none */
+static cache_entry * cache_find(xml_cache * cache, uint64_t hash,
+                                const char * buf, int len) {
+    cache_entry * entry;
+
+    for(entry = cache->buckets[hash & (cache->nbuckets - 1)]; 
+        entry; 
+        entry = entry->chain) {
+
+        if(entry->hash == hash && entry->len == len &&
+           memcmp(entry->bytes, buf, len) == 0) {
+            return entry;
         }
     }
 
     return NULL;
 }
 
-/* Returns an attribute's value given an xpath */
-char * get_attrib_value(xml_node * current, 
-                        char *xpath) {
-   int count;
-   xml_node ** nodes = select_nodes(current, &count, xpath);
-   if(count > 0) {
-       char * at = strchr(xpath, '@');
-       if(at && *(at+1)) {
-          return get_attribute(nodes[0], at + 1);
-       }
-   }
-
-   return NULL;
-}
+/* Use this to parse through the cache. buf is copied, not kept */
+int xml_cache_parse_buffer(xml_cache * cache, char * buf, int len,
+                           xml_element ** root) {
+    uint64_t hash;
+    cache_entry * entry;
+    int ret;
 
-/*
- * INTERNAL
- * Selects a node given an partial path ( not XPath)
- * 
- */
-xml_node** select(xml_node ** current, 
-                  int *pcount, 
-                  char * path) {
-    xml_node **nodearr = NULL;
-    int maxindex = 0;
-    int index = 0;
-    int j = 0;
-    xml_node * node;
+    *root = NULL;
+    if(!cache) {
+        return NOMEMORY;
+    }
 
-    /* pcount is input and output */
-    int nodecount = *pcount;
+    hash = hash_bytes(buf, len, 0);
+
+    CACHE_LOCK(cache)
+    entry = cache_find(cache, hash, buf, len);
+    if(entry) {
+        /* move to the front of the LRU list */
+        if(entry != cache->head) {
+            entry->prev->next = entry->next;
+            if(entry->next) entry->next->prev = entry->prev;
+            else cache->tail = entry->prev;
+
+            entry->prev = NULL;
+            entry->next = cache->head;
+            cache->head->prev = entry;
+            cache->head = entry;
+        }
 
-    if(!current || !path) {
-        *pcount = 0;
-        return current;
+        cache->stats.hits++;
+        COUNT_ADD(entry->document->refcount, 1);
+        *root = entry->document;
+        CACHE_UNLOCK(cache)
+        return 0;
     }
 
-    if(path[0] == '@') { /* attribute */
-          /* one should search for attributes in the nodes themselves */
-          xml_node * snode = NULL;
-          char * p = &path[1];
-          char * name, *value = NULL;
-          parse_name_value(p, &name, &value);
-
-          for(j = 0; j < nodecount; j++) {
-            node = current[j];
+    cache->stats.misses++;
+    CACHE_UNLOCK(cache)
 
-            if(find_attribute(node, name, value)) {
-               if(index == maxindex) {
-                 xml_node** tmparr = realloc(nodearr, (maxindex + 5) * sizeof(xml_node *));
-                 if(!tmparr) {
-                       /* Warn for memory error */
-                      return nodearr;
-                 }
+    /* parsed unlocked, other documents go on being looked up meanwhile */
+    ret = parse_buffer(buf, len, root, cache->config);
+    if(ret < 0 || *root == NULL) {
+        return ret;
+    }
 
-                 nodearr = tmparr;
-                 maxindex += 4;
-               }
+    /* the caller's reference */
+    (*root)->refcount = 1;
 
-               nodearr[index++] = node;
-            }
-          }
+    entry = (cache_entry *)xml_calloc(1, sizeof(cache_entry));
+    if(!entry) {
+        return ret;
+    }
 
-          if(name) free(name);
-          if(value) free(value);
+    entry->bytes = (char *)xml_malloc(len > 0 ? len : 1);
+    if(!entry->bytes) {
+        xml_free(entry);
+        return ret;
+    }
 
-    } else {
-        for(j = 0; j < nodecount; j++) {
-            node = current[j]->child;
+    memcpy(entry->bytes, buf, len);
+    entry->len = len;
+    entry->hash = hash;
+    entry->document = *root;
+    entry->cost = sizeof(cache_entry) + len + tree_size(*root);
+
+    if(entry->cost > cache->stats.budget) {
+        /* would evict everything else and still not fit */
+        xml_free(entry->bytes);
+        xml_free(entry);
+        return ret;
+    }
 
-            while(node) {
-               int flag = !strcmp(node->name, path);
-               if(!flag) {
-                   char * col = strchr(node->name, ':');
-                   if(col && *(col + 1)) {
-                      flag = !strcmp(col+1, path);
-                   }
-               }
+    /* holders only read a shared tree, xml_hash included: its hashes
+       are kept before anyone else sees it */
+    xml_hash(*root);
 
-               if(flag) {
-                  if(index == maxindex) {
-                    xml_node** tmparr = realloc(nodearr, (maxindex + 5) * sizeof(xml_node *));
-                    if(!tmparr) {
-                       /* Warn for memory error */
-                       return nodearr;
-                    }
+    CACHE_LOCK(cache)
 
-                    nodearr = tmparr;
-                    maxindex += 4;
-                  }
+    /* another thread may have cached the same document meanwhile, the
+       caller keeps this one to itself */
+    if(cache_find(cache, hash, entry->bytes, len)) {
+        CACHE_UNLOCK(cache)
+        xml_free(entry->bytes);
+        xml_free(entry);
+        return ret;
+    }
 
-                  nodearr[index++] = node;
-               }
+    /* evict least recently used documents to make room */
+    while(cache->tail && 
+          cache->stats.bytes + entry->cost > cache->stats.budget) {
+        cache_entry * victim = cache->tail;
+        cache_unlink(cache, victim);
+        cache_free_entry(victim);
+        cache->stats.evictions++;
+    }
 
-               node = node->sibling;
-            }
-        }
+    if(cache->stats.entries >= cache->nbuckets) {
+        cache_grow(cache);
     }
 
-    *pcount = index;
-    return nodearr;
-}
+    /* the cache's reference */
+    COUNT_ADD(entry->document->refcount, 1);
 
-void parse_name_value(char *p, 
-                      char** name, 
-                      char** value) {
-    char * q = strchr(p, '=');
-    *value = *name = NULL;
-    if( q && *(q + 1) &&(*p != *q) ) {
-        *q = 0;
-        *value = (char *)malloc(strlen(q + 1) + 1);
-        strcpy(*value, q + 1);
-    }
+    entry->chain = cache->buckets[hash & (cache->nbuckets - 1)];
+    cache->buckets[hash & (cache->nbuckets - 1)] = entry;
 
-    *name = (char *)malloc(strlen(p) + 1);
-    strcpy(*name, p);
+    entry->next = cache->head;
+    if(cache->head) cache->head->prev = entry;
+    else cache->tail = entry;
+    cache->head = entry;
+
+    cache->stats.entries++;
+    cache->stats.bytes += entry->cost;
+    CACHE_UNLOCK(cache)
+
+    return ret;
 }
 
-xml_attribute * find_attribute(xml_node * node,
-                               char * name , 
-                               char * value) {
+/* Use this to parse a file through the cache */
+int xml_cache_parse(xml_cache * cache, void * fp, xml_element ** root) {
+    FILE * file = (FILE *)fp;
+    char * buf = NULL;
+    int size = 0;
+    int len = 0;
+    int ret;
 
-    if(node != NULL) {
-        xml_attribute * attrib = node->attributes;
+    *root = NULL;
 
-        while(attrib) {
-            if(name && !strcmp(attrib->name, name)) {
-                if(value) {
-                  if(!strcmp(attrib->value, value))
-                      return attrib; 
-                } else {
-                   return attrib;
-                }
+    for(;;) {
+        int n;
+
+        if(len == size) {
+            char * p = (char *)xml_realloc(buf, size ? size * 2 : BUFFER_SIZE * 8);
+            if(!p) {
+                xml_free(buf);
+                return NOMEMORY;
             }
+            buf = p;
+            size = size ? size * 2 : BUFFER_SIZE * 8;
+        }
 
-            attrib = attrib->next;
+        n = file_read(file, &buf[len], size - len);
+        if(n < 0) {
+            xml_free(buf);
+            return FILEERROR;
         }
-    }
 
-    return NULL;
-}
+        if(n == 0) {
+            break;
+        }
 
+        len += n;
+    }
 
-char * get_text(xml_node * current) {
-    if(current && current->type == ELEMENT) {
-        xml_node *node = current->child;
+    ret = xml_cache_parse_buffer(cache, buf, len, root);
+    xml_free(buf);
 
-        while(node && node->type != TEXT) {
-           node = node->sibling;
-        }
+    return ret;
+}
 
-        if(node) {
-           return node->text;
-        }
+/* Use this to read the hit/miss counters */
+void xml_cache_get_stats(xml_cache * cache, xml_cache_stats * stats) {
+    if(cache && stats) {
+        CACHE_LOCK(cache)
+        *stats = cache->stats;
+        CACHE_UNLOCK(cache)
     }
-
-    return NULL;
 }
 
+/* Drops the cache's references. Trees still held elsewhere stay valid */
+void xml_cache_destroy(xml_cache * cache) {
+    if(cache) {
+        cache_entry * entry = cache->head;
 
+        while(entry) {
+            cache_entry * next = entry->next;
+            cache_free_entry(entry);
+            entry = next;
+        }
 
+#ifdef XMLC_THREADS
+        pthread_mutex_destroy(&cache->lock);
+#endif
+        xml_free(cache->buckets);
+        xml_free(cache);
+    }
+}
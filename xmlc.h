@@ -1,6 +1,10 @@
 #ifndef _xml_c_
 #define _xml_c_
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
 /**
  *
  *  XML Parser/Generator structural Definitions
@@ -23,10 +27,15 @@ typedef enum xml_type_t {
 	PI
 } xml_type;
 
-/* Clean up related */
+/* Clean up related. Set in flags when a node owns its name/text (an
+   attribute its name/value) and destroy_node should free them. Trees
+   from parse_inplace point into the caller's buffer and leave them clear */
 enum {
 	FREENAME = 0x0001,
-    FREETEXT = 0x0002
+    FREETEXT = 0x0002,
+	INARENA  = 0x0004,   /* part of an xml_clone block, freed with its root */
+	SHARED   = 0x0008,   /* children borrowed from origin, see xml_share */
+	HOLDSREF = 0x0010    /* holds a reference on origin, see xml_share */
 };
 
 /* XML Attribute */
@@ -35,9 +44,17 @@ typedef struct xml_attribute_t {
 
   char *name;
   char *value;
+  int flags;      /* FREENAME, FREETEXT for the value */
+
+  /* config.namespaces, interned: see xml_intern. ns NULL for none */
+  const char * ns;
+  const char * localname;
  
 } xml_attribute;
 
+/* Secondary index of a tree, see xml_index_build */
+typedef struct xml_index_t xml_index;
+
 /* Our Node */
 typedef struct xml_node_t {
    struct xml_node_t * sibling;
@@ -49,6 +66,24 @@ typedef struct xml_node_t {
    char * text;
 
    xml_attribute* attributes;
+
+   int flags;      /* FREENAME, FREETEXT */
+   int refcount;   /* > 0 for shared (cached) documents, see xml_release */
+
+   /* elements with config.namespaces, interned: see xml_intern */
+   const char * ns;         /* namespace URI, NULL for none */
+   const char * localname;  /* name without its prefix */
+
+   /* elements, where their markup starts relative to the parent element
+      (the document for the root) and its bytes. See parse_edit */
+   int offset;
+   int length;
+
+   uint64_t hash;  /* kept subtree hash, 0 for none. See xml_hash */
+
+   struct xml_node_t * origin;  /* copy on write, the node copied */
+
+   xml_index * index;  /* top nodes, names and attribute values indexed */
    
 } xml_node;
 
@@ -57,39 +92,186 @@ typedef struct xml_node_t xml_element;
 
 /* Affects parse buffering */
 #define BUFFER_SIZE  2048
-#define HALF_SIZE 1024
-#define ERROR_BUFFER_SIZE 80
+#define HALF_SIZE 1024                /* unget_c lookback the window keeps */
+#define READ_SIZE (64 * 1024)         /* minimum read from the source */
+#define READAHEAD_SIZE (1024 * 1024)  /* parse_readahead, bytes a buffer */
+#define READAHEAD_COUNT 4             /* parse_readahead, buffers */
+#define WRITE_SIZE (64 * 1024)        /* xml_writer, output buffered */
+#define ERROR_BUFFER_SIZE 80          /* xml_error message */
 
 #define RAISE_ERROR(c,c1,s,t,a) \
- if(c < 0 && c != -19) { return raise_error(c1, location(s), t, a); }
+ if(c < 0 && c != ENDOFFILE) { return raise_error(s, LIMIT_ERROR(c) ? c : c1, t, a); }
 
-// Error codes
-#define ENDOFFILE  -19
+/* memory or a config limit ran out, RAISE_ERROR passes these on as is */
+#define LIMIT_ERROR(c) ((c) == NOMEMORY || (c) == ENTITYLIMIT || \
+                        ((c) <= DEPTHLIMIT && (c) >= MEMORYLIMIT))
+
+// Error codes, see xml_strerror
+#define INCOMPLETETAG -1   /* input ends in the middle of a tag */
+#define COMMENTERROR -4    /* comment not ended */
+#define MARKUPERROR -5     /* malformed DOCTYPE, declaration, PI or CDATA */
+#define CDATAERROR -8      /* CDATA section not ended */
+#define TEXTERROR -10      /* text or comment runs into the end of input */
+#define NOMEMORY -11       /* out of memory */
+#define ELEMENTERROR -12   /* malformed start tag */
+#define NAMEERROR -13      /* no element name, or start tag not ended */
+#define ATTRIBUTEERROR -14 /* malformed attribute */
+#define NOENDTAG -16       /* input ends before an element's end tag */
+#define ENDTAGERROR -17    /* malformed end tag */
 #define FILEERROR  -18
+#define ENDOFFILE  -19
+#define ENDTAGMISMATCH -22 /* end tag of another element */
+#define READERROR -23      /* reading the input failed */
+#define ENTITYERROR -31    /* malformed entity declaration */
+#define ENTITYLIMIT -34    /* entity expansion too deep or too big */
+#define ENCODINGERROR -35  /* malformed UTF-8 (validate_utf8) or UTF-16 */
+#define NAMESPACEERROR -36 /* prefix not bound (namespaces) */
+#define PATCHERROR -37     /* edit script does not fit the tree */
+#define XPATHERROR -38     /* xpath has too many steps for an iterator */
+#define COMPRESSERROR -39  /* corrupt gzip/zstd input, or support not built */
+#define WRITEERROR -40     /* write callback failed, or xw_ calls out of order */
+#define DEPTHLIMIT -41     /* elements nested deeper than config.max_depth */
+#define NODELIMIT -42      /* more nodes than config.max_nodes */
+#define ATTRIBUTELIMIT -43 /* more attributes than config.max_attributes */
+#define NAMELIMIT -44      /* name longer than config.max_name */
+#define TEXTLIMIT -45      /* text or value longer than config.max_text */
+#define MEMORYLIMIT -46    /* the parse allocated more than config.max_bytes */
+
+#ifdef XMLC_STATS
+/* Parser instrumentation, only compiled in with XMLC_STATS.
+   Point config.stats at one of these and parse() fills it in. */
+typedef struct xml_stats_t {
+  unsigned long bytes_read;
+  unsigned long refills;          /* reads from the source */
+  unsigned long ungets;           /* unget_c calls */
+  unsigned long nodes[PI + 1];    /* nodes created, by xml_type */
+  unsigned long attributes;
+  unsigned long bytes_allocated;
+  int peak_depth;                 /* deepest element nesting */
+  unsigned long skipped;          /* elements left out, config.skip */
+
+  /* nanoseconds spent in each phase, they add up to the whole parse */
+  double tokenize_ns;
+  double process_text_ns;
+  double tree_ns;                 /* creating and linking nodes */
+} xml_stats;
+#endif
+
+/* Called with each record as it is read, see config.record. ctx is
+   config.recordctx. Return < 0 to stop the parse with that code */
+typedef int (*pfn_record)(void * ctx, xml_node * record);
+
+/* Where and why a parse failed, see config.error. Positions are in the
+   input as parsed: UTF-8 after any transcoding or decompression */
+typedef struct xml_error_t {
+  int code;                         /* 0, or the error parse returned */
+  long offset;                      /* bytes read when it was found */
+  int line;                         /* from 1 */
+  int column;                       /* bytes into the line, from 1 */
+  char message[ERROR_BUFFER_SIZE];  /* for people, with the element */
+} xml_error;
 
 /* For configuring the parser */
 typedef struct config_t {
-  /* only flag supported */
   int parsecomment;   /* 1 => parse comments and make comment nodes */
+  int validate_utf8;  /* 1 => fail on input that is not well formed UTF-8 */
+  int namespaces;     /* 1 => resolve prefixes, fill in ns and localname */
+  /* NULL terminated element names, or /paths from the root, whose
+     elements are skipped with all their content. NULL => none */
+  const char ** skip;
+  /* NULL terminated attribute names to index after parsing, along with
+     element names; see xml_index_build. NULL => no index */
+  const char ** index;
+  /* element name, or /path from the root, of the records of a document
+     too big to hold: each is handed to on_record once read, then freed.
+     NULL => none */
+  const char * record;
+  pfn_record on_record;
+  void * recordctx;
+  /* filled in when a parse fails, NULL => not reported. Nothing is
+     ever printed */
+  xml_error * error;
+  /* entity expansion limits, 0 => defaults (16 levels, 8 MB) */
+  int max_entity_depth;
+  unsigned long max_entity_bytes;   /* all expansion in a document */
+  /* limits for untrusted input, 0 => none. Each fails the parse with its
+     own code as soon as it is passed */
+  int max_depth;                /* element nesting */
+  unsigned long max_nodes;      /* nodes made, attributes aside */
+  int max_attributes;           /* on one element */
+  int max_name;                 /* bytes in an element or attribute name */
+  unsigned long max_text;       /* bytes in a text, CDATA, comment, PI,
+                                   DOCTYPE or attribute value */
+  unsigned long max_bytes;      /* allocated by the parse in all */
+#ifdef XMLC_STATS
+  xml_stats * stats;  /* NULL => no stats collected */
+#endif
 #ifdef DEBUG
   int nodeflush;  /* set to 1 */
   void * fp;      /* pointer to file to write nodes to , while parsing */
 #endif
 } config_t;
 
+/* Reads up to len bytes into buf. Returns bytes read, 0 at end, < 0 on error */
+typedef int (*pfn_read)(void * ctx, char * buf, int len);
+
+/* The parse window. buf holds the unread input plus everything from
+   mark (the start of the token being read) on, see stream_fill */
 typedef struct stream_t {
-	int length;
-    int runlength;
+	int length;       /* bytes in buf */
+    int runlength;    /* read position */
 	char * buf;
-	FILE * fp;
-	int activezone;
-	int lastactivezone;
+	int size;         /* capacity of buf */
+	int mark;         /* -1 when no token is being held */
+	int eof;          /* source exhausted */
+	int overrun;      /* get_c calls made at end of input */
+	pfn_read read;
+	void * readctx;
+	int base;         /* input bytes dropped from before buf */
 	config_t config;
+	int inplace;      /* parse_inplace, tokens are terminated inside buf */
+	int pending;      /* in place, where a text still needs its NUL or -1 */
+	int utf8;         /* validate_utf8 state between reads */
+	int invalid;      /* the input is not well formed */
+	void * utf16;     /* transcoding source, see stream_bom */
+	void * inflate;   /* decompressing source, see stream_inflate */
+	int corrupt;      /* the compressed input is corrupt or truncated */
+	struct entity_table_t * entities;  /* declared in the DOCTYPE, see
+	                                      declare_entities */
+	struct ns_binding_t * ns;  /* namespaces, prefixes bound in scope */
+	int nscount;
+	int nssize;
+	char * path;      /* config.skip by path, path of the current element */
+	int pathlen;
+	int pathsize;
+	int inrecord;     /* config.record, inside a record element */
+	long lines;       /* config.error, newlines dropped from before buf */
+	long linestart;   /* ... and where the line after the last began */
+	int raised;       /* config.error has been filled in */
+	int depth;        /* elements open */
+	int attributes;   /* config.max_attributes, on the element being read */
+	int valueat;      /* config.max_text, where after mark a value starts */
+	unsigned long nodes;  /* config.max_nodes, made so far */
+	unsigned long bytes;  /* config.max_bytes, allocated so far */
+	int limited;      /* the limit reached, 0 for none */
+#ifdef XMLC_STATS
+	int phase;        /* config.stats, what time is charged to */
+	double phasestart;  /* ... and since when */
+#endif
 } stream_t;
 
 typedef int (*pfn_end_token)(stream_t * stream);
 
 
+/* Allocator, see xml_set_allocator. ctx is passed back on every call */
+typedef struct xml_allocator_t {
+  void * (*malloc_fn)(void * ctx, size_t size);
+  void * (*realloc_fn)(void * ctx, void * ptr, size_t size);
+  void   (*free_fn)(void * ctx, void * ptr);
+  void * ctx;
+} xml_allocator;
+
+
 /* Function declarations */
 
 /* use default config and parse */
@@ -98,12 +280,30 @@ int parsexml(void * fp, xml_element ** root);
 /* use passed in config */
 int parse(void * fp, xml_element ** root, config_t config);
 
+/* parse a file read ahead on a thread, see parse_readahead */
+int parse_readahead(void * fp, xml_element ** root, config_t config);
+
+/* parse from an in-memory buffer of len bytes, read in place */
+int parse_buffer(char * buf, int len, xml_element ** root, config_t config);
+
+/* parse a buffer the tree may keep, destructively. See parse_inplace */
+int parse_inplace(char * buf, int len, xml_element ** root, config_t config);
+
+/* parse from any source, see pfn_read */
+int parse_source(pfn_read read, void * ctx, xml_element ** root, config_t config);
+
+/* update a tree parsed from buf after an edit, see parse_edit */
+int parse_edit(xml_element ** root, char * buf, int len, int start,
+               int removed, int inserted, config_t config);
+
 /* mostly private, not for public use */
 int parse_node(stream_t* stream, xml_node* parent);
 int scan_comment(stream_t * stream);
 int parse_attributes(stream_t * stream, xml_element * elt,
 					 int * pchild);
-int parse_attr(char * q, xml_element * elt);
+int parse_attr(stream_t * stream, xml_element * elt, char * name,
+               int namelen, char * value, int len);
+int ns_resolve(stream_t * stream, xml_element * elt);
 int parse_element(stream_t * stream, xml_element * parent);
 int parse_cdata(stream_t * stream, xml_node * parent);
 int parse_text(stream_t * stream,  xml_element * parent);
@@ -112,6 +312,7 @@ int parse_entity(stream_t * stream, xml_node * parent);
 int parse_PI(stream_t * stream, xml_node * parent);
 
 /* creation */
+xml_node * new_node(xml_type type);
 xml_element * create_element(char * name);
 xml_node * create_text(char * text);
 xml_node * create_document();
@@ -127,8 +328,33 @@ void add_attribute(xml_element * element,
 
 /* utilities */
 void print(xml_node * node, void *fp, int depth);
+const char * xml_strerror(int code);
+
+/* Streaming writer, XML written as it is made, see xw_create.
+   pfn_write is given len bytes of output, returns < 0 on failure */
+typedef int (*pfn_write)(void * ctx, const char * buf, int len);
+typedef struct xml_writer_t xml_writer;
+
+xml_writer * xw_create(pfn_write write, void * ctx);
+int xw_start_element(xml_writer * w, const char * name);
+int xw_attribute(xml_writer * w, const char * name, const char * value);
+int xw_text(xml_writer * w, const char * text);
+int xw_raw(xml_writer * w, const char * text, int len);
+int xw_end_element(xml_writer * w);
+int xw_flush(xml_writer * w);
+int xw_close(xml_writer * w);
+int file_write(void * fp, const char * buf, int len);
+
+/* allocation - all library memory comes from the installed allocator */
+void xml_set_allocator(const xml_allocator * allocator);
+void xml_get_allocator(xml_allocator * allocator);
+void * xml_malloc(size_t size);
+void * xml_calloc(size_t count, size_t size);
+void * xml_realloc(void * ptr, size_t size);
+void xml_free(void * ptr);
 
 /* clean up */
+void destroy_node(xml_node * node);
 void destroy_element(xml_element * e);
 void remove_attribute(xml_element * element,
     			      char * name);
@@ -136,21 +362,171 @@ void  add_childorsibling(xml_node * parent, xml_node * childorsibling);
 xml_node * remove_childorsibiling(xml_node * parent, 
                                   xml_node * childorsibling);
 
+/* Parsed document cache.
+   Documents are keyed by a 64 bit hash of their bytes. A hit returns the
+   cached tree, shared with every other holder. Shared trees are read-only,
+   give them back with xml_release rather than destroy_node. Least recently
+   used documents are evicted once the budget (in bytes) is exceeded.
+   Built with POSIX threads (XMLC_THREADS) a cache, and the trees it hands
+   out, may be used from any thread; xml_hash and the config.index lookups
+   only read a shared tree. Every miss parses with the cache's config, so
+   what it points at is shared by misses on different threads: leave
+   config.error and config.stats NULL, and give any callbacks state of
+   their own, for such a cache. config.namespaces is fine (the intern
+   table is locked) as long as xml_intern_reset waits for the cache to
+   be destroyed. Without XMLC_THREADS, a cache is for one thread.
+ */
+typedef struct xml_cache_t xml_cache;
+
+typedef struct xml_cache_stats_t {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long entries;  /* documents currently cached */
+  size_t bytes;           /* bytes charged against the budget */
+  size_t budget;
+} xml_cache_stats;
+
+xml_cache * xml_cache_create(size_t budget, config_t config);
+void xml_cache_destroy(xml_cache * cache);
+int xml_cache_parse(xml_cache * cache, void * fp, xml_element ** root);
+int xml_cache_parse_buffer(xml_cache * cache, char * buf, int len,
+                           xml_element ** root);
+void xml_cache_get_stats(xml_cache * cache, xml_cache_stats * stats);
+void xml_release(xml_node * node);
+
+/* Copies. xml_clone copies into one block, xml_share is copy on write */
+xml_node * xml_clone(xml_node * node);
+xml_node * xml_share(xml_node * template);
+xml_node * xml_unshare(xml_node * root, xml_node * node);
+
+/* Secondary indexes, lookups by element name or attribute value */
+int xml_index_build(xml_node * node, const char ** attrs);
+void xml_index_drop(xml_node * node);
+xml_node * xml_lookup(xml_node * node, const char * name, const char * value);
+xml_node ** xml_lookup_all(xml_node * node, const char * name,
+                           const char * value, int * pcount);
+
+/* Deep equality and subtree hashes, kept in the nodes */
+uint64_t xml_hash(xml_node * node);
+int xml_equal(xml_node * a, xml_node * b);
+void xml_touch(xml_node * node);
+
+/* Tree diff. xml_diff makes an edit script, itself a tree, that
+   xml_patch applies. See xml_diff for the ops */
+xml_node * xml_diff(xml_node * a, xml_node * b);
+int xml_patch(xml_node * root, xml_node * diff);
+
+/* One step of an xpath, see xpath_iter */
+typedef struct xpath_step_t {
+   const char * name;       /* the step, or for @ the attribute name */
+   int len;
+   const char * value;      /* @name=value, NULL for none */
+   int valuelen;
+   int attr;                /* 1 => @ step, filters the node so far */
+   int clark;               /* {uri}local */
+   int prefixed;            /* prefix:local */
+   const char * ns;         /* interned, for trees parsed with namespaces */
+   const char * local;
+} xpath_step;
+
+/* Affects xpath iterators */
+#define XPATH_MAX_STEPS 32
+
+/* Goes through what an xpath selects without allocating, see
+   xpath_iter_init */
+typedef struct xpath_iter_t {
+   xml_node * start;
+   xml_node * at[XPATH_MAX_STEPS];     /* the node each step is on */
+   xpath_step step[XPATH_MAX_STEPS];
+   int steps;
+   int level;                          /* step to move on, -1 at the end */
+} xpath_iter;
+
 /* XPaths & normalization */
 xml_node** select_nodes(xml_node* current, int *pcount, char * xpath);
+int xpath_iter_init(xpath_iter * it, xml_node * current, const char * xpath);
+xml_node * xpath_iter_next(xpath_iter * it);
+int select_nodes_into(xml_node * current, const char * xpath,
+                      xml_node ** nodes, int size);
+
+/* Many xpaths evaluated in one pass, see xpath_batch_compile */
+typedef struct xpath_batch_t xpath_batch;
+
+xpath_batch * xpath_batch_compile(const char ** paths, int count);
+int xpath_batch_run(xpath_batch * batch, xml_node * node, xml_node ** first,
+                    int * counts);
+void xpath_batch_free(xpath_batch * batch);
+
 char * get_attrib_value(xml_node * current, char *xpath);
 xml_attribute * find_attribute(xml_node * node, char * name , char * value);
+char * get_attribute(xml_node * node, char * name);
+xml_attribute * find_attribute_ns(xml_node * node, const char * ns,
+                                  const char * localname);
+
+/* Namespaces. Names are interned: equal strings share one copy, so
+   nodes parsed with config.namespaces compare ns and localname by
+   pointer. Look names up with xml_intern to compare against them.
+   The table is locked, any thread may intern; xml_intern_reset frees it
+   and must run alone, with no namespace aware tree left */
+const char * xml_intern(const char * s);
+void xml_intern_reset(void);
 void normalize(xml_node * node);
 
 
 /* Privates - usage strongly discouraged */
 char * process_spl_chars(char * value) ;
-int read_text(stream_t * stream, int endchar, pfn_end_token is_endtoken, char ** ptext);
-char * location(stream_t * stream);
+char * process_text(char * value);
+char * escape_text(const char * value, int len);
+char * expand_text(const char * value, int len);
+int escape_inplace(char * value, int len);
+int read_text(stream_t * stream, int endchar, pfn_end_token is_endtoken,
+              int escape, char ** ptext);
+int slice_text(stream_t * stream, int len, int endchar, int escape,
+               char ** ptext);
+int read_doctype(stream_t * stream, char ** ptext);
+void declare_entities(stream_t * stream, const char * p, int len);
+int parse_stream(stream_t * stream, xml_element ** root);
+int stream_fill(stream_t * stream);
+int stream_scan(stream_t * stream, int ch);
+void stream_settle(stream_t * stream);
+int stream_bom(stream_t * stream);
+int utf8_validate(int state, const char * text, int len);
+int utf16_bom(const char * buf, int len);
+char * utf16_decode(const char * buf, int len, int * plen);
+int utf16_read(void * ctx, char * buf, int len);
+void utf16_free(void * source);
+int compress_magic(const char * buf, int len);
+int stream_inflate(stream_t * stream);
+int inflate_read(void * ctx, char * buf, int len);
+void inflate_free(void * source);
+xml_node * new_textnode(stream_t * stream, xml_type type, char * text,
+                        int owned);
+xml_node * new_named(stream_t * stream, xml_type type, char * name, int len);
+xml_attribute * new_attribute_at(stream_t * stream, char * name, int namelen,
+                                 char * value, int len);
+int raise_error(stream_t * stream, int code, const char * error,
+                const char * arg);
+void error_position(stream_t * stream, xml_error * error);
 xml_node** select(xml_node ** current, int *pcount, char * path);
 void parse_name_value(char *p, char**name, char ** value);
 int skip_whitespaces(stream_t * stream);
+int skip_match(stream_t * stream, const char * name, int len);
+int skip_element(stream_t * stream, int c, int child);
+int path_push(stream_t * stream, const char * name, int len);
+int file_read(void * fp, char * buf, int len);
+uint64_t hash_bytes(const void * data, size_t len, uint64_t seed);
+size_t tree_size(xml_node * node);
+int unshare_children(xml_node * node);
+xml_index * index_of(xml_node * node);
+void index_tree(xml_index * ix, xml_node * node, int add);
+void index_attribute(xml_index * ix, xml_node * node, xml_attribute * a,
+                     int add);
+void index_rename(xml_index * ix, xml_node * from, xml_node * to);
+int index_like(xml_node * to, xml_node * from);
+int select_indexed(xml_node * top, const char * path, xml_node ** pnode);
+const char * intern(stream_t * stream, const char * s, int len, int insert);
 /* privates  */
 
 
-#endif /*_xml_c */
\ No newline at end of file
+#endif /*_xml_c */